@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Compare interpreter binaries on 'bench/*.sk' programs.
+# Each program is run RUNS times per binary, best wall time is reported.
+
+USAGE="USAGE: bench.sh <skooma> [<skooma>...]"
+RUNS=${RUNS:-5}
+
+if [ $# -eq 0 ]
+then
+    echo "$USAGE"
+    exit 1
+fi
+
+best()
+{
+    local TIMEFORMAT="%R"
+    for ((i = 0; i < RUNS; i++))
+    do
+        { time "$1" "$2" > /dev/null 2>&1; } 2>&1
+    done | sort -n | head -n 1
+}
+
+printf "%-16s" "benchmark"
+for bin in "$@"; do printf "%16s" "$(basename "$bin")"; done
+printf "\n"
+for benchfile in bench/*.sk
+do
+    printf "%-16s" "$(basename "$benchfile" .sk)"
+    for bin in "$@"; do printf "%16s" "$(best "$bin" "$benchfile")"; done
+    printf "\n"
+done
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Rank executed opcode pairs over a corpus of scripts.
+# The interpreter must be built with 'S_OPCODE_PAIRS' defined (skconf.h),
+# it dumps 'count previous current' lines when the VM is freed.
+# Pairs at the top are candidates for superinstructions.
+
+USAGE="USAGE: bench/oppairs.sh <skooma> [top] [script.sk...]"
+
+if [ $# -eq 0 ]
+then
+    echo "$USAGE"
+    exit 1
+fi
+
+BIN=$1
+TOP=${2:-30}
+shift 2 2> /dev/null
+SCRIPTS=("$@")
+if [ ${#SCRIPTS[@]} -eq 0 ]; then SCRIPTS=(bench/*.sk); fi
+
+# OpCode enum order from 'src/chunk.h', index -> name
+OPNAMES=$(awk '/^typedef enum/ { on = 1; n = 0; next }
+               on && /} OpCode;/ { exit }
+               on && match($0, /OP_[A-Z_0-9]+/) { print n++, substr($0, RSTART, RLENGTH) }' \
+               src/chunk.h)
+
+for script in "${SCRIPTS[@]}"
+do
+    "$BIN" "$script" 2>&1 > /dev/null | grep -E '^[0-9]+ [0-9]+ [0-9]+$'
+done | awk -v top="$TOP" -v names="$OPNAMES" '
+    BEGIN {
+        n = split(names, f, "\n");
+        for(i = 1; i <= n; i++) { split(f[i], kv, " "); name[kv[1]] = kv[2]; }
+    }
+    { pairs[$2 " " $3] += $1; total += $1; }
+    END {
+        for(p in pairs) {
+            split(p, op, " ");
+            printf "%12d %6.2f%%  %-22s %s\n", pairs[p], 100 * pairs[p] / total, name[op[1]], name[op[2]];
+        }
+    }' | sort -rn | head -n "$TOP"
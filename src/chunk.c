@@ -3,6 +3,7 @@
 #include "common.h"
 #include "debug.h"
 #include "mem.h"
+#include "object.h"
 #include "vmachine.h"
 
 #include <stdio.h>
@@ -34,18 +35,37 @@ UInt Chunk_make_constant(VM* vm, Chunk* chunk, Value value)
     return idx;
 }
 
+/* Creates new empty inline cache, returns its index */
+UInt Chunk_make_cache(Chunk* chunk)
+{
+    InlineCache cache;
+    memset(&cache, 0, sizeof(InlineCache));
+    return Array_IC_push(&chunk->caches, cache);
+}
+
+/* Creates new loop hotness counter, returns its index */
+UInt Chunk_make_loop(VM* vm, Chunk* chunk)
+{
+    UInt    hotloop = vm->config.hotloop;
+    HotLoop loop    = {hotloop > 0 ? (Int)hotloop : INT32_MAX, 0, NULL};
+    return Array_HotLoop_push(&chunk->loops, loop);
+}
+
 /* Initializes the Chunk */
 void Chunk_init(Chunk* chunk, VM* vm)
 {
-    Array_Byte_init(&chunk->code, vm);
+    Array_Inst_init(&chunk->code, vm);
     Array_Value_init(&chunk->constants, vm);
     Array_UInt_init(&chunk->lines, vm);
+    Array_IC_init(&chunk->caches, vm);
+    Array_HotLoop_init(&chunk->loops, vm);
+    Array_TInst_init(&chunk->tcode, vm);
 }
 
-/* Writes OpCodes that require no parameters */
-UInt Chunk_write(Chunk* chunk, uint8_t byte, UInt line)
+/* Writes instruction or extension word */
+UInt Chunk_write(Chunk* chunk, Inst ins, UInt line)
 {
-    UInt idx = Array_Byte_push(&chunk->code, byte);
+    UInt idx = Array_Inst_push(&chunk->code, ins);
     LineArray_write(&chunk->lines, line, idx);
     return idx;
 }
@@ -55,130 +75,432 @@ void Chunk_free(Chunk* chunk)
 {
     Array_Value_free(&chunk->constants, NULL);
     Array_UInt_free(&chunk->lines, NULL);
-    Array_Byte_free(&chunk->code, NULL);
+    Array_Inst_free(&chunk->code, NULL);
+    Array_IC_free(&chunk->caches, NULL);
+    Array_HotLoop_free(&chunk->loops, NULL);
+    Array_TInst_free(&chunk->tcode, NULL);
     // Here chunk is at the init state
 }
 
-/* Write long param (24-bit) */
-sstatic force_inline void
-Chunk_write_param24(Chunk* chunk, UInt param, UInt line)
+/* Write instruction with 24-bit parameter. */
+UInt Chunk_write_codewparam(Chunk* chunk, OpCode code, UInt param, UInt line)
 {
-    Chunk_write(chunk, BYTE(param, 0), line);
-    Chunk_write(chunk, BYTE(param, 1), line);
-    Chunk_write(chunk, BYTE(param, 2), line);
-    ASSERT(
-        GET_BYTES3(Array_Byte_last(&chunk->code) - 2) == param,
-        "Invalid write to chunk bytecode array.");
+    ASSERT(param <= UINT24_MAX, "Invalid instruction parameter.");
+    return Chunk_write(chunk, MAKE_INS(code, param), line);
 }
 
-sstatic force_inline UInt
-Chunk_write_op(Chunk* chunk, OpCode code, bool islong, UInt idx, UInt line)
+/* Stack effect of a single instruction */
+typedef struct {
+    UInt len; // instruction length in words
+    Int  effect; // stack effect if execution falls through
+    Int  peak; // transient growth while executing (on top of effect)
+    Int  jmp; // jump target offset (-1 if instruction doesn't jump)
+    Int  jmpeffect; // stack effect if jump is taken
+    bool fallthrough; // execution can continue at the next instruction
+} OpEffect;
+
+/* Count operand without the 'VARCNT_BIT', values over it are checked at runtime */
+#define STATICCNT(cnt) ((Int)((cnt) & ~VARCNT_BIT))
+
+sstatic OpEffect opeffect(Chunk* chunk, UInt offset)
 {
-    UInt start = Chunk_write(chunk, code, line);
-    if(!islong) Chunk_write(chunk, idx, line);
-    else Chunk_write_param24(chunk, idx, line);
-    return start;
+    Inst*    ip  = &chunk->code.data[offset];
+    UInt     arg = GET_ARG(*ip);
+    OpEffect E   = {1, 0, 0, -1, 0, true};
+    switch(GET_OP(*ip)) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+            E.effect = 1;
+            break;
+        case OP_NEG:
+        case OP_NOT:
+        case OP_EQ:
+        case OP_OVERLOAD:
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_NOT_EQUAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_ADD_ANY:
+        case OP_ADD_NUM_SET_LOCAL: // fused instructions describe their first instruction
+        case OP_SUB_SET_LOCAL:
+        case OP_POP:
+        case OP_INDEX:
+        case OP_CLOSE_UPVAL:
+        case OP_INHERIT:
+            E.effect = -1;
+            break;
+        case OP_SET_INDEX:
+            E.effect = -3;
+            break;
+        case OP_NILN:
+        case OP_VALIST: // 'MULRET' count is checked at runtime
+            E.effect = arg;
+            break;
+        case OP_POPN:
+        case OP_CLOSE_UPVALN:
+            E.effect = -(Int)arg;
+            break;
+        case OP_ADDRK:
+        case OP_ADDRK_STR:
+        case OP_ADDRK_ANY:
+            E.peak = 2; // concatenated strings are kept on the stack
+            // fall through
+        case OP_SUBRK:
+        case OP_MULRK:
+        case OP_DIVRK:
+        case OP_NOT_EQUALRK:
+        case OP_EQUALRK:
+        case OP_GREATERRK:
+        case OP_GREATER_EQUALRK:
+        case OP_LESSRK:
+        case OP_LESS_EQUALRK:
+        case OP_ADDRK_NUM:
+            E.effect = (GET_A(*ip) == 0);
+            break;
+        case OP_NOT_EQUALRK_JMP:
+        case OP_EQUALRK_JMP:
+        case OP_GREATERRK_JMP:
+        case OP_GREATER_EQUALRK_JMP:
+        case OP_LESSRK_JMP:
+        case OP_LESS_EQUALRK_JMP:
+            E.len = 2;
+            E.jmp = offset + 2 + arg;
+            break;
+        case OP_GET_LOCAL_PROPERTY:
+            E.len    = 3;
+            E.effect = 1;
+            break;
+        case OP_CONST:
+        case OP_CONST_ADD_NUM:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_ADD_NUM:
+        case OP_GET_UPVALUE:
+        case OP_GET_FIXED:
+        case OP_CLASS:
+            E.effect = 1;
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_METHOD:
+            E.effect = -1;
+            break;
+        case OP_GET_SUPER:
+            E.len    = 2;
+            E.effect = -1;
+            break;
+        case OP_JMP_IF_FALSE:
+            E.jmp = offset + 1 + arg;
+            break;
+        case OP_JMP_IF_FALSE_POP:
+            E.effect    = -1;
+            E.jmp       = offset + 1 + arg;
+            E.jmpeffect = -1;
+            break;
+        case OP_JMP_IF_FALSE_OR_POP:
+            E.effect = -1;
+            E.jmp    = offset + 1 + arg;
+            break;
+        case OP_JMP_IF_FALSE_AND_POP:
+            E.jmp       = offset + 1 + arg;
+            E.jmpeffect = -1;
+            break;
+        case OP_JMP:
+            E.jmp         = offset + 1 + arg;
+            E.fallthrough = false;
+            break;
+        case OP_JMP_AND_POP:
+            E.jmp         = offset + 1 + arg;
+            E.jmpeffect   = -1;
+            E.fallthrough = false;
+            break;
+        case OP_LOOP:
+            E.len         = 2;
+            E.jmp         = offset + 2 - arg;
+            E.fallthrough = false;
+            break;
+        case OP_FORPREP: // jumps over the loop if it is done
+            E.len = 2;
+            E.jmp = offset + 2 + arg;
+            break;
+        case OP_FORLOOP: // jumps back to the loop body, falls through if done
+            E.len = 3;
+            E.jmp = offset + 3 - arg;
+            break;
+        case OP_CALL: // callee and arguments -> return values
+        case OP_TAILCALL: // falls through only if callee returned in place
+            E.len    = 2;
+            E.effect = arg - STATICCNT(ip[1]) - 1;
+            break;
+        case OP_INVOKE_INDEX: // receiver, key and arguments -> return values
+            E.len    = 2;
+            E.effect = arg - STATICCNT(ip[1]) - 2;
+            break;
+        case OP_INVOKE: // receiver and arguments -> return values
+        case OP_TAILINVOKE:
+            E.len    = 4;
+            E.effect = ip[1] - STATICCNT(ip[2]) - 1;
+            break;
+        case OP_INVOKE_SUPER: // receiver, arguments and superclass -> return values
+            E.len    = 4;
+            E.effect = ip[1] - STATICCNT(ip[2]) - 2;
+            break;
+        case OP_CLOSURE: {
+            Value fn = *Array_Value_index(&chunk->constants, arg);
+            E.len    = 1 + AS_FUNCTION(fn)->upvalc + AS_FUNCTION(fn)->fixedc; // word per capture
+            E.effect = 1;
+            break;
+        }
+        case OP_SET_PROPERTY:
+            E.len    = 2;
+            E.effect = -2;
+            break;
+        case OP_GET_PROPERTY:
+            E.len = 2;
+            break;
+        case OP_FOREACH: // skips the loop exit 'OP_JMP' unless control variable is nil
+            E.jmp = offset + 1 + 1;
+            break;
+        case OP_FOREACH_PREP: // copy iterator, state and control variable and call
+            E.effect = arg;
+            E.peak   = 3 - E.effect;
+            break;
+        case OP_TOPRET:
+        case OP_RET:
+            E.fallthrough = false;
+            break;
+        default:
+            unreachable;
+    }
+    return E;
 }
 
-/* Write generic OpCode-s with parameters. */
-UInt Chunk_write_codewparam(Chunk* chunk, OpCode code, UInt param, UInt line)
+/* Length of the instruction at 'offset' in words */
+UInt Chunk_oplen(Chunk* chunk, UInt offset)
 {
-#ifdef S_PRECOMPUTED_GOTO
-    #define OP_TABLE
-    #include "jmptable.h"
-    #undef OP_TABLE
-#else
-    #define DISPATCH(x) switch(x)
-    #define CASE(label) case label:
-    #define BREAK       break
-#endif
-#undef BREAK
-#define BREAK return
-
-    DISPATCH(code)
-    {
-        CASE(OP_RET)
-        CASE(OP_TOPRET)
-        CASE(OP_TRUE)
-        CASE(OP_FALSE)
-        CASE(OP_NIL)
-        CASE(OP_NEG)
-        CASE(OP_ADD)
-        CASE(OP_SUB)
-        CASE(OP_MUL)
-        CASE(OP_DIV)
-        CASE(OP_NOT)
-        CASE(OP_NOT_EQUAL)
-        CASE(OP_EQUAL)
-        CASE(OP_EQ)
-        CASE(OP_GREATER)
-        CASE(OP_GREATER_EQUAL)
-        CASE(OP_LESS)
-        CASE(OP_LESS_EQUAL)
-        CASE(OP_POP)
-        CASE(OP_LOOP)
-        CASE(OP_CLOSE_UPVAL)
-        CASE(OP_INHERIT)
-        CASE(OP_INDEX)
-        CASE(OP_SET_INDEX)
-        CASE(OP_CALLSTART)
-        CASE(OP_RETSTART)
-        CASE(OP_MOD)
-        CASE(OP_POW)
-        {
-            unreachable;
-        }
-        CASE(OP_POPN)
-        CASE(OP_DEFINE_GLOBALL)
-        CASE(OP_GET_GLOBALL)
-        CASE(OP_SET_GLOBALL)
-        CASE(OP_GET_LOCALL)
-        CASE(OP_SET_LOCALL)
-        CASE(OP_JMP_IF_FALSE)
-        CASE(OP_JMP_IF_FALSE_POP)
-        CASE(OP_JMP_IF_FALSE_OR_POP)
-        CASE(OP_JMP_IF_FALSE_AND_POP)
-        CASE(OP_JMP)
-        CASE(OP_JMP_AND_POP)
-        CASE(OP_GET_UPVALUE)
-        CASE(OP_SET_UPVALUE)
-        CASE(OP_CLOSURE)
-        CASE(OP_CLOSE_UPVALN)
-        CASE(OP_CLASS)
-        CASE(OP_SET_PROPERTY)
-        CASE(OP_GET_PROPERTY)
-        CASE(OP_METHOD)
-        CASE(OP_INVOKE)
-        CASE(OP_VALIST)
-        CASE(OP_GET_SUPER)
-        CASE(OP_INVOKE_SUPER)
-        CASE(OP_INVOKE_INDEX)
-        CASE(OP_CONST)
-        CASE(OP_NILN)
-        CASE(OP_CALL)
-        CASE(OP_FOREACH);
-        CASE(OP_FOREACH_PREP);
-        {
-            return Chunk_write_op(chunk, code, true, param, line);
-        }
-        CASE(OP_DEFINE_GLOBAL)
-        CASE(OP_GET_GLOBAL)
-        CASE(OP_SET_GLOBAL)
-        CASE(OP_GET_LOCAL)
-        CASE(OP_SET_LOCAL)
-        CASE(OP_OVERLOAD)
-        {
-            return Chunk_write_op(chunk, code, false, param, line);
+    return opeffect(chunk, offset).len;
+}
+
+/*
+ * Computes the highest stack growth above the arguments of any call
+ * to the function owning 'chunk'. Follows every control flow edge,
+ * stack depth at each reachable instruction is the same regardless
+ * of the path taken, so each instruction is visited only once.
+ * Variable amount of values (call or '...' spread) is not included,
+ * instructions producing those check the stack themselves.
+ */
+UInt Chunk_maxstack(Chunk* chunk, VM* vm)
+{
+    UInt  len   = chunk->code.len;
+    Int*  depth = MALLOC(vm, len * sizeof(Int));
+    UInt* work  = MALLOC(vm, len * sizeof(UInt));
+    UInt  workc = 0;
+    Int   max   = 0;
+    for(UInt i = 0; i < len; i++)
+        depth[i] = -1;
+    if(len > 0) {
+        depth[0]      = 0;
+        work[workc++] = 0;
+    }
+#define VISIT(target, d)                                                                 \
+    do {                                                                                 \
+        ASSERT((UInt)(target) < len, "Invalid jump target.");                            \
+        ASSERT(depth[target] < 0 || depth[target] == (d), "Inconsistent stack depth.");  \
+        if(depth[target] < 0) {                                                          \
+            depth[target] = (d);                                                         \
+            work[workc++] = (target);                                                    \
+        }                                                                                \
+    } while(false)
+    while(workc > 0) {
+        UInt offset = work[--workc];
+        for(;;) {
+            Int      d = depth[offset];
+            OpEffect E = opeffect(chunk, offset);
+            max        = MAX(max, d + E.effect + MAX(E.peak, 0));
+            max        = MAX(max, d + E.jmpeffect);
+            if(E.jmp >= 0) VISIT(E.jmp, d + E.jmpeffect);
+            if(!E.fallthrough || offset + E.len >= len) break;
+            offset += E.len;
+            ASSERT(
+                depth[offset] < 0 || depth[offset] == d + E.effect,
+                "Inconsistent stack depth.");
+            if(depth[offset] >= 0) break; // already visited
+            depth[offset] = d + E.effect;
         }
     }
+#undef VISIT
+    FREE(vm, work);
+    FREE(vm, depth);
+    return max;
+}
+
+/* Forward jumps with the jump offset operand */
+sstatic bool isfwdjmp(OpCode op)
+{
+    switch(op) {
+        case OP_JMP:
+        case OP_JMP_AND_POP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_FALSE_POP:
+        case OP_JMP_IF_FALSE_OR_POP:
+        case OP_JMP_IF_FALSE_AND_POP:
+        case OP_NOT_EQUALRK_JMP:
+        case OP_EQUALRK_JMP:
+        case OP_GREATERRK_JMP:
+        case OP_GREATER_EQUALRK_JMP:
+        case OP_LESSRK_JMP:
+        case OP_LESS_EQUALRK_JMP:
+        case OP_FORPREP:
+            return true;
+        default:
+            return false;
+    }
+}
 
-#undef DISPATCH
-#undef CASE
-#undef BREAK
+/*
+ * Thread the forward jump at 'offset' through the jump it lands on,
+ * returns true if the jump changed. Conditional jump landing on another
+ * conditional jump that tests the same (falsey) value takes its branch
+ * right away, popping the value if that jump would.
+ */
+sstatic bool threadjmp(Chunk* chunk, UInt offset)
+{
+    Inst*    ip     = &chunk->code.data[offset];
+    OpEffect E      = opeffect(chunk, offset);
+    OpCode   op     = GET_OP(*ip);
+    switch(GET_OP(chunk->code.data[E.jmp])) {
+        case OP_JMP:
+            break;
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_FALSE_OR_POP: // jumps keeping the value
+            if(op != OP_JMP_IF_FALSE && op != OP_JMP_IF_FALSE_OR_POP) return false;
+            break;
+        case OP_JMP_IF_FALSE_POP:
+        case OP_JMP_IF_FALSE_AND_POP: // jumps popping the value
+            if(op == OP_JMP_IF_FALSE) SET_OP(*ip, OP_JMP_IF_FALSE_AND_POP);
+            else if(op == OP_JMP_IF_FALSE_OR_POP) SET_OP(*ip, OP_JMP_IF_FALSE_POP);
+            else return false;
+            break;
+        default:
+            return false;
+    }
+    UInt dest = opeffect(chunk, E.jmp).jmp;
+    SET_ARG(*ip, dest - (offset + E.len));
+    return true;
+}
 
-#ifdef SKOOMA_JMPTABLE_H
-    #undef SKOOMA_JMPTABLE_H
-#endif
+/*
+ * Fuse the instruction at 'offset' with the instruction at 'next' by
+ * rewriting only its opcode, returns true if the pair got fused.
+ * Fused instruction executes both, the second instruction is left as
+ * is so jumps and frames landing on it still execute it alone.
+ * Pairs are the most executed ones that the compiler can't fuse
+ * (see 'bench/oppairs.sh'), arithmetic pairs are fused only after
+ * 'OP_ADD' got quickened for numbers.
+ */
+sstatic bool fuse(Chunk* chunk, UInt offset, UInt next)
+{
+    Inst*  ip     = &chunk->code.data[offset];
+    OpCode second = GET_OP(chunk->code.data[next]);
+    switch(GET_OP(*ip)) {
+        case OP_CONST:
+            if(second != OP_ADD_NUM || !IS_NUMBER(chunk->constants.data[GET_ARG(*ip)]))
+                return false;
+            SET_OP(*ip, OP_CONST_ADD_NUM);
+            return true;
+        case OP_GET_LOCAL:
+            if(second != OP_ADD_NUM) return false;
+            SET_OP(*ip, OP_GET_LOCAL_ADD_NUM);
+            return true;
+        case OP_ADD_NUM:
+            if(second != OP_SET_LOCAL) return false;
+            SET_OP(*ip, OP_ADD_NUM_SET_LOCAL);
+            return true;
+        case OP_SUB:
+            if(second != OP_SET_LOCAL) return false;
+            SET_OP(*ip, OP_SUB_SET_LOCAL);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* First instruction of the fused instruction 'op' (or 'op' if not fused) */
+OpCode Chunk_unfuse(OpCode op)
+{
+    switch(op) {
+        case OP_CONST_ADD_NUM:
+            return OP_CONST;
+        case OP_GET_LOCAL_ADD_NUM:
+            return OP_GET_LOCAL;
+        case OP_ADD_NUM_SET_LOCAL:
+            return OP_ADD_NUM;
+        case OP_SUB_SET_LOCAL:
+            return OP_SUB;
+        default:
+            return op;
+    }
+}
+
+/*
+ * Optimizing pass over the bytecode of hot functions ('TIER_OPT'),
+ * threads forward jumps and fuses hot instruction pairs.
+ * Instructions are rewritten in place and keep their length, so frames
+ * already running the function continue at their current instruction.
+ */
+void Chunk_optimize(Chunk* chunk)
+{
+    for(UInt pc = 0; pc < chunk->code.len; pc += Chunk_oplen(chunk, pc))
+        if(isfwdjmp(GET_OP(chunk->code.data[pc])))
+            while(threadjmp(chunk, pc))
+                ;
+    for(UInt pc = 0; pc < chunk->code.len;) {
+        UInt next = pc + Chunk_oplen(chunk, pc);
+        if(next < chunk->code.len && fuse(chunk, pc, next))
+            next += Chunk_oplen(chunk, next);
+        pc = next;
+    }
+    Chunk_unthread(chunk);
+}
+
+/*
+ * Translates the bytecode into direct-threaded code, 'table' maps
+ * opcodes into handler addresses (if NULL opcodes are stored as is).
+ * Original bytecode is kept for debug, line lookups and the JIT.
+ */
+void Chunk_thread(Chunk* chunk, const void* const* table)
+{
+    UInt len = chunk->code.len;
+    if(chunk->tcode.cap < len) Array_TInst_init_cap(&chunk->tcode, len);
+    chunk->tcode.len = len;
+    for(UInt pc = 0; pc < len;) {
+        UInt next = pc + Chunk_oplen(chunk, pc);
+        Inst ins  = chunk->code.data[pc];
+        chunk->tcode.data[pc].handler =
+            (table != NULL ? table[GET_OP(ins)] : (const void*)(uintptr_t)GET_OP(ins));
+        for(; pc < next; pc++)
+            chunk->tcode.data[pc].ins = chunk->code.data[pc];
+    }
+}
+
+/* Invalidates threaded code, called when the bytecode gets rewritten */
+void Chunk_unthread(Chunk* chunk)
+{
+    chunk->tcode.len = 0;
 }
 
 // @TODO: Implement binary search
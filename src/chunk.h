@@ -8,6 +8,36 @@
 
 ARRAY_NEW(Array_Byte, Byte);
 
+/*
+ * Instructions are encoded in fixed width 32-bit words, the low byte
+ * is the opcode and the upper 24 bits hold the first operand 'A'.
+ * Register instructions pack three single byte operands A, B and C
+ * instead. Instructions with more operands are followed by extension
+ * words, each holding a whole operand (see 'opeffect' in chunk.c for
+ * the length of each instruction).
+ */
+typedef uint32_t Inst;
+
+ARRAY_NEW(Array_Inst, Inst);
+
+#define MAKE_INS(op, arg)       ((Inst)(op) | ((Inst)(arg) << 8))
+#define MAKE_ABC(op, a, b, c)   MAKE_INS(op, (a) | ((b) << 8) | ((Inst)(c) << 16))
+#define GET_OP(ins)             ((OpCode)((ins) & 0xff))
+#define GET_ARG(ins)            ((UInt)((ins) >> 8))
+#define GET_A(ins)              ((Byte)((ins) >> 8))
+#define GET_B(ins)              ((Byte)((ins) >> 16))
+#define GET_C(ins)              ((Byte)((ins) >> 24))
+#define SET_OP(ins, op)         ((ins) = ((ins) & ~(Inst)0xff) | (Inst)(op))
+#define SET_ARG(ins, arg)       ((ins) = ((ins) & 0xff) | ((Inst)(arg) << 8))
+
+/*
+ * 'OP_CLOSURE' extension word of each upvalue, 'idx' is the captured
+ * local slot (if 'local') or the upvalue index of the enclosing closure.
+ */
+#define MAKE_UPVAL(local, flags, idx) MAKE_INS((local) | ((flags) << 1), idx)
+#define UPVAL_LOCAL(ins)              ((ins) & 1)
+#define UPVAL_FLAGS(ins)              (((ins) & 0xff) >> 1)
+
 #define OPCODE_N ((uint32_t)(OP_RET + 1))
 
 typedef enum {
@@ -33,21 +63,42 @@ typedef enum {
     OP_GREATER_EQUAL, /* -||- check if left greater or equal than right */
     OP_LESS, /* -||- check if left is less than right */
     OP_LESS_EQUAL, /* -||- check if left is less or equal than right */
+    OP_ADDRK, /* Register instruction, A = RK(B) + RK(C) (A == 0 pushes result) */
+    OP_SUBRK, /* -||- A = RK(B) - RK(C) */
+    OP_MULRK, /* -||- A = RK(B) * RK(C) */
+    OP_DIVRK, /* -||- A = RK(B) / RK(C) */
+    OP_NOT_EQUALRK, /* -||- A = RK(B) != RK(C) */
+    OP_EQUALRK, /* -||- A = RK(B) == RK(C) */
+    OP_GREATERRK, /* -||- A = RK(B) > RK(C) */
+    OP_GREATER_EQUALRK, /* -||- A = RK(B) >= RK(C) */
+    OP_LESSRK, /* -||- A = RK(B) < RK(C) */
+    OP_LESS_EQUALRK, /* -||- A = RK(B) <= RK(C) */
+    OP_ADD_NUM, /* OP_ADD quickened for number operands */
+    OP_ADD_STR, /* OP_ADD quickened for string operands */
+    OP_ADDRK_NUM, /* OP_ADDRK quickened for number operands */
+    OP_ADDRK_STR, /* OP_ADDRK quickened for string operands */
+    OP_ADD_ANY, /* OP_ADD that failed a quickened guard, never quickened again */
+    OP_ADDRK_ANY, /* OP_ADDRK that failed a quickened guard, never quickened again */
+    OP_NOT_EQUALRK_JMP, /* Superinstruction, jump if !(RK(B) != RK(C)) */
+    OP_EQUALRK_JMP, /* -||- jump if !(RK(B) == RK(C)) */
+    OP_GREATERRK_JMP, /* -||- jump if !(RK(B) > RK(C)) */
+    OP_GREATER_EQUALRK_JMP, /* -||- jump if !(RK(B) >= RK(C)) */
+    OP_LESSRK_JMP, /* -||- jump if !(RK(B) < RK(C)) */
+    OP_LESS_EQUALRK_JMP, /* -||- jump if !(RK(B) <= RK(C)) */
+    OP_GET_LOCAL_PROPERTY, /* Superinstruction, OP_GET_LOCAL + OP_GET_PROPERTY */
+    OP_CONST_ADD_NUM, /* Fused by 'Chunk_optimize', OP_CONST + OP_ADD_NUM */
+    OP_GET_LOCAL_ADD_NUM, /* -||- OP_GET_LOCAL + OP_ADD_NUM */
+    OP_ADD_NUM_SET_LOCAL, /* -||- OP_ADD_NUM + OP_SET_LOCAL */
+    OP_SUB_SET_LOCAL, /* -||- OP_SUB + OP_SET_LOCAL */
     OP_POP, /* Pop the value of the stack */
     OP_POPN, /* Pop 'n' values of the stack */
     OP_CONST, /* Push constant on the stack */
-    OP_DEFINE_GLOBAL, /* Pop global value off the stack (8-bit idx) and store it
+    OP_DEFINE_GLOBAL, /* Pop global value off the stack and store it
                          in chunk table for globals. */
-    OP_DEFINE_GLOBALL, /* Pop global value off the stack (24-bit idx) and store
-                          it in chunk table for globals */
     OP_GET_GLOBAL, /* Push global on the stack */
-    OP_GET_GLOBALL, /* Push global on the stack long */
     OP_SET_GLOBAL, /* Set global variable */
-    OP_SET_GLOBALL, /* Set global variable long */
     OP_GET_LOCAL, /* Push local variable on the stack */
-    OP_GET_LOCALL, /* Push local variable on the stack long */
     OP_SET_LOCAL, /* Set local variable */
-    OP_SET_LOCALL, /* Set local variable long */
     OP_JMP_IF_FALSE, /* Conditional jump to instruction */
     OP_JMP_IF_FALSE_POP, /* Jump if false and pop unconditionally */
     OP_JMP_IF_FALSE_OR_POP, /* Conditional jump to instruction or pop stack value
@@ -56,10 +107,14 @@ typedef enum {
                                 value */
     OP_JMP, /* Jump to instruction */
     OP_JMP_AND_POP, /* Jump to instruction and pop the value of the stack */
-    OP_LOOP, /* Jump backwards unconditionally */
+    OP_LOOP, /* Jump backwards unconditionally (counts loop iterations) */
+    OP_FORPREP, /* Numeric for-loop entry, check counter and limit, skip loop if done */
+    OP_FORLOOP, /* Numeric for-loop step, increment counter and jump back if not done */
     OP_CALL, /* Call instruction */
+    OP_TAILCALL, /* Call in tail position, callee reuses the caller frame */
     OP_CLOSURE, /* Create a closure */
     OP_GET_UPVALUE, /* Push the upvalue on the stack */
+    OP_GET_FIXED, /* Push the captured 'fixed' value on the stack */
     OP_SET_UPVALUE, /* Set upvalue */
     OP_CLOSE_UPVAL, /* Close upvalue */
     OP_CLOSE_UPVALN, /* Close 'n' upvalues */
@@ -71,12 +126,11 @@ typedef enum {
     OP_INVOKE_INDEX, /* Invoke class method name resolved dynamically */
     OP_METHOD, /* Create class method */
     OP_INVOKE, /* Invoke class method */
+    OP_TAILINVOKE, /* Invoke class method in tail position */
     OP_OVERLOAD, /* Overload operator or initializer for a class */
     OP_INHERIT, /* Inherit class properties. */
     OP_GET_SUPER, /* Fetch superclass method */
     OP_INVOKE_SUPER, /* Invoke superclass method call */
-    OP_CALLSTART, /* Start of call instruction arguments */
-    OP_RETSTART, /* Start of return instruction values */
     OP_FOREACH, /* Generic for loop */
     OP_FOREACH_PREP, /* Generic for loop stack prep */
     OP_TOPRET, /* Return from top-level function */
@@ -85,16 +139,131 @@ typedef enum {
 
 ARRAY_NEW(Array_UInt, UInt);
 
+/*
+ * Register instructions have three single byte operands A, B and C.
+ * A is the destination stack slot of the frame (0 means push result
+ * on the stack), B and C are RK operands, either a frame stack slot
+ * or constant index if the 'RK_CONST_BIT' is set.
+ * Register jumps ('OP_*RK_JMP') hold the jump offset in their 24-bit
+ * operand, B and C are in the extension word (at the same bit positions).
+ */
+/*
+ * Argument count operand of call instructions and value count operand
+ * of return instructions. If 'VARCNT_BIT' is set the last expression
+ * returns variable amount of values (call or '...'), the count is then
+ * the rest of the operand plus the count of values that expression
+ * returned ('mulretc' in VM).
+ */
+#define VARCNT_BIT (1 << 23)
+
+#define RK_CONST_BIT   0x80
+#define RK_MAX         0x7f
+#define RKCONST(idx)   ((idx) | RK_CONST_BIT)
+#define RKISCONST(rk)  ((rk) & RK_CONST_BIT)
+#define RKINDEX(rk)    ((rk) & RK_MAX)
+
+/*
+ * Operand word of numeric for-loop instructions ('OP_FORPREP' and
+ * 'OP_FORLOOP'), B is the counter slot and C the limit RK (same bit
+ * positions as in register jumps), low bytes hold the step constant
+ * RK and the register compare opcode of the loop condition.
+ */
+#define MAKE_FOR(step, cmp, counter, limit)                                              \
+    ((Inst)(step) | ((Inst)(cmp) << 8) | ((Inst)(counter) << 16) | ((Inst)(limit) << 24))
+#define FOR_STEP(ext) ((Byte)(ext))
+#define FOR_CMP(ext)  ((OpCode)(Byte)((ext) >> 8))
+
+/*
+ * Numeric for-loop condition, 'cmp' is the register compare opcode.
+ * 'OP_FORPREP' checks that counter and limit are numbers on the loop
+ * entry, compiler ensures the loop body never writes them.
+ */
+sstatic force_inline bool forcond(OpCode cmp, double i, double limit)
+{
+    switch(cmp) {
+        case OP_GREATERRK:
+            return i > limit;
+        case OP_GREATER_EQUALRK:
+            return i >= limit;
+        case OP_LESSRK:
+            return i < limit;
+        default:
+            return i <= limit;
+    }
+}
+
+/* Max receiver shapes inline cache holds before it goes megamorphic */
+#define IC_ENTRIES 4
+
+/* Inline cache entry, valid only for receivers with the same 'shape' */
+typedef struct {
+    OShape*   shape; // receiver shape
+    OShape*   next; // shape after adding the field (setter transition)
+    OClosure* method; // resolved method (NULL if field)
+    UInt      slot; // field slot index
+} ICEntry;
+
+/* Inline cache of a single property access/invoke instruction */
+typedef struct {
+    ICEntry entries[IC_ENTRIES];
+    Byte    len; // entries in use
+    Byte    megamorphic; // too many receiver shapes, cache is bypassed
+#ifdef DEBUG_IC_STATS
+    UInt hits; // lookups resolved by the cache
+    UInt misses; // lookups that took the slow path
+#endif
+} InlineCache;
+
+ARRAY_NEW(Array_IC, InlineCache);
+
+/*
+ * Loop back-edge ('OP_LOOP' or 'OP_FORLOOP') hotness counter, 'hotcount'
+ * is decremented each iteration, when it reaches zero the loop is hot,
+ * the running function tiers up and the JIT records and compiles a trace
+ * of the loop.
+ */
+typedef struct {
+    Int    hotcount; // iterations left until the loop is hot
+    UInt   aborts; // failed trace recordings
+    Trace* trace; // compiled trace of the loop body (NULL if none)
+} HotLoop;
+
+ARRAY_NEW(Array_HotLoop, HotLoop);
+
+/*
+ * Direct-threaded code word, threaded code mirrors the bytecode word
+ * for word (same offsets and jumps). First word of each instruction
+ * holds the address of the opcode handler ('run') along with the
+ * instruction word, extension words hold only the instruction word.
+ */
+typedef struct {
+    const void* handler;
+    Inst        ins;
+} TInst;
+
+ARRAY_NEW(Array_TInst, TInst);
+
 typedef struct {
-    Array_Value constants; // Constant values
-    Array_UInt  lines; // Lines array (in case of compile time errors or debug)
-    Array_Byte  code; // Bytecode array
+    Array_Value   constants; // Constant values
+    Array_UInt    lines; // Lines array (in case of compile time errors or debug)
+    Array_Inst    code; // Bytecode array
+    Array_IC      caches; // Inline caches
+    Array_HotLoop loops; // Loop hotness counters
+    Array_TInst   tcode; // Threaded code (built lazily, empty if stale)
 } Chunk;
 
 void Chunk_init(Chunk* chunk, VM* vm);
-UInt Chunk_write(Chunk* chunk, uint8_t byte, UInt line);
-UInt Chunk_write_codewparam(Chunk* chunk, OpCode code, UInt idx, UInt line);
+UInt Chunk_write(Chunk* chunk, Inst ins, UInt line);
+UInt Chunk_write_codewparam(Chunk* chunk, OpCode code, UInt param, UInt line);
 void Chunk_free(Chunk* chunk);
 UInt Chunk_make_constant(VM* vm, Chunk* chunk, Value value);
+UInt Chunk_make_cache(Chunk* chunk);
+UInt Chunk_make_loop(VM* vm, Chunk* chunk);
+UInt Chunk_maxstack(Chunk* chunk, VM* vm);
+UInt Chunk_oplen(Chunk* chunk, UInt offset);
+void Chunk_optimize(Chunk* chunk);
+OpCode Chunk_unfuse(OpCode op);
+void Chunk_thread(Chunk* chunk, const void* const* table);
+void Chunk_unthread(Chunk* chunk);
 
 #endif
@@ -104,12 +104,13 @@ typedef struct {
 #define SS_BOOL  5
 #define SS_NIL   6
 #define SS_FUNC  7
+#define SS_RANGE 8
 /* Native functions argument names */
-#define SS_MANU       8
-#define SS_AUTO       9
-#define SS_ASSERT_MSG 10
-#define SS_ERROR      11
-#define SS_ASSERT     12
+#define SS_MANU       9
+#define SS_AUTO       10
+#define SS_ASSERT_MSG 11
+#define SS_ERROR      12
+#define SS_ASSERT     13
 /* Size */
 #define SS_SIZE (sizeof(static_str) / sizeof(static_str[0]))
 
@@ -124,6 +125,7 @@ static const InternedString static_str[] = {
     {"bool",              sizeofstr("bool")             },
     {"nil",               sizeofstr("nil")              },
     {"function",          sizeofstr("function")         },
+    {"range",             sizeofstr("range")            },
  /* Native function statics */
     {"manual",            sizeofstr("manual")           },
     {"auto",              sizeofstr("auto")             },
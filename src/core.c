@@ -64,7 +64,7 @@ snative(isfield)
     return false;
 fin:;
     Value _;
-    argv[-1] = BOOL_VAL(HashTable_get(&AS_INSTANCE(receiver)->fields, field, &_));
+    argv[-1] = BOOL_VAL(OInstance_get(AS_INSTANCE(receiver), field, &_));
     return true;
 }
 
@@ -112,13 +112,14 @@ sstatic force_inline OString* typename(VM* vm, Value type)
         &&nil,
         &&ins,
         &&cls,
+        &&rng,
     };
     UInt sum = (IS_NUMBER(type) * 1) | (IS_STRING(type) * 2) |
                ((IS_FUNCTION(type) | IS_BOUND_METHOD(type) | IS_CLOSURE(type) |
                  IS_NATIVE(type)) *
                 4) |
                IS_BOOL(type) * 8 | IS_NIL(type) * 16 | IS_INSTANCE(type) * 32 |
-               IS_CLASS(type) * 64;
+               IS_CLASS(type) * 64 | IS_RANGE(type) * 128;
     ASSERT(sum != 0, "Type doesn't exist.");
     // https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html#index-_005f_005fbuiltin_005fctz
     Byte  idx = __builtin_ctz(sum);
@@ -137,6 +138,8 @@ ins:
     return vm->statics[SS_INS];
 cls:
     return vm->statics[SS_CLASS];
+rng:
+    return vm->statics[SS_RANGE];
 #else
     if(IS_NUMBER(type)) {
         return vm->statics[SS_NUM];
@@ -154,6 +157,8 @@ cls:
         return vm->statics[SS_INS];
     } else if(IS_CLASS(type)) {
         return vm->statics[SS_CLASS];
+    } else if(IS_RANGE(type)) {
+        return vm->statics[SS_RANGE];
     }
 #endif
     unreachable;
@@ -174,6 +179,32 @@ snative(typeof)
 }
 
 
+/**
+ * Creates numeric range iterator counting from 'start' by 'step'
+ * (default 1) up to 'stop' (exclusive), 'foreach' steps it natively.
+ * @ret - range
+ * @err - if any of the arguments is not a number
+ *      - if 'step' is 0
+ **/
+snative(range)
+{
+    UNUSED(retcnt);
+    OString* err = NULL;
+    for(Int i = 0; i < argc; i++)
+        if(unlikely(!IS_NUMBER(argv[i]))) err = ERR_NEW(vm, RANGE_ARG_TYPE_ERR);
+    if(err == NULL && argc > 2 && unlikely(AS_NUMBER(argv[2]) == 0))
+        err = ERR_NEW(vm, RANGE_STEP_ERR);
+    if(unlikely(err != NULL)) {
+        argv[-1]  = OBJ_VAL(err);
+        vm->sp   -= argc;
+        return false;
+    }
+    double step = (argc > 2 ? AS_NUMBER(argv[2]) : 1);
+    argv[-1]    = OBJ_VAL(ORange_new(vm, AS_NUMBER(argv[0]), AS_NUMBER(argv[1]), step));
+    vm->sp     -= argc;
+    return true;
+}
+
 /**
  * Checks if the 'expr' is falsey ('false' or 'nil') and if it is
  * it invokes runtime error printing the default 'Assertion failed.' message.
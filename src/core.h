@@ -7,6 +7,16 @@
 
 typedef bool (*NativeFn)(VM* vm, Value* argv, Int argc, Int retcnt, ...);
 
+/*
+ * Iterator step of a native iterator, 'OP_FOREACH_PREP' calls it directly
+ * instead of calling the iterator through a new call frame. 'iter' points
+ * to the iterator, invariant state and control variable, 'vars' loop
+ * variables are stored into 'dest' (nil first variable ends the loop).
+ * On error the error message is stored into 'dest[0]' and false is returned.
+ * The step must not grow the stack.
+ */
+typedef bool (*NativeNext)(VM* vm, Value* iter, Value* dest, Int vars);
+
 Value       resolve_script(VM* vm, Value name);
 const char* load_script_default(VM* vm, const char* path);
 
@@ -21,6 +31,7 @@ snative(clock);
 snative(isfield);
 snative(typeof);
 snative(loadscript);
+snative(range);
 
 snative(printl);
 snative(print);
@@ -23,9 +23,19 @@ sstatic Int simpleins(const char* name, UInt offset)
 
 sstatic Int jmpins(const char* name, Int sign, Chunk* chunk, UInt offset)
 {
-    UInt jmp = GET_BYTES3(&chunk->code.data[offset + 1]);
-    printf("%-25s %5u -> %u\n", name, offset, offset + 4 + (sign * jmp));
-    return offset + 4;
+    UInt jmp = GET_ARG(chunk->code.data[offset]);
+    printf("%-25s %5u -> %u\n", name, offset, offset + 1 + (sign * jmp));
+    return offset + 1;
+}
+
+sstatic Int loopins(Chunk* chunk, UInt offset)
+{
+    UInt     jmp  = GET_ARG(chunk->code.data[offset]);
+    UInt     idx  = chunk->code.data[offset + 1];
+    HotLoop* loop = &chunk->loops.data[idx];
+    printf("%-25s %5u -> %u", "OP_LOOP", offset, offset + 2 - jmp);
+    printf(" [loop %u hot %d%s]\n", idx, loop->hotcount, loop->trace ? " traced" : "");
+    return offset + 2; /* OpCode + jump, loop index */
 }
 
 sstatic void constant(Chunk* chunk, UInt param)
@@ -41,31 +51,28 @@ sstatic UInt closure(Chunk* chunk, UInt param, UInt offset)
     vprint(value);
     printf("\n");
     OFunction* fn = AS_FUNCTION(value);
-    for(UInt i = 0; i < fn->upvalc; i++) {
-        bool local = chunk->code.data[offset++];
-        offset++; // flags
-        UInt idx = GET_BYTES3(&chunk->code.data[offset]);
+    for(UInt i = 0; i < fn->upvalc + fn->fixedc; i++, offset++) {
+        Inst upval = chunk->code.data[offset];
         printf(
-            "%04d     |                                 %s %d\n",
+            "%04d     |                                 %s %d%s\n",
             offset,
-            local ? "local" : "upvalue",
-            idx);
-        offset += 3;
+            UPVAL_LOCAL(upval) ? "local" : "upvalue",
+            GET_ARG(upval),
+            (UPVAL_FLAGS(upval) & VAR_FIXED_BIT) ? " (fixed)" : "");
     }
     return offset;
 }
 
-sstatic Int shorinst(const char* name, Chunk* chunk, OpCode code, UInt offset)
+sstatic Int argins(const char* name, Chunk* chunk, OpCode code, UInt offset)
 {
-    Byte param = *Array_Byte_index(&chunk->code, offset + 1);
+    UInt param = GET_ARG(chunk->code.data[offset]);
     printf("%-25s %5u ", name, param);
     switch(code) {
+        case OP_CLOSURE:
+            return closure(chunk, param, offset + 1);
         case OP_CONST:
         case OP_CLASS:
-        case OP_SET_PROPERTY:
-        case OP_GET_PROPERTY:
         case OP_METHOD:
-        case OP_GET_SUPER:
             constant(chunk, param);
             break;
         case OP_OVERLOAD:
@@ -76,41 +83,132 @@ sstatic Int shorinst(const char* name, Chunk* chunk, OpCode code, UInt offset)
             break;
     }
     printf("\n");
-    return offset + 2; /* OpCode + param(8-bit/1-byte) */
+    return offset + 1; /* OpCode(8-bit) + param(24-bit) */
 }
 
-sstatic Int longins(const char* name, Chunk* chunk, OpCode code, UInt offset)
+sstatic void cache(Chunk* chunk, UInt idx)
 {
-    UInt param = GET_BYTES3(&chunk->code.data[offset + 1]);
+    InlineCache* cache = &chunk->caches.data[idx];
+    printf(" [ic %u", idx);
+    if(cache->megamorphic) printf(" megamorphic");
+    else printf(" %u/%u", cache->len, IC_ENTRIES);
+#ifdef DEBUG_IC_STATS
+    printf(" hits %u misses %u", cache->hits, cache->misses);
+#endif
+    printf("]");
+}
+
+sstatic Int cachedins(const char* name, Chunk* chunk, UInt offset)
+{
+    UInt param = GET_ARG(chunk->code.data[offset]);
+    UInt idx   = chunk->code.data[offset + 1];
     printf("%-25s %5u ", name, param);
-    switch(code) {
-        case OP_CLOSURE:
-            return closure(chunk, param, offset + 4);
-        case OP_CONST:
-        case OP_CLASS:
-        case OP_SET_PROPERTY:
-        case OP_GET_PROPERTY:
-        case OP_METHOD:
-        case OP_GET_SUPER:
-            constant(chunk, param);
-            break;
-        default:
-            // do nothing
-            break;
+    constant(chunk, param);
+    cache(chunk, idx);
+    printf("\n");
+    return offset + 2; /* OpCode + param, cache index */
+}
+
+sstatic void rkoperand(Chunk* chunk, Byte rk)
+{
+    if(RKISCONST(rk)) {
+        printf(" K%u ", RKINDEX(rk));
+        constant(chunk, RKINDEX(rk));
+    } else printf(" R%u", rk);
+}
+
+sstatic Int registerins(const char* name, Chunk* chunk, UInt offset)
+{
+    Inst ins = chunk->code.data[offset];
+    printf("%-25s ", name);
+    if(GET_A(ins) == 0) printf(" push ");
+    else printf("   R%u", GET_A(ins));
+    rkoperand(chunk, GET_B(ins));
+    rkoperand(chunk, GET_C(ins));
+    printf("\n");
+    return offset + 1; /* OpCode + A + B + C */
+}
+
+sstatic Int registerjmpins(const char* name, Chunk* chunk, UInt offset)
+{
+    UInt jmp = GET_ARG(chunk->code.data[offset]);
+    Inst ext = chunk->code.data[offset + 1];
+    printf("%-25s      ", name);
+    rkoperand(chunk, GET_B(ext));
+    rkoperand(chunk, GET_C(ext));
+    printf(" %5u -> %u\n", offset, offset + 2 + jmp);
+    return offset + 2; /* OpCode + jump, B + C */
+}
+
+sstatic Int forins(const char* name, Chunk* chunk, UInt offset)
+{
+    static const char* cond[] = {">", ">=", "<", "<="}; // OP_GREATERRK..OP_LESS_EQUALRK
+    Inst ins = chunk->code.data[offset];
+    Inst ext = chunk->code.data[offset + 1];
+    printf("%-25s      R%u %s", name, GET_B(ext), cond[FOR_CMP(ext) - OP_GREATERRK]);
+    rkoperand(chunk, GET_C(ext));
+    if(GET_OP(ins) == OP_FORPREP) {
+        printf(" %5u -> %u\n", offset, offset + 2 + GET_ARG(ins));
+        return offset + 2; /* OpCode + jump, operands */
     }
+    printf(" +");
+    rkoperand(chunk, FOR_STEP(ext));
+    UInt     idx  = chunk->code.data[offset + 2];
+    HotLoop* loop = &chunk->loops.data[idx];
+    printf(" %5u -> %u", offset, offset + 3 - GET_ARG(ins));
+    printf(" [loop %u hot %d%s]\n", idx, loop->hotcount, loop->trace ? " traced" : "");
+    return offset + 3; /* OpCode + jump, operands, loop index */
+}
+
+sstatic Int localcachedins(const char* name, Chunk* chunk, UInt offset)
+{
+    UInt slot  = GET_ARG(chunk->code.data[offset]);
+    UInt param = chunk->code.data[offset + 1];
+    UInt idx   = chunk->code.data[offset + 2];
+    printf("%-25s R%u %5u ", name, slot, param);
+    constant(chunk, param);
+    cache(chunk, idx);
+    printf("\n");
+    return offset + 3; /* OpCode + slot, param, cache index */
+}
+
+sstatic void varcnt(const char* name, UInt cnt)
+{
+    if(cnt & VARCNT_BIT) printf("(%s %u+) ", name, cnt & ~VARCNT_BIT);
+    else printf("(%s %u) ", name, cnt);
+}
+
+sstatic Int callins(const char* name, Chunk* chunk, UInt offset)
+{
+    Int  retcnt = GET_ARG(chunk->code.data[offset]);
+    UInt argc   = chunk->code.data[offset + 1];
+    printf("%-25s (retcnt %d) ", name, retcnt);
+    varcnt("argc", argc);
+    printf("\n");
+    return offset + 2; /* OpCode + retcnt, argc */
+}
+
+sstatic Int retins(const char* name, Chunk* chunk, UInt offset)
+{
+    printf("%-25s ", name);
+    varcnt("retcnt", GET_ARG(chunk->code.data[offset]));
     printf("\n");
-    return offset + 4; /* OpCode(8-bit/1-byte) + param(24-bit/3-bytes) */
+    return offset + 1; /* OpCode + retcnt */
 }
 
 sstatic Int invoke(const char* name, Chunk* chunk, Int offset)
 {
-    UInt param  = GET_BYTES3(&chunk->code.data[offset + 1]);
-    offset     += 4;
-    Int retcnt  = GET_BYTES3(&chunk->code.data[offset]);
-    printf("%-25s (retcnt %d) %5d ", name, retcnt, param);
+    UInt param  = GET_ARG(chunk->code.data[offset]);
+    Int  retcnt = chunk->code.data[offset + 1];
+    UInt argc   = chunk->code.data[offset + 2];
+    UInt idx    = chunk->code.data[offset + 3];
+    printf("%-25s (retcnt %d) ", name, retcnt);
+    varcnt("argc", argc);
+    printf("%5d ", param);
     constant(chunk, param);
+    cache(chunk, idx);
     printf("\n");
-    return offset + 3;
+    return offset + 4; /* OpCode + param, retcnt, argc, cache index */
 }
 
 sdebug UInt Instruction_debug(Chunk* chunk, UInt offset)
@@ -119,12 +217,12 @@ sdebug UInt Instruction_debug(Chunk* chunk, UInt offset)
     UInt line = Chunk_getline(chunk, offset);
     if(offset > 0 && line == Chunk_getline(chunk, offset - 1)) printf("    | ");
     else printf("%5d ", line);
-    Byte instruction = chunk->code.data[offset];
+    OpCode instruction = GET_OP(chunk->code.data[offset]);
     switch(instruction) {
         case OP_RET:
-            return simpleins("OP_RET", offset);
+            return retins("OP_RET", chunk, offset);
         case OP_TOPRET:
-            return simpleins("OP_TOPRET", offset);
+            return retins("OP_TOPRET", chunk, offset);
         case OP_TRUE:
             return simpleins("OP_TRUE", offset);
         case OP_FALSE:
@@ -132,9 +230,9 @@ sdebug UInt Instruction_debug(Chunk* chunk, UInt offset)
         case OP_NIL:
             return simpleins("OP_NIL", offset);
         case OP_NILN:
-            return longins("OP_NILN", chunk, OP_NILN, offset);
+            return argins("OP_NILN", chunk, OP_NILN, offset);
         case OP_VALIST:
-            return longins("OP_VALIST", chunk, OP_VALIST, offset);
+            return argins("OP_VALIST", chunk, OP_VALIST, offset);
         case OP_NEG:
             return simpleins("OP_NEG", offset);
         case OP_ADD:
@@ -165,36 +263,76 @@ sdebug UInt Instruction_debug(Chunk* chunk, UInt offset)
             return simpleins("OP_LESS", offset);
         case OP_LESS_EQUAL:
             return simpleins("OP_LESS_EQUAL", offset);
+        case OP_ADDRK:
+            return registerins("OP_ADDRK", chunk, offset);
+        case OP_SUBRK:
+            return registerins("OP_SUBRK", chunk, offset);
+        case OP_MULRK:
+            return registerins("OP_MULRK", chunk, offset);
+        case OP_DIVRK:
+            return registerins("OP_DIVRK", chunk, offset);
+        case OP_NOT_EQUALRK:
+            return registerins("OP_NOT_EQUALRK", chunk, offset);
+        case OP_EQUALRK:
+            return registerins("OP_EQUALRK", chunk, offset);
+        case OP_GREATERRK:
+            return registerins("OP_GREATERRK", chunk, offset);
+        case OP_GREATER_EQUALRK:
+            return registerins("OP_GREATER_EQUALRK", chunk, offset);
+        case OP_LESSRK:
+            return registerins("OP_LESSRK", chunk, offset);
+        case OP_LESS_EQUALRK:
+            return registerins("OP_LESS_EQUALRK", chunk, offset);
+        case OP_ADD_NUM:
+            return simpleins("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleins("OP_ADD_STR", offset);
+        case OP_ADDRK_NUM:
+            return registerins("OP_ADDRK_NUM", chunk, offset);
+        case OP_ADDRK_STR:
+            return registerins("OP_ADDRK_STR", chunk, offset);
+        case OP_ADD_ANY:
+            return simpleins("OP_ADD_ANY", offset);
+        case OP_ADDRK_ANY:
+            return registerins("OP_ADDRK_ANY", chunk, offset);
+        case OP_NOT_EQUALRK_JMP:
+            return registerjmpins("OP_NOT_EQUALRK_JMP", chunk, offset);
+        case OP_EQUALRK_JMP:
+            return registerjmpins("OP_EQUALRK_JMP", chunk, offset);
+        case OP_GREATERRK_JMP:
+            return registerjmpins("OP_GREATERRK_JMP", chunk, offset);
+        case OP_GREATER_EQUALRK_JMP:
+            return registerjmpins("OP_GREATER_EQUALRK_JMP", chunk, offset);
+        case OP_LESSRK_JMP:
+            return registerjmpins("OP_LESSRK_JMP", chunk, offset);
+        case OP_LESS_EQUALRK_JMP:
+            return registerjmpins("OP_LESS_EQUALRK_JMP", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localcachedins("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_CONST_ADD_NUM:
+            return argins("OP_CONST_ADD_NUM", chunk, OP_CONST, offset);
+        case OP_GET_LOCAL_ADD_NUM:
+            return argins("OP_GET_LOCAL_ADD_NUM", chunk, OP_GET_LOCAL, offset);
+        case OP_ADD_NUM_SET_LOCAL:
+            return simpleins("OP_ADD_NUM_SET_LOCAL", offset);
+        case OP_SUB_SET_LOCAL:
+            return simpleins("OP_SUB_SET_LOCAL", offset);
         case OP_POP:
             return simpleins("OP_POP", offset);
         case OP_POPN:
-            return longins("OP_POPN", chunk, OP_POPN, offset);
+            return argins("OP_POPN", chunk, OP_POPN, offset);
         case OP_CONST:
-            return longins("OP_CONST", chunk, OP_CONST, offset);
+            return argins("OP_CONST", chunk, OP_CONST, offset);
         case OP_DEFINE_GLOBAL:
-            return shorinst("OP_DEFINE_GLOBAL", chunk, OP_DEFINE_GLOBAL, offset);
-        case OP_DEFINE_GLOBALL:
-            return longins(
-                "OP_DEFINE_GLOBALL",
-                chunk,
-                OP_DEFINE_GLOBALL,
-                offset);
+            return argins("OP_DEFINE_GLOBAL", chunk, OP_DEFINE_GLOBAL, offset);
         case OP_GET_GLOBAL:
-            return shorinst("OP_GET_GLOBAL", chunk, OP_GET_GLOBAL, offset);
-        case OP_GET_GLOBALL:
-            return longins("OP_GET_GLOBALL", chunk, OP_GET_GLOBALL, offset);
+            return argins("OP_GET_GLOBAL", chunk, OP_GET_GLOBAL, offset);
         case OP_SET_GLOBAL:
-            return shorinst("OP_SET_GLOBAL", chunk, OP_SET_GLOBAL, offset);
-        case OP_SET_GLOBALL:
-            return longins("OP_SET_GLOBALL", chunk, OP_SET_GLOBALL, offset);
+            return argins("OP_SET_GLOBAL", chunk, OP_SET_GLOBAL, offset);
         case OP_GET_LOCAL:
-            return shorinst("OP_GET_LOCAL", chunk, OP_GET_LOCAL, offset);
-        case OP_GET_LOCALL:
-            return longins("OP_GET_LOCALL", chunk, OP_GET_LOCALL, offset);
+            return argins("OP_GET_LOCAL", chunk, OP_GET_LOCAL, offset);
         case OP_SET_LOCAL:
-            return shorinst("OP_SET_LOCAL", chunk, OP_SET_LOCAL, offset);
-        case OP_SET_LOCALL:
-            return longins("OP_SET_LOCALL", chunk, OP_SET_LOCALL, offset);
+            return argins("OP_SET_LOCAL", chunk, OP_SET_LOCAL, offset);
         case OP_JMP_IF_FALSE:
             return jmpins("OP_JMP_IF_FALSE", 1, chunk, offset);
         case OP_JMP_IF_FALSE_POP:
@@ -208,51 +346,57 @@ sdebug UInt Instruction_debug(Chunk* chunk, UInt offset)
         case OP_JMP_AND_POP:
             return jmpins("OP_JMP_AND_POP", 1, chunk, offset);
         case OP_LOOP:
-            return jmpins("OP_LOOP", -1, chunk, offset);
+            return loopins(chunk, offset);
+        case OP_FORPREP:
+            return forins("OP_FORPREP", chunk, offset);
+        case OP_FORLOOP:
+            return forins("OP_FORLOOP", chunk, offset);
         case OP_CALL:
-            return longins("OP_CALL", chunk, OP_CALL, offset);
+            return callins("OP_CALL", chunk, offset);
+        case OP_TAILCALL:
+            return callins("OP_TAILCALL", chunk, offset);
         case OP_CLOSURE:
-            return longins("OP_CLOSURE", chunk, OP_CLOSURE, offset);
+            return argins("OP_CLOSURE", chunk, OP_CLOSURE, offset);
         case OP_GET_UPVALUE:
-            return longins("OP_GET_UPVALUE", chunk, OP_GET_UPVALUE, offset);
+            return argins("OP_GET_UPVALUE", chunk, OP_GET_UPVALUE, offset);
+        case OP_GET_FIXED:
+            return argins("OP_GET_FIXED", chunk, OP_GET_FIXED, offset);
         case OP_SET_UPVALUE:
-            return longins("OP_SET_UPVALUE", chunk, OP_SET_UPVALUE, offset);
+            return argins("OP_SET_UPVALUE", chunk, OP_SET_UPVALUE, offset);
         case OP_CLOSE_UPVAL:
             return simpleins("OP_CLOSE_UPVAL", offset);
         case OP_CLOSE_UPVALN:
-            return longins("OP_CLOSE_UPVALN", chunk, OP_CLOSE_UPVALN, offset);
+            return argins("OP_CLOSE_UPVALN", chunk, OP_CLOSE_UPVALN, offset);
         case OP_CLASS:
-            return longins("OP_CLASS", chunk, OP_CLASS, offset);
+            return argins("OP_CLASS", chunk, OP_CLASS, offset);
         case OP_SET_PROPERTY:
-            return longins("OP_SET_PROPERTY", chunk, OP_SET_PROPERTY, offset);
+            return cachedins("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_PROPERTY:
-            return longins("OP_GET_PROPERTY", chunk, OP_GET_PROPERTY, offset);
+            return cachedins("OP_GET_PROPERTY", chunk, offset);
         case OP_INDEX:
             return simpleins("OP_INDEX", offset);
         case OP_SET_INDEX:
             return simpleins("OP_SET_INDEX", offset);
         case OP_INVOKE_INDEX:
-            return longins("OP_INVOKE_INDEX", chunk, OP_INVOKE_INDEX, offset);
+            return callins("OP_INVOKE_INDEX", chunk, offset);
         case OP_METHOD:
-            return longins("OP_METHOD", chunk, OP_METHOD, offset);
+            return argins("OP_METHOD", chunk, OP_METHOD, offset);
         case OP_INVOKE:
             return invoke("OP_INVOKE", chunk, offset);
+        case OP_TAILINVOKE:
+            return invoke("OP_TAILINVOKE", chunk, offset);
         case OP_OVERLOAD:
-            return shorinst("OP_OVERLOAD", chunk, OP_OVERLOAD, offset);
+            return argins("OP_OVERLOAD", chunk, OP_OVERLOAD, offset);
         case OP_INHERIT:
             return simpleins("OP_INHERIT", offset);
         case OP_GET_SUPER:
-            return longins("OP_GET_SUPER", chunk, OP_GET_SUPER, offset);
+            return cachedins("OP_GET_SUPER", chunk, offset);
         case OP_INVOKE_SUPER:
             return invoke("OP_INVOKE_SUPER", chunk, offset);
-        case OP_CALLSTART:
-            return simpleins("OP_CALLSTART", offset);
-        case OP_RETSTART:
-            return simpleins("OP_RETSTART", offset);
         case OP_FOREACH:
-            return longins("OP_FOREACH", chunk, OP_FOREACH, offset);
+            return argins("OP_FOREACH", chunk, OP_FOREACH, offset);
         case OP_FOREACH_PREP:
-            return longins("OP_FOREACH_PREP", chunk, OP_FOREACH_PREP, offset);
+            return argins("OP_FOREACH_PREP", chunk, OP_FOREACH_PREP, offset);
         default:
             printf("Unknown opcode: %d\n", instruction);
             return offset + 1;
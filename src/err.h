@@ -249,6 +249,11 @@
         NATIVE_FN_ERR(strsub, "indices 'i' and 'j' must be numbers.")
     /* ------------- */
 
+    /* native_range() */
+    #define RANGE_ARG_TYPE_ERR NATIVE_FN_ERR(range, "arguments must be numbers.")
+    #define RANGE_STEP_ERR     NATIVE_FN_ERR(range, "'step' can't be 0.")
+    /* ------------- */
+
     /* native_loadscript() */
     #define LOADSCRIPT_ARG_TYPE_ERR                                                      \
         NATIVE_FN_ERR(loadscript, INVALID_FIRST_ARG_TYPE(string))
@@ -346,12 +351,12 @@
             superclass);
     /*-----------------*/
 
-    /* OP_GET_GLOBAL | OP_GET_GLOBALL | OP_SET_GLOBAL | OP_SET_GLOBALL */
+    /* OP_GET_GLOBAL | OP_SET_GLOBAL */
     #define UNDEFINED_GLOBAL_ERR(vm, name)                                               \
         RUNTIME_ERR(vm, "Undefined global variable '%s'.", name)
     /*-----------------*/
 
-    /* OP_DEFINE_GLOBAL | OP_DEFINE_GLOBALL */
+    /* OP_DEFINE_GLOBAL */
     #define GLOBALVAR_REDEFINITION_ERR(vm, name)                                         \
         RUNTIME_ERR(vm, "Redefinition of global variable '%s'.", name);
     /*-----------------*/
@@ -377,6 +382,8 @@
         RUNTIME_ERR(vm, "Expected at least %d argument/s, instead got %d.", arity, argc)
     #define FRAME_LIMIT_ERR(vm, frames_max)                                              \
         RUNTIME_ERR(vm, "Call-frame stack overflow, limit reached [%u].", frames_max)
+    #define STACK_LIMIT_ERR(vm, stack_max)                                               \
+        RUNTIME_ERR(vm, "VM stack overflow, limit reached [%u].", stack_max)
     /* -------------- */
 
     /* vcall() { OP_CALL } */
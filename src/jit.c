@@ -0,0 +1,2304 @@
+#include "jit.h"
+
+#ifdef S_JIT
+
+    #include "debug.h"
+    #include "mem.h"
+
+    #include <stddef.h>
+    #include <sys/mman.h>
+
+/*
+ * Baseline template JIT.
+ *
+ * Each instruction is translated into a fixed template of x86-64
+ * machine code, operands are decoded at compile time. Templates
+ * implement only the fast paths (numbers, locals, globals, upvalues,
+ * jumps, inline cache hits), if the type guard fails or instruction
+ * has no template (calls, returns, allocations...) compiled code
+ * exits and the interpreter executes that instruction instead.
+ * Interpreter enters compiled code again on the next frame switch
+ * or loop back-edge. Compiled return exits with the instruction of
+ * the caller frame.
+ *
+ * Register assignment of compiled code:
+ * rbx - VM
+ * r12 - frame stack pointer (locals)
+ * r13 - stack pointer ('vm->sp' is written back on exit)
+ * r14 - CallFrame
+ * r15 - 'QNAN' mask
+ * rax, rcx, rdx, r11, xmm0 and xmm1 are scratch registers.
+ */
+
+typedef enum {
+    RAX = 0,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Reg;
+
+    #define XMM0 0
+    #define XMM1 1
+
+    #define VMREG    RBX
+    #define BASEREG  R12
+    #define SPREG    R13
+    #define FRAMEREG R14
+    #define QNANREG  R15
+
+/* Condition codes */
+typedef enum {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_NP = 0xb,
+    CC_LE = 0xe,
+} Cond;
+
+/* ALU opcodes (register, register) and their /digit (register, immediate) */
+    #define ALU_ADD 0x01, 0
+    #define ALU_OR  0x09, 1
+    #define ALU_AND 0x21, 4
+    #define ALU_SUB 0x29, 5
+    #define ALU_XOR 0x31, 6
+    #define ALU_CMP 0x39, 7
+    #define ALU_TEST 0x85, 0
+
+/* SSE2 scalar double opcodes */
+    #define SSE_ADD 0x58
+    #define SSE_MUL 0x59
+    #define SSE_SUB 0x5c
+    #define SSE_DIV 0x5e
+
+    #define SLOT(i) ((Int)((i) * sizeof(Value)))
+
+/* Jump to the bytecode offset or exit stub, patched after all code is emitted */
+typedef struct {
+    UInt at; // offset of the rel32 operand
+    UInt pc; // bytecode offset
+} Fixup;
+
+typedef struct {
+    VM*        vm;
+    OFunction* fn;
+    Byte*      code; // machine code
+    UInt       len;
+    UInt       cap;
+    Fixup*     fixups; // jumps to instructions and exits
+    UInt       fixupc;
+    UInt       fixupcap;
+    UInt*      entries; // machine code offset of each instruction
+    UInt       epilogue; // offset of the exit epilogue
+    UInt       pc; // bytecode offset of the instruction being compiled
+} Jit;
+
+/* Jump kinds, stored in the high bit of 'Fixup' 'pc' */
+    #define FIXUP_EXIT (1u << 31)
+
+
+
+
+//======================= EMIT =======================//
+
+sstatic void emit(Jit* J, Byte byte)
+{
+    if(unlikely(J->len == J->cap)) {
+        J->cap  = GROW_ARRAY_CAPACITY(J->cap, 256);
+        J->code = REALLOC(J->vm, J->code, J->cap);
+    }
+    J->code[J->len++] = byte;
+}
+
+sstatic void emit32(Jit* J, uint32_t x)
+{
+    for(UInt i = 0; i < 4; i++)
+        emit(J, BYTE(x, i));
+}
+
+sstatic void emit64(Jit* J, uint64_t x)
+{
+    for(UInt i = 0; i < 8; i++)
+        emit(J, BYTE(x, i));
+}
+
+sstatic void patch32(Jit* J, UInt at, uint32_t x)
+{
+    for(UInt i = 0; i < 4; i++)
+        J->code[at + i] = BYTE(x, i);
+}
+
+sstatic void addfixup(Jit* J, UInt at, UInt pc)
+{
+    if(unlikely(J->fixupc == J->fixupcap)) {
+        J->fixupcap = GROW_ARRAY_CAPACITY(J->fixupcap, 16);
+        J->fixups   = REALLOC(J->vm, J->fixups, J->fixupcap * sizeof(Fixup));
+    }
+    J->fixups[J->fixupc++] = (Fixup){at, pc};
+}
+
+/* REX prefix, omitted if not needed */
+sstatic void rex(Jit* J, bool w, Reg r, Reg b)
+{
+    Byte prefix = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+    if(prefix != 0x40) emit(J, prefix);
+}
+
+sstatic void modrm_reg(Jit* J, Reg r, Reg rm)
+{
+    emit(J, 0xc0 | ((r & 7) << 3) | (rm & 7));
+}
+
+/* ModRM (and SIB) of the memory operand [base + disp] */
+sstatic void modrm_mem(Jit* J, Reg r, Reg base, Int disp)
+{
+    Byte mod;
+    if(disp == 0 && (base & 7) != RBP) mod = 0;
+    else if(disp >= -128 && disp <= 127) mod = 1;
+    else mod = 2;
+    emit(J, (mod << 6) | ((r & 7) << 3) | (base & 7));
+    if((base & 7) == RSP) emit(J, 0x24);
+    if(mod == 1) emit(J, (Byte)disp);
+    else if(mod == 2) emit32(J, disp);
+}
+
+sstatic void push_r(Jit* J, Reg r)
+{
+    rex(J, false, 0, r);
+    emit(J, 0x50 + (r & 7));
+}
+
+sstatic void pop_r(Jit* J, Reg r)
+{
+    rex(J, false, 0, r);
+    emit(J, 0x58 + (r & 7));
+}
+
+sstatic void mov_ri(Jit* J, Reg r, uint64_t imm)
+{
+    if(imm <= UINT32_MAX) { // mov r32, imm32 (zero extends)
+        rex(J, false, 0, r);
+        emit(J, 0xb8 + (r & 7));
+        emit32(J, imm);
+    } else {
+        rex(J, true, 0, r);
+        emit(J, 0xb8 + (r & 7));
+        emit64(J, imm);
+    }
+}
+
+sstatic void mov_rr(Jit* J, Reg dst, Reg src)
+{
+    rex(J, true, src, dst);
+    emit(J, 0x89);
+    modrm_reg(J, src, dst);
+}
+
+sstatic void load(Jit* J, Reg r, Reg base, Int disp)
+{
+    rex(J, true, r, base);
+    emit(J, 0x8b);
+    modrm_mem(J, r, base, disp);
+}
+
+sstatic void store(Jit* J, Reg base, Int disp, Reg r)
+{
+    rex(J, true, r, base);
+    emit(J, 0x89);
+    modrm_mem(J, r, base, disp);
+}
+
+/* movzx eax, byte [base + disp] */
+sstatic void loadbyte(Jit* J, Reg base, Int disp)
+{
+    rex(J, false, RAX, base);
+    emit(J, 0x0f);
+    emit(J, 0xb6);
+    modrm_mem(J, RAX, base, disp);
+}
+
+sstatic void alu_rr(Jit* J, Byte op, Byte digit, Reg dst, Reg src)
+{
+    UNUSED(digit);
+    rex(J, true, src, dst);
+    emit(J, op);
+    modrm_reg(J, src, dst);
+}
+
+sstatic void alu_ri(Jit* J, Byte op, Byte digit, Reg dst, Int imm)
+{
+    UNUSED(op);
+    rex(J, true, 0, dst);
+    if(imm >= -128 && imm <= 127) {
+        emit(J, 0x83);
+        modrm_reg(J, digit, dst);
+        emit(J, (Byte)imm);
+    } else {
+        emit(J, 0x81);
+        modrm_reg(J, digit, dst);
+        emit32(J, imm);
+    }
+}
+
+/* lea dst, [base + disp] */
+sstatic void lea(Jit* J, Reg dst, Reg base, Int disp)
+{
+    rex(J, true, dst, base);
+    emit(J, 0x8d);
+    modrm_mem(J, dst, base, disp);
+}
+
+/* shr r64, imm8 */
+sstatic void shr_ri(Jit* J, Reg r, Byte imm)
+{
+    rex(J, true, 0, r);
+    emit(J, 0xc1);
+    modrm_reg(J, 5, r);
+    emit(J, imm);
+}
+
+/* cmp r32, imm32 */
+sstatic void cmp32_ri(Jit* J, Reg r, uint32_t imm)
+{
+    rex(J, false, 0, r);
+    emit(J, 0x81);
+    modrm_reg(J, 7, r);
+    emit32(J, imm);
+}
+
+/* cmp dword [base + disp], imm8 */
+sstatic void cmp32_mi(Jit* J, Reg base, Int disp, int8_t imm)
+{
+    rex(J, false, 0, base);
+    emit(J, 0x83);
+    modrm_mem(J, 7, base, disp);
+    emit(J, (Byte)imm);
+}
+
+/* mov dword [base + disp], imm32 */
+sstatic void mov32_mi(Jit* J, Reg base, Int disp, Int imm)
+{
+    rex(J, false, 0, base);
+    emit(J, 0xc7);
+    modrm_mem(J, 0, base, disp);
+    emit32(J, imm);
+}
+
+/* dec dword [base + disp] */
+sstatic void dec32_m(Jit* J, Reg base, Int disp)
+{
+    rex(J, false, 0, base);
+    emit(J, 0xff);
+    modrm_mem(J, 1, base, disp);
+}
+
+/* movq xmm, r64 */
+sstatic void movq_xr(Jit* J, Byte x, Reg r)
+{
+    emit(J, 0x66);
+    rex(J, true, x, r);
+    emit(J, 0x0f);
+    emit(J, 0x6e);
+    modrm_reg(J, x, r);
+}
+
+/* movq r64, xmm */
+sstatic void movq_rx(Jit* J, Reg r, Byte x)
+{
+    emit(J, 0x66);
+    rex(J, true, x, r);
+    emit(J, 0x0f);
+    emit(J, 0x7e);
+    modrm_reg(J, x, r);
+}
+
+/* cvtsi2sd xmm, r32 */
+sstatic void cvtsi2sd(Jit* J, Byte x, Reg r)
+{
+    emit(J, 0xf2);
+    rex(J, false, x, r);
+    emit(J, 0x0f);
+    emit(J, 0x2a);
+    modrm_reg(J, x, r);
+}
+
+sstatic void sse_rr(Jit* J, Byte op, Byte xdst, Byte xsrc)
+{
+    emit(J, 0xf2);
+    rex(J, false, xdst, xsrc);
+    emit(J, 0x0f);
+    emit(J, op);
+    modrm_reg(J, xdst, xsrc);
+}
+
+sstatic void ucomisd(Jit* J, Byte xa, Byte xb)
+{
+    emit(J, 0x66);
+    rex(J, false, xa, xb);
+    emit(J, 0x0f);
+    emit(J, 0x2e);
+    modrm_reg(J, xa, xb);
+}
+
+/* movaps xdst, xsrc */
+sstatic void movaps(Jit* J, Byte xdst, Byte xsrc)
+{
+    rex(J, false, xdst, xsrc);
+    emit(J, 0x0f);
+    emit(J, 0x28);
+    modrm_reg(J, xdst, xsrc);
+}
+
+/* movsd [base + disp], x */
+sstatic void movsd_mx(Jit* J, Reg base, Int disp, Byte x)
+{
+    emit(J, 0xf2);
+    rex(J, false, x, base);
+    emit(J, 0x0f);
+    emit(J, 0x11);
+    modrm_mem(J, x, base, disp);
+}
+
+/* cmp byte [base + disp], imm8 */
+sstatic void cmp8_mi(Jit* J, Reg base, Int disp, Byte imm)
+{
+    rex(J, false, 0, base);
+    emit(J, 0x80);
+    modrm_mem(J, 7, base, disp);
+    emit(J, imm);
+}
+
+/* cmp [base + disp], r */
+sstatic void cmp_mr(Jit* J, Reg base, Int disp, Reg r)
+{
+    rex(J, true, r, base);
+    emit(J, 0x39);
+    modrm_mem(J, r, base, disp);
+}
+
+/* setcc r8 (al or cl) */
+sstatic void setcc(Jit* J, Cond cc, Reg r)
+{
+    emit(J, 0x0f);
+    emit(J, 0x90 | cc);
+    modrm_reg(J, 0, r);
+}
+
+/* Forward jumps inside of the template (rel8), patched with 'here8' */
+sstatic UInt jcc8(Jit* J, Cond cc)
+{
+    emit(J, 0x70 | cc);
+    emit(J, 0);
+    return J->len - 1;
+}
+
+sstatic UInt jmp8(Jit* J)
+{
+    emit(J, 0xeb);
+    emit(J, 0);
+    return J->len - 1;
+}
+
+sstatic void here8(Jit* J, UInt at)
+{
+    ASSERT(J->len - (at + 1) <= 127, "Template jump out of range.");
+    J->code[at] = (Byte)(J->len - (at + 1));
+}
+
+/* Jump to instruction at bytecode offset 'pc' */
+sstatic void jmpto(Jit* J, Int cc, UInt pc)
+{
+    if(cc < 0) emit(J, 0xe9);
+    else {
+        emit(J, 0x0f);
+        emit(J, 0x80 | cc);
+    }
+    emit32(J, 0);
+    addfixup(J, J->len - 4, pc);
+}
+
+/* Exit into the interpreter at the current instruction (if 'cc', -1 always) */
+sstatic void exitif(Jit* J, Int cc)
+{
+    if(cc < 0) emit(J, 0xe9);
+    else {
+        emit(J, 0x0f);
+        emit(J, 0x80 | cc);
+    }
+    emit32(J, 0);
+    addfixup(J, J->len - 4, J->pc | FIXUP_EXIT);
+}
+
+sstatic void callhelper(Jit* J, void* fn)
+{
+    mov_ri(J, RAX, (uint64_t)(uintptr_t)fn);
+    emit(J, 0xff);
+    emit(J, 0xd0); // call rax
+}
+
+
+
+
+//======================= VALUES =======================//
+
+sstatic void vpush(Jit* J, Reg r)
+{
+    store(J, SPREG, 0, r);
+    alu_ri(J, ALU_ADD, SPREG, SLOT(1));
+}
+
+sstatic void vpop(Jit* J, UInt n)
+{
+    if(n > 0) alu_ri(J, ALU_SUB, SPREG, SLOT(n));
+}
+
+/* Load value 'peek' slots below the top of the stack */
+sstatic void vpeek(Jit* J, Reg r, UInt peek)
+{
+    load(J, r, SPREG, -SLOT(peek + 1));
+}
+
+/*
+ * Test the value in 'r' for a number, jumps to the returned label
+ * if it is a double, otherwise flags are 'CC_NE' unless it is an integer.
+ */
+sstatic UInt numtest(Jit* J, Reg r)
+{
+    mov_rr(J, R11, r);
+    alu_rr(J, ALU_AND, R11, QNANREG);
+    alu_rr(J, ALU_CMP, R11, QNANREG);
+    UInt dbl = jcc8(J, CC_NE);
+    mov_rr(J, R11, r);
+    shr_ri(J, R11, 32);
+    cmp32_ri(J, R11, INT_TAG >> 32);
+    return dbl;
+}
+
+/* Load number in 'r' tested by 'numtest' into 'x', integers are converted */
+sstatic void numload(Jit* J, Reg r, Byte x, UInt dbl)
+{
+    cvtsi2sd(J, x, r);
+    UInt done = jmp8(J);
+    here8(J, dbl);
+    movq_xr(J, x, r);
+    here8(J, done);
+}
+
+/* Load number in 'r' into 'x', exits unless it is a number (or it is 'known' double) */
+sstatic void numguard(Jit* J, Reg r, Byte x, bool known)
+{
+    if(known) movq_xr(J, x, r);
+    else {
+        UInt dbl = numtest(J, r);
+        exitif(J, CC_NE);
+        numload(J, r, x, dbl);
+    }
+}
+
+/* Numeric constants are loaded as doubles, compiled code computes only on doubles */
+sstatic Value numconst(Value k)
+{
+    return IS_NUMBER(k) ? NUMBER_VAL(AS_NUMBER(k)) : k;
+}
+
+/* Load RK operand, returns true if the loaded value is known to be a double */
+sstatic bool rkload(Jit* J, Reg r, Byte rk)
+{
+    if(RKISCONST(rk)) {
+        Value k = J->fn->chunk.constants.data[RKINDEX(rk)];
+        mov_ri(J, r, numconst(k));
+        return IS_NUMBER(k);
+    }
+    load(J, r, BASEREG, SLOT(rk));
+    return false;
+}
+
+/* Set flags for 'ISFALSEY' of the value in rax (clobbers rax), 'CC_BE' if falsey */
+sstatic void testfalsey(Jit* J)
+{
+    mov_ri(J, RCX, NIL_VAL);
+    alu_rr(J, ALU_SUB, RAX, RCX);
+    alu_ri(J, ALU_CMP, RAX, 1); // nil and false are adjacent
+}
+
+/* Convert al (0 or 1) into the boolean value in rax */
+sstatic void tobool(Jit* J)
+{
+    emit(J, 0x0f);
+    emit(J, 0xb6);
+    emit(J, 0xc0); // movzx eax, al
+    mov_ri(J, RCX, FALSE_VAL);
+    alu_rr(J, ALU_OR, RAX, RCX);
+}
+
+/* al = 'veq(rax, rdx)' */
+sstatic void veqal(Jit* J)
+{
+    UInt dbl    = numtest(J, RAX);
+    UInt notnum = jcc8(J, CC_NE);
+    numload(J, RAX, XMM0, dbl);
+    dbl          = numtest(J, RDX);
+    UInt notnum2 = jcc8(J, CC_NE);
+    numload(J, RDX, XMM1, dbl);
+    ucomisd(J, XMM0, XMM1);
+    setcc(J, CC_E, RAX);
+    setcc(J, CC_NP, RCX);
+    emit(J, 0x20);
+    emit(J, 0xc8); // and al, cl
+    UInt done = jmp8(J);
+    here8(J, notnum);
+    here8(J, notnum2);
+    alu_rr(J, ALU_CMP, RAX, RDX);
+    setcc(J, CC_E, RAX);
+    here8(J, done);
+}
+
+/* Guard numbers in rax and rdx (unless known) and load them into xmm0 and xmm1 */
+sstatic void numoperands(Jit* J, bool anum, bool bnum)
+{
+    numguard(J, RAX, XMM0, anum);
+    numguard(J, RDX, XMM1, bnum);
+}
+
+/*
+ * Compare numbers in 'xa' and 'xb', returns condition code that
+ * is set when the comparison is true (false if unordered).
+ */
+sstatic Cond numcmp(Jit* J, OpCode op, Byte xa, Byte xb)
+{
+    switch(op) {
+        case OP_GREATER:
+        case OP_GREATERRK:
+        case OP_GREATERRK_JMP:
+            ucomisd(J, xa, xb);
+            return CC_A;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUALRK:
+        case OP_GREATER_EQUALRK_JMP:
+            ucomisd(J, xa, xb);
+            return CC_AE;
+        case OP_LESS:
+        case OP_LESSRK:
+        case OP_LESSRK_JMP:
+            ucomisd(J, xb, xa);
+            return CC_A;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUALRK:
+        case OP_LESS_EQUALRK_JMP:
+            ucomisd(J, xb, xa);
+            return CC_AE;
+        default:
+            unreachable;
+    }
+}
+
+/* SSE2 opcode of the arithmetic instruction */
+sstatic Byte sseop(OpCode op)
+{
+    switch(op) {
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_ANY:
+        case OP_ADDRK:
+        case OP_ADDRK_NUM:
+        case OP_ADDRK_ANY:
+            return SSE_ADD;
+        case OP_SUB:
+        case OP_SUBRK:
+            return SSE_SUB;
+        case OP_MUL:
+        case OP_MULRK:
+            return SSE_MUL;
+        case OP_DIV:
+        case OP_DIVRK:
+            return SSE_DIV;
+        default:
+            unreachable;
+    }
+}
+
+/* Arithmetic on numbers in xmm0 and xmm1, result in rax */
+sstatic void numarith(Jit* J, OpCode op)
+{
+    sse_rr(J, sseop(op), XMM0, XMM1);
+    movq_rx(J, RAX, XMM0);
+}
+
+/* Store register instruction result in rax ('ra' 0 pushes) */
+sstatic void rkstore(Jit* J, Byte ra)
+{
+    if(ra == 0) vpush(J, RAX);
+    else store(J, BASEREG, SLOT(ra), RAX);
+}
+
+/* Load address of the upvalue 'idx' of the frame closure into rcx */
+sstatic void upvalue(Jit* J, UInt idx)
+{
+    load(J, RCX, FRAMEREG, offsetof(CallFrame, closure));
+    load(J, RCX, RCX, offsetof(OClosure, upvals));
+    load(J, RCX, RCX, SLOT(idx));
+}
+
+/* Load captured 'fixed' value 'idx' of the frame closure into rax */
+sstatic void fixedvalue(Jit* J, UInt idx)
+{
+    load(J, RCX, FRAMEREG, offsetof(CallFrame, closure));
+    load(J, RCX, RCX, offsetof(OClosure, fixed));
+    load(J, RAX, RCX, SLOT(idx));
+}
+
+
+
+
+//======================= TEMPLATES =======================//
+
+sstatic void template(Jit* J, Inst* ip)
+{
+    Chunk* chunk = &J->fn->chunk;
+    OpCode op    = Chunk_unfuse(GET_OP(*ip)); // second instruction compiles on its own
+    switch(op) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+            mov_ri(J, RAX, op == OP_TRUE ? TRUE_VAL : op == OP_FALSE ? FALSE_VAL : NIL_VAL);
+            vpush(J, RAX);
+            break;
+        case OP_NILN: {
+            UInt n = GET_ARG(*ip);
+            mov_ri(J, RAX, NIL_VAL);
+            for(UInt i = 0; i < n; i++)
+                store(J, SPREG, SLOT(i), RAX);
+            alu_ri(J, ALU_ADD, SPREG, SLOT(n));
+            break;
+        }
+        case OP_CONST:
+            mov_ri(J, RAX, numconst(chunk->constants.data[GET_ARG(*ip)]));
+            vpush(J, RAX);
+            break;
+        case OP_POP:
+            vpop(J, 1);
+            break;
+        case OP_POPN:
+            vpop(J, GET_ARG(*ip));
+            break;
+        case OP_GET_LOCAL: {
+            UInt slot = GET_ARG(*ip);
+            load(J, RAX, BASEREG, SLOT(slot));
+            vpush(J, RAX);
+            break;
+        }
+        case OP_SET_LOCAL: {
+            UInt slot = GET_ARG(*ip);
+            vpeek(J, RAX, 0);
+            store(J, BASEREG, SLOT(slot), RAX);
+            vpop(J, 1);
+            break;
+        }
+        case OP_GET_GLOBAL: {
+            UInt idx = GET_ARG(*ip);
+            load(J, RCX, VMREG, offsetof(VM, globvals));
+            load(J, RAX, RCX, idx * sizeof(Variable) + offsetof(Variable, value));
+            mov_ri(J, RDX, UNDEFINED_VAL);
+            alu_rr(J, ALU_CMP, RAX, RDX);
+            exitif(J, CC_E);
+            vpush(J, RAX);
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            UInt idx = GET_ARG(*ip);
+            load(J, RCX, VMREG, offsetof(VM, globvals));
+            load(J, RAX, RCX, idx * sizeof(Variable) + offsetof(Variable, value));
+            mov_ri(J, RDX, UNDEFINED_VAL);
+            alu_rr(J, ALU_CMP, RAX, RDX);
+            exitif(J, CC_E);
+            loadbyte(J, RCX, idx * sizeof(Variable) + offsetof(Variable, flags));
+            emit(J, 0xa8);
+            emit(J, VAR_FIXED_BIT); // test al, imm8
+            exitif(J, CC_NE);
+            vpeek(J, RAX, 0);
+            store(J, RCX, idx * sizeof(Variable) + offsetof(Variable, value), RAX);
+            vpop(J, 1);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            upvalue(J, GET_ARG(*ip));
+            load(J, RAX, RCX, offsetof(OUpvalue, location));
+            load(J, RAX, RAX, 0);
+            vpush(J, RAX);
+            break;
+        case OP_GET_FIXED:
+            fixedvalue(J, GET_ARG(*ip));
+            vpush(J, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            upvalue(J, GET_ARG(*ip));
+            loadbyte(J, RCX, offsetof(OUpvalue, closed) + offsetof(Variable, flags));
+            emit(J, 0xa8);
+            emit(J, VAR_FIXED_BIT); // test al, imm8
+            exitif(J, CC_NE);
+            load(J, RCX, RCX, offsetof(OUpvalue, location));
+            vpeek(J, RAX, 0);
+            store(J, RCX, 0, RAX);
+            vpop(J, 1);
+            break;
+        case OP_NEG:
+            vpeek(J, RAX, 0);
+            numguard(J, RAX, XMM0, false);
+            movq_rx(J, RAX, XMM0);
+            mov_ri(J, RCX, (uint64_t)1 << 63);
+            alu_rr(J, ALU_XOR, RAX, RCX);
+            store(J, SPREG, -SLOT(1), RAX);
+            break;
+        case OP_NOT:
+            vpeek(J, RAX, 0);
+            testfalsey(J);
+            setcc(J, CC_BE, RAX);
+            tobool(J);
+            store(J, SPREG, -SLOT(1), RAX);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_ANY:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            vpeek(J, RAX, 1);
+            vpeek(J, RDX, 0);
+            numoperands(J, false, false);
+            numarith(J, op);
+            store(J, SPREG, -SLOT(2), RAX);
+            vpop(J, 1);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            vpeek(J, RAX, 1);
+            vpeek(J, RDX, 0);
+            numoperands(J, false, false);
+            setcc(J, numcmp(J, op, XMM0, XMM1), RAX);
+            tobool(J);
+            store(J, SPREG, -SLOT(2), RAX);
+            vpop(J, 1);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_EQ:
+            vpeek(J, RAX, 1);
+            vpeek(J, RDX, 0);
+            veqal(J);
+            if(op == OP_NOT_EQUAL) {
+                emit(J, 0x34);
+                emit(J, 0x01); // xor al, 1
+            }
+            tobool(J);
+            if(op == OP_EQ) store(J, SPREG, -SLOT(1), RAX); // keeps the left operand
+            else {
+                store(J, SPREG, -SLOT(2), RAX);
+                vpop(J, 1);
+            }
+            break;
+        case OP_ADDRK:
+        case OP_ADDRK_NUM:
+        case OP_ADDRK_ANY:
+        case OP_SUBRK:
+        case OP_MULRK:
+        case OP_DIVRK: {
+            bool anum = rkload(J, RAX, GET_B(*ip));
+            bool bnum = rkload(J, RDX, GET_C(*ip));
+            numoperands(J, anum, bnum);
+            numarith(J, op);
+            rkstore(J, GET_A(*ip));
+            break;
+        }
+        case OP_GREATERRK:
+        case OP_GREATER_EQUALRK:
+        case OP_LESSRK:
+        case OP_LESS_EQUALRK: {
+            bool anum = rkload(J, RAX, GET_B(*ip));
+            bool bnum = rkload(J, RDX, GET_C(*ip));
+            numoperands(J, anum, bnum);
+            setcc(J, numcmp(J, op, XMM0, XMM1), RAX);
+            tobool(J);
+            rkstore(J, GET_A(*ip));
+            break;
+        }
+        case OP_EQUALRK:
+        case OP_NOT_EQUALRK:
+            rkload(J, RAX, GET_B(*ip));
+            rkload(J, RDX, GET_C(*ip));
+            veqal(J);
+            if(op == OP_NOT_EQUALRK) {
+                emit(J, 0x34);
+                emit(J, 0x01); // xor al, 1
+            }
+            tobool(J);
+            rkstore(J, GET_A(*ip));
+            break;
+        case OP_GREATERRK_JMP:
+        case OP_GREATER_EQUALRK_JMP:
+        case OP_LESSRK_JMP:
+        case OP_LESS_EQUALRK_JMP: {
+            bool anum = rkload(J, RAX, GET_B(ip[1]));
+            bool bnum = rkload(J, RDX, GET_C(ip[1]));
+            numoperands(J, anum, bnum);
+            Cond cc = numcmp(J, op, XMM0, XMM1);
+            jmpto(J, cc ^ 1, J->pc + 2 + GET_ARG(*ip)); // jump if false
+            break;
+        }
+        case OP_EQUALRK_JMP:
+        case OP_NOT_EQUALRK_JMP:
+            rkload(J, RAX, GET_B(ip[1]));
+            rkload(J, RDX, GET_C(ip[1]));
+            veqal(J);
+            emit(J, 0x84);
+            emit(J, 0xc0); // test al, al
+            jmpto(J, op == OP_EQUALRK_JMP ? CC_E : CC_NE, J->pc + 2 + GET_ARG(*ip));
+            break;
+        case OP_JMP:
+            jmpto(J, -1, J->pc + 1 + GET_ARG(*ip));
+            break;
+        case OP_JMP_AND_POP:
+            vpop(J, 1);
+            jmpto(J, -1, J->pc + 1 + GET_ARG(*ip));
+            break;
+        case OP_LOOP: { // hot loop exits, interpreter runs its trace
+            HotLoop* loop = &chunk->loops.data[ip[1]];
+            mov_ri(J, RCX, (uint64_t)(uintptr_t)&loop->hotcount);
+            dec32_m(J, RCX, 0);
+            exitif(J, CC_LE);
+            jmpto(J, -1, J->pc + 2 - GET_ARG(*ip));
+            break;
+        }
+        case OP_FORPREP: {
+            load(J, RAX, BASEREG, SLOT(GET_B(ip[1])));
+            bool lnum = rkload(J, RDX, GET_C(ip[1]));
+            numoperands(J, false, lnum);
+            Cond cc = numcmp(J, FOR_CMP(ip[1]), XMM0, XMM1);
+            jmpto(J, cc ^ 1, J->pc + 2 + GET_ARG(*ip)); // jump if done
+            break;
+        }
+        case OP_FORLOOP: { // hot loop exits before the counter is incremented
+            HotLoop* loop    = &chunk->loops.data[ip[2]];
+            Byte     counter = GET_B(ip[1]);
+            mov_ri(J, RCX, (uint64_t)(uintptr_t)&loop->hotcount);
+            dec32_m(J, RCX, 0);
+            exitif(J, CC_LE);
+            load(J, RAX, BASEREG, SLOT(counter));
+            bool snum = rkload(J, RDX, FOR_STEP(ip[1]));
+            numoperands(J, false, snum);
+            numarith(J, OP_ADD);
+            store(J, BASEREG, SLOT(counter), RAX);
+            bool lnum = rkload(J, RDX, GET_C(ip[1]));
+            numguard(J, RDX, XMM1, lnum);
+            Cond cc = numcmp(J, FOR_CMP(ip[1]), XMM0, XMM1);
+            jmpto(J, cc, J->pc + 3 - GET_ARG(*ip)); // jump back if not done
+            break;
+        }
+        case OP_JMP_IF_FALSE:
+            vpeek(J, RAX, 0);
+            testfalsey(J);
+            jmpto(J, CC_BE, J->pc + 1 + GET_ARG(*ip));
+            break;
+        case OP_JMP_IF_FALSE_POP:
+            vpeek(J, RAX, 0);
+            vpop(J, 1);
+            testfalsey(J);
+            jmpto(J, CC_BE, J->pc + 1 + GET_ARG(*ip));
+            break;
+        case OP_JMP_IF_FALSE_OR_POP:
+            vpeek(J, RAX, 0);
+            testfalsey(J);
+            jmpto(J, CC_BE, J->pc + 1 + GET_ARG(*ip));
+            vpop(J, 1);
+            break;
+        case OP_JMP_IF_FALSE_AND_POP: {
+            vpeek(J, RAX, 0);
+            testfalsey(J);
+            UInt truthy = jcc8(J, CC_A);
+            vpop(J, 1);
+            jmpto(J, -1, J->pc + 1 + GET_ARG(*ip));
+            here8(J, truthy);
+            break;
+        }
+        case OP_GET_PROPERTY:
+        case OP_GET_LOCAL_PROPERTY: {
+            InlineCache* cache;
+            if(op == OP_GET_PROPERTY) {
+                cache = &chunk->caches.data[ip[1]];
+                mov_rr(J, RDI, SPREG);
+            } else {
+                cache = &chunk->caches.data[ip[2]];
+                load(J, RAX, BASEREG, SLOT(GET_ARG(*ip)));
+                store(J, SPREG, 0, RAX);
+                lea(J, RDI, SPREG, SLOT(1));
+            }
+            mov_ri(J, RSI, (uint64_t)(uintptr_t)cache);
+            callhelper(J, jit_getproperty);
+            emit(J, 0x84);
+            emit(J, 0xc0); // test al, al
+            exitif(J, CC_E);
+            if(op == OP_GET_LOCAL_PROPERTY) alu_ri(J, ALU_ADD, SPREG, SLOT(1));
+            break;
+        }
+        case OP_SET_PROPERTY:
+            mov_rr(J, RDI, SPREG);
+            mov_ri(J, RSI, (uint64_t)(uintptr_t)&chunk->caches.data[ip[1]]);
+            callhelper(J, jit_setproperty);
+            emit(J, 0x84);
+            emit(J, 0xc0); // test al, al
+            exitif(J, CC_E);
+            vpop(J, 2);
+            break;
+        case OP_RET: { // single value return into a caller that wants one value
+            if(GET_ARG(*ip) != 1) {
+                exitif(J, -1);
+                break;
+            }
+            cmp32_mi(J, FRAMEREG, offsetof(CallFrame, retcnt), 1);
+            exitif(J, CC_NE);
+            load(J, RCX, VMREG, offsetof(VM, upvaltop));
+            alu_rr(J, ALU_CMP, RCX, BASEREG);
+            exitif(J, CC_A); // frame has open upvalues
+            vpeek(J, RAX, 0);
+            store(J, BASEREG, 0, RAX);
+            lea(J, SPREG, BASEREG, SLOT(1));
+            mov32_mi(J, VMREG, offsetof(VM, mulretc), 1);
+            dec32_m(J, VMREG, offsetof(VM, fc));
+            // continue in the caller
+            load(J, RAX, FRAMEREG, (Int)offsetof(CallFrame, ip) - (Int)sizeof(CallFrame));
+            emit(J, 0xe9);
+            emit32(J, J->epilogue - (J->len + 4));
+            break;
+        }
+        default: // no template, interpreter executes it
+            exitif(J, -1);
+            break;
+    }
+}
+
+/*
+ * Entry stub (JitFn) saves callee-saved registers, loads the VM state
+ * and jumps to the entry instruction, the epilogue following it writes
+ * back the stack pointer and returns the exit instruction (in rax).
+ */
+sstatic void prologue(Jit* J)
+{
+    push_r(J, RBX);
+    push_r(J, R12);
+    push_r(J, R13);
+    push_r(J, R14);
+    push_r(J, R15); // stack is 16 byte aligned for helper calls
+    mov_rr(J, VMREG, RDI);
+    mov_rr(J, FRAMEREG, RSI);
+    load(J, BASEREG, RSI, offsetof(CallFrame, sp));
+    load(J, SPREG, RDI, offsetof(VM, sp));
+    mov_ri(J, QNANREG, QNAN);
+    emit(J, 0xff);
+    emit(J, 0xe2); // jmp rdx
+    J->epilogue = J->len;
+    store(J, VMREG, offsetof(VM, sp), SPREG);
+    pop_r(J, R15);
+    pop_r(J, R14);
+    pop_r(J, R13);
+    pop_r(J, R12);
+    pop_r(J, RBX);
+    emit(J, 0xc3); // ret
+}
+
+/* Emit exit stubs and resolve all jumps */
+sstatic void linkcode(Jit* J)
+{
+    Inst* code = J->fn->chunk.code.data;
+    Int   stub = -1; // exit stub of the last instruction
+    UInt  pc   = 0;
+    for(UInt i = 0; i < J->fixupc; i++) {
+        Fixup* fixup = &J->fixups[i];
+        if(!(fixup->pc & FIXUP_EXIT)) continue;
+        // exits are recorded in bytecode order
+        if(stub < 0 || (fixup->pc & ~FIXUP_EXIT) != pc) {
+            pc   = fixup->pc & ~FIXUP_EXIT;
+            stub = J->len;
+            mov_ri(J, RAX, (uint64_t)(uintptr_t)(code + pc));
+            emit(J, 0xe9);
+            emit32(J, J->epilogue - (J->len + 4));
+        }
+        patch32(J, fixup->at, stub - (fixup->at + 4));
+    }
+    for(UInt i = 0; i < J->fixupc; i++) {
+        Fixup* fixup = &J->fixups[i];
+        if(fixup->pc & FIXUP_EXIT) continue;
+        patch32(J, fixup->at, J->entries[fixup->pc] - (fixup->at + 4));
+    }
+}
+
+/* Copy emitted code into executable memory, NULL on failure */
+sstatic Byte* mapcode(Jit* J)
+{
+    Byte* mem = mmap(NULL, J->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return NULL;
+    memcpy(mem, J->code, J->len);
+    if(mprotect(mem, J->len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, J->len);
+        return NULL;
+    }
+    return mem;
+}
+
+/* Compile 'fn' into machine code, returns false if it can't be compiled */
+bool jit_compile(VM* vm, OFunction* fn)
+{
+    Chunk* chunk = &fn->chunk;
+    UInt   len   = chunk->code.len;
+    Jit    J;
+    memset(&J, 0, sizeof(Jit));
+    J.vm      = vm;
+    J.fn      = fn;
+    J.entries = MALLOC(vm, (len + 1) * sizeof(UInt));
+    prologue(&J);
+    for(UInt pc = 0; pc < len; pc += Chunk_oplen(chunk, pc)) {
+        J.entries[pc] = J.len;
+        J.pc          = pc;
+        template(&J, &chunk->code.data[pc]);
+    }
+    linkcode(&J);
+    Byte* mem = mapcode(&J);
+    FREE(vm, J.code);
+    FREE(vm, J.fixups);
+    if(unlikely(mem == NULL)) {
+        FREE(vm, J.entries);
+        return false;
+    }
+    JitCode* jc = MALLOC(vm, sizeof(JitCode));
+    jc->mem     = mem;
+    jc->size    = J.len;
+    jc->entries = J.entries;
+    fn->jit     = jc;
+    return true;
+}
+
+void jit_free(VM* vm, OFunction* fn)
+{
+    JitCode* jc = fn->jit;
+    if(jc != NULL) {
+        munmap(jc->mem, jc->size);
+        FREE(vm, jc->entries);
+        FREE(vm, jc);
+        fn->jit = NULL;
+    }
+    for(UInt i = 0; i < fn->chunk.loops.len; i++) {
+        Trace* trace = fn->chunk.loops.data[i].trace;
+        if(trace == NULL) continue;
+        munmap(trace->mem, trace->size);
+        FREE(vm, trace->shapes);
+        FREE(vm, trace);
+        fn->chunk.loops.data[i].trace = NULL;
+    }
+}
+
+
+
+
+//======================= TRACES =======================//
+
+/*
+ * Trace JIT.
+ *
+ * Each 'OP_LOOP' and 'OP_FORLOOP' counts iterations of its loop
+ * ('HotLoop'), when the loop gets hot the recorder executes one
+ * iteration of the loop body in place of the interpreter and records
+ * executed instructions along with the branch directions and receiver
+ * shapes it observed. Recording aborts and the interpreter takes over
+ * on any instruction the trace can't contain (calls, returns,
+ * allocations, non-number arithmetic, inner loops...).
+ *
+ * The trace is straight line code ending with a jump back to its start.
+ * Compiler keeps the value stack symbolic, constants, locals and globals
+ * are loaded only when used and numbers stay unboxed in xmm registers.
+ * Locals and globals known to be numbers are cached in xmm registers
+ * until the end of the iteration, so only their first use is guarded.
+ * Type, shape and branch guards side-exit into the interpreter at the
+ * guarded instruction, exit stub first stores the symbolic stack into
+ * the VM stack. Locals and globals are always written through, exits
+ * never restore them.
+ *
+ * Registers are the same as in the baseline code, except r13 which holds
+ * the VM stack pointer at the loop start (trace stack is addressed from
+ * it), xmm2 - xmm15 hold unboxed numbers.
+ */
+
+/* Recorded instruction */
+typedef struct {
+    UInt    pc; // bytecode offset
+    Byte    op; // opcode
+    Byte    taken; // branch was taken
+    OShape* shape; // receiver shape (property access)
+    UInt    slot; // receiver field slot (property access)
+} TraceIns;
+
+typedef struct {
+    VM*        vm;
+    CallFrame* frame;
+    TraceIns*  ins;
+    UInt       len;
+    UInt       cap;
+    UInt       base; // frame slots below the trace stack (loop start)
+} Recorder;
+
+/* Symbolic trace stack value */
+typedef enum {
+    TV_MEM, // stored in the VM stack
+    TV_CONST, // constant 'k'
+    TV_SLOT, // frame slot 'idx' (not loaded yet)
+    TV_GLOBAL, // global 'idx' (not loaded yet)
+    TV_XMM, // unboxed number in xmm register 'reg'
+    TV_CC, // boolean, true if condition 'reg' holds (cpu flags)
+} TValKind;
+
+typedef struct {
+    Byte  kind;
+    Byte  num; // known to be a double
+    Byte  reg; // xmm register or condition code
+    UInt  idx; // stack position, frame slot or global index
+    Value k; // constant
+} TVal;
+
+/* Owner of the xmm register */
+typedef enum {
+    XO_FREE,
+    XO_TEMP, // operand of the current instruction
+    XO_STACK, // trace stack value
+    XO_SLOT, // cached frame slot
+    XO_GLOBAL, // cached global
+} XOwner;
+
+typedef struct {
+    Byte kind;
+    UInt idx; // stack position, frame slot or global index
+    UInt age; // allocation order, oldest cached variable is evicted first
+} XReg;
+
+    #define XMM_FIRST 2
+    #define XMM_LAST  15
+
+/* Side exit, 'at' is the rel32 operand of the jump into the exit stub */
+typedef struct {
+    UInt at;
+    UInt pc; // bytecode offset the interpreter continues at
+    UInt snap; // start of the stack snapshot in 'snaps'
+    UInt depth; // trace stack depth
+} TExit;
+
+typedef struct {
+    Jit      J; // code buffer
+    TVal*    stack; // symbolic trace stack
+    UInt     depth;
+    UInt     base; // frame slots below the trace stack, locals above are on it
+    UInt     stackcap;
+    XReg     xmm[XMM_LAST + 1];
+    UInt     age;
+    TExit*   exits;
+    UInt     exitc;
+    UInt     exitcap;
+    TVal*    snaps; // stack snapshots of exits
+    UInt     snapc;
+    UInt     snapcap;
+    OShape** shapes;
+    UInt     shapec;
+    UInt     shapecap;
+} TraceJit;
+
+
+
+
+//======================= RECORDER =======================//
+
+sstatic void addins(Recorder* R, TraceIns* ins)
+{
+    if(unlikely(R->len == R->cap)) {
+        R->cap = GROW_ARRAY_CAPACITY(R->cap, 64);
+        R->ins = REALLOC(R->vm, R->ins, R->cap * sizeof(TraceIns));
+    }
+    R->ins[R->len++] = *ins;
+}
+
+sstatic bool recorded(Recorder* R, UInt pc)
+{
+    for(UInt i = 0; i < R->len; i++)
+        if(R->ins[i].pc == pc) return true;
+    return false;
+}
+
+/* Field slot of the instance 'receiver' (with shape), -1 if none */
+sstatic Int fieldslot(Value receiver, Value name)
+{
+    if(!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape == NULL) return -1;
+    Value slot;
+    if(!HashTable_get(&AS_INSTANCE(receiver)->shape->slots, name, &slot)) return -1;
+    return (Int)AS_NUMBER(slot);
+}
+
+/*
+ * Execute one iteration of the loop starting at 'header' while
+ * recording it. Returns the instruction where the recording stopped,
+ * the trace is complete only if it stopped at the 'header' with
+ * 'closed' set, otherwise the interpreter continues at the returned
+ * instruction which was not executed.
+ */
+sstatic Inst* record(Recorder* R, Inst* header, bool* closed)
+{
+    VM*        vm    = R->vm;
+    CallFrame* frame = R->frame;
+    Chunk*     chunk = &frame->closure->fn->chunk;
+    Value*     K     = chunk->constants.data;
+    Value*     base  = vm->sp; // stack top at the loop start
+    Inst*      ip    = header;
+    *closed          = false;
+    #define PEEK(i)   (vm->sp[-1 - (i)])
+    #define RK(rk)    (RKISCONST(rk) ? K[RKINDEX(rk)] : frame->sp[rk])
+    #define RA_SET(v)                                                                    \
+        ((GET_A(*ip) == 0) ? (void)(*vm->sp++ = (v)) : (void)(frame->sp[GET_A(*ip)] = (v)))
+    #define NUMBERS(a, b)                                                                \
+        if(!IS_NUMBER(a) || !IS_NUMBER(b)) return ip
+    while(R->len < S_JIT_TRACE_MAX) {
+        TraceIns ins  = {ip - chunk->code.data, Chunk_unfuse(GET_OP(*ip)), 0, NULL, 0};
+        Inst*    next = ip + Chunk_oplen(chunk, ins.pc);
+        switch(ins.op) {
+            case OP_TRUE:
+                *vm->sp++ = TRUE_VAL;
+                break;
+            case OP_FALSE:
+                *vm->sp++ = FALSE_VAL;
+                break;
+            case OP_NIL:
+                *vm->sp++ = NIL_VAL;
+                break;
+            case OP_NILN:
+                for(UInt n = GET_ARG(*ip); n > 0; n--)
+                    *vm->sp++ = NIL_VAL;
+                break;
+            case OP_CONST:
+                *vm->sp++ = K[GET_ARG(*ip)];
+                break;
+            case OP_POP:
+                vm->sp--;
+                break;
+            case OP_POPN:
+                vm->sp -= GET_ARG(*ip);
+                break;
+            case OP_GET_LOCAL:
+                *vm->sp++ = frame->sp[GET_ARG(*ip)];
+                break;
+            case OP_SET_LOCAL:
+                frame->sp[GET_ARG(*ip)] = *--vm->sp;
+                break;
+            case OP_GET_GLOBAL: {
+                Variable* global = &vm->globvals[GET_ARG(*ip)];
+                if(IS_UNDEFINED(global->value)) return ip;
+                *vm->sp++ = global->value;
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                Variable* global = &vm->globvals[GET_ARG(*ip)];
+                if(IS_UNDEFINED(global->value) || VAR_CHECK(global, VAR_FIXED_BIT)) return ip;
+                global->value = *--vm->sp;
+                break;
+            }
+            case OP_GET_UPVALUE:
+                *vm->sp++ = *frame->closure->upvals[GET_ARG(*ip)]->location;
+                break;
+            case OP_GET_FIXED:
+                *vm->sp++ = frame->closure->fixed[GET_ARG(*ip)];
+                break;
+            case OP_SET_UPVALUE: {
+                OUpvalue* upval = frame->closure->upvals[GET_ARG(*ip)];
+                if(VAR_CHECK(&upval->closed, VAR_FIXED_BIT)) return ip;
+                *upval->location = *--vm->sp;
+                break;
+            }
+            case OP_NEG:
+                if(!IS_NUMBER(PEEK(0))) return ip;
+                PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+                break;
+            case OP_NOT:
+                PEEK(0) = BOOL_VAL(ISFALSEY(PEEK(0)));
+                break;
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_ANY:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL: {
+                Value a = PEEK(1), b = PEEK(0);
+                NUMBERS(a, b);
+                double x = AS_NUMBER(a), y = AS_NUMBER(b);
+                Value  r;
+                switch(ins.op) {
+                    case OP_ADD:
+                    case OP_ADD_NUM:
+                    case OP_ADD_ANY:
+                        r = NUMBER_VAL(x + y);
+                        break;
+                    case OP_SUB:
+                        r = NUMBER_VAL(x - y);
+                        break;
+                    case OP_MUL:
+                        r = NUMBER_VAL(x * y);
+                        break;
+                    case OP_DIV:
+                        r = NUMBER_VAL(x / y);
+                        break;
+                    case OP_GREATER:
+                        r = BOOL_VAL(x > y);
+                        break;
+                    case OP_GREATER_EQUAL:
+                        r = BOOL_VAL(x >= y);
+                        break;
+                    case OP_LESS:
+                        r = BOOL_VAL(x < y);
+                        break;
+                    default:
+                        r = BOOL_VAL(x <= y);
+                        break;
+                }
+                vm->sp--;
+                PEEK(0) = r;
+                break;
+            }
+            case OP_EQUAL:
+            case OP_NOT_EQUAL: {
+                bool eq  = veq(PEEK(1), PEEK(0));
+                vm->sp--;
+                PEEK(0) = BOOL_VAL(ins.op == OP_EQUAL ? eq : !eq);
+                break;
+            }
+            case OP_EQ:
+                PEEK(0) = BOOL_VAL(veq(PEEK(1), PEEK(0)));
+                break;
+            case OP_ADDRK:
+            case OP_ADDRK_NUM:
+            case OP_ADDRK_ANY:
+            case OP_SUBRK:
+            case OP_MULRK:
+            case OP_DIVRK:
+            case OP_GREATERRK:
+            case OP_GREATER_EQUALRK:
+            case OP_LESSRK:
+            case OP_LESS_EQUALRK: {
+                Value a = RK(GET_B(*ip)), b = RK(GET_C(*ip));
+                NUMBERS(a, b);
+                double x = AS_NUMBER(a), y = AS_NUMBER(b);
+                switch(ins.op) {
+                    case OP_ADDRK:
+                    case OP_ADDRK_NUM:
+                    case OP_ADDRK_ANY:
+                        RA_SET(NUMBER_VAL(x + y));
+                        break;
+                    case OP_SUBRK:
+                        RA_SET(NUMBER_VAL(x - y));
+                        break;
+                    case OP_MULRK:
+                        RA_SET(NUMBER_VAL(x * y));
+                        break;
+                    case OP_DIVRK:
+                        RA_SET(NUMBER_VAL(x / y));
+                        break;
+                    case OP_GREATERRK:
+                        RA_SET(BOOL_VAL(x > y));
+                        break;
+                    case OP_GREATER_EQUALRK:
+                        RA_SET(BOOL_VAL(x >= y));
+                        break;
+                    case OP_LESSRK:
+                        RA_SET(BOOL_VAL(x < y));
+                        break;
+                    default:
+                        RA_SET(BOOL_VAL(x <= y));
+                        break;
+                }
+                break;
+            }
+            case OP_EQUALRK:
+            case OP_NOT_EQUALRK: {
+                bool eq = veq(RK(GET_B(*ip)), RK(GET_C(*ip)));
+                RA_SET(BOOL_VAL(ins.op == OP_EQUALRK ? eq : !eq));
+                break;
+            }
+            case OP_GREATERRK_JMP:
+            case OP_GREATER_EQUALRK_JMP:
+            case OP_LESSRK_JMP:
+            case OP_LESS_EQUALRK_JMP: {
+                Value a = RK(GET_B(ip[1])), b = RK(GET_C(ip[1]));
+                NUMBERS(a, b);
+                double x = AS_NUMBER(a), y = AS_NUMBER(b);
+                bool   holds;
+                switch(ins.op) {
+                    case OP_GREATERRK_JMP:
+                        holds = x > y;
+                        break;
+                    case OP_GREATER_EQUALRK_JMP:
+                        holds = x >= y;
+                        break;
+                    case OP_LESSRK_JMP:
+                        holds = x < y;
+                        break;
+                    default:
+                        holds = x <= y;
+                        break;
+                }
+                ins.taken = !holds;
+                break;
+            }
+            case OP_EQUALRK_JMP:
+            case OP_NOT_EQUALRK_JMP: {
+                bool eq   = veq(RK(GET_B(ip[1])), RK(GET_C(ip[1])));
+                ins.taken = (ins.op == OP_EQUALRK_JMP ? !eq : eq);
+                break;
+            }
+            case OP_JMP_IF_FALSE:
+                ins.taken = ISFALSEY(PEEK(0));
+                break;
+            case OP_JMP_IF_FALSE_POP:
+                ins.taken = ISFALSEY(PEEK(0));
+                vm->sp--;
+                break;
+            case OP_JMP_IF_FALSE_OR_POP:
+                ins.taken = ISFALSEY(PEEK(0));
+                if(!ins.taken) vm->sp--;
+                break;
+            case OP_JMP_IF_FALSE_AND_POP:
+                ins.taken = ISFALSEY(PEEK(0));
+                if(ins.taken) vm->sp--;
+                break;
+            case OP_JMP_AND_POP:
+                vm->sp--;
+                // fall through
+            case OP_JMP:
+                ins.taken = true;
+                break;
+            case OP_LOOP: {
+                Inst* target = next - GET_ARG(*ip);
+                if(target != header && recorded(R, target - chunk->code.data))
+                    return ip; // inner loop
+                addins(R, &ins);
+                if(target == header) {
+                    *closed = true;
+                    return header;
+                }
+                ip = target;
+                continue;
+            }
+            case OP_FORPREP: {
+                Value a = frame->sp[GET_B(ip[1])], b = RK(GET_C(ip[1]));
+                NUMBERS(a, b);
+                ins.taken = !forcond(FOR_CMP(ip[1]), AS_NUMBER(a), AS_NUMBER(b));
+                break;
+            }
+            case OP_FORLOOP: { // counter and limit are numbers
+                Inst   ext    = ip[1];
+                Inst*  target = next - GET_ARG(*ip);
+                Value* count  = &frame->sp[GET_B(ext)];
+                if(target != header && recorded(R, target - chunk->code.data))
+                    return ip; // inner loop
+                *count = NUMBER_VAL(AS_NUMBER(*count) + AS_NUMBER(RK(FOR_STEP(ext))));
+                if(!forcond(FOR_CMP(ext), AS_NUMBER(*count), AS_NUMBER(RK(GET_C(ext)))))
+                    return next; // loop is done
+                addins(R, &ins);
+                if(target == header) {
+                    *closed = true;
+                    return header;
+                }
+                ip = target;
+                continue;
+            }
+            case OP_GET_PROPERTY:
+            case OP_GET_LOCAL_PROPERTY: {
+                bool  local    = (ins.op == OP_GET_LOCAL_PROPERTY);
+                Value receiver = (local ? frame->sp[GET_ARG(*ip)] : PEEK(0));
+                Int   slot     = fieldslot(receiver, K[local ? ip[1] : GET_ARG(*ip)]);
+                if(slot < 0) return ip;
+                ins.shape = AS_INSTANCE(receiver)->shape;
+                ins.slot  = slot;
+                if(local) vm->sp++;
+                PEEK(0) = AS_INSTANCE(receiver)->slots[slot];
+                break;
+            }
+            case OP_SET_PROPERTY: {
+                Value receiver = PEEK(1);
+                Int   slot     = fieldslot(receiver, K[GET_ARG(*ip)]);
+                if(slot < 0) return ip;
+                ins.shape                             = AS_INSTANCE(receiver)->shape;
+                ins.slot                              = slot;
+                AS_INSTANCE(receiver)->slots[slot]    = PEEK(0);
+                vm->sp                               -= 2;
+                break;
+            }
+            default: // can't be traced
+                return ip;
+        }
+        if(ins.taken) next += GET_ARG(*ip); // forward jump
+        if(unlikely(vm->sp < base)) return next; // pops values below the loop
+        addins(R, &ins);
+        ip = next;
+    }
+    #undef PEEK
+    #undef RK
+    #undef RA_SET
+    #undef NUMBERS
+    return ip; // trace too long
+}
+
+
+
+
+//======================= TRACE COMPILER =======================//
+
+sstatic void xown(TraceJit* T, Byte x, XOwner kind, UInt idx)
+{
+    T->xmm[x].kind = kind;
+    T->xmm[x].idx  = idx;
+    T->xmm[x].age  = T->age++;
+}
+
+/* Register caching the variable, -1 if none */
+sstatic Int xfind(TraceJit* T, XOwner kind, UInt idx)
+{
+    for(Byte x = XMM_FIRST; x <= XMM_LAST; x++)
+        if(T->xmm[x].kind == kind && T->xmm[x].idx == idx) return x;
+    return -1;
+}
+
+sstatic void xdrop(TraceJit* T, XOwner kind, UInt idx)
+{
+    Int x = xfind(T, kind, idx);
+    if(x >= 0) T->xmm[x].kind = XO_FREE;
+}
+
+/* Release operand registers of the previous instruction */
+sstatic void xfreetemps(TraceJit* T)
+{
+    for(Byte x = XMM_FIRST; x <= XMM_LAST; x++)
+        if(T->xmm[x].kind == XO_TEMP) T->xmm[x].kind = XO_FREE;
+}
+
+/* Load trace value into 'r', boolean in flags only into rax (clobbers rcx) */
+sstatic void gprload(Jit* J, TVal* v, Reg r)
+{
+    switch(v->kind) {
+        case TV_MEM:
+            load(J, r, SPREG, SLOT(v->idx));
+            break;
+        case TV_CONST:
+            mov_ri(J, r, v->k);
+            break;
+        case TV_SLOT:
+            load(J, r, BASEREG, SLOT(v->idx));
+            break;
+        case TV_GLOBAL:
+            load(J, RCX, VMREG, offsetof(VM, globvals));
+            load(J, r, RCX, v->idx * sizeof(Variable) + offsetof(Variable, value));
+            break;
+        case TV_XMM:
+            movq_rx(J, r, v->reg);
+            break;
+        case TV_CC:
+            ASSERT(r == RAX, "Boolean in flags loads only into rax.");
+            setcc(J, v->reg, RAX);
+            tobool(J);
+            break;
+        default:
+            unreachable;
+    }
+}
+
+/* Write the trace stack value 'i' into the VM stack */
+sstatic void tmaterialize(TraceJit* T, UInt i)
+{
+    TVal* v = &T->stack[i];
+    if(v->kind == TV_MEM) return;
+    if(v->kind == TV_XMM) {
+        movsd_mx(&T->J, SPREG, SLOT(i), v->reg);
+        T->xmm[v->reg].kind = XO_FREE;
+        v->num              = true;
+    } else {
+        gprload(&T->J, v, RAX);
+        store(&T->J, SPREG, SLOT(i), RAX);
+    }
+    v->kind = TV_MEM;
+    v->idx  = i;
+}
+
+/*
+ * Allocate temporary xmm register, registers in 'pin' mask are never
+ * taken. Free register is taken first, then the register caching the
+ * oldest variable and at last the bottom trace stack number is spilled.
+ */
+sstatic Byte xalloc(TraceJit* T, uint32_t pin)
+{
+    Int victim = -1;
+    for(Byte x = XMM_FIRST; x <= XMM_LAST; x++) {
+        XReg* r = &T->xmm[x];
+        if(pin & (1u << x)) continue;
+        if(r->kind == XO_FREE) {
+            victim = x;
+            break;
+        }
+        if((r->kind == XO_SLOT || r->kind == XO_GLOBAL) &&
+           (victim < 0 || r->age < T->xmm[victim].age))
+            victim = x;
+    }
+    for(UInt i = 0; victim < 0 && i < T->depth; i++) {
+        TVal* v = &T->stack[i];
+        if(v->kind == TV_XMM && !(pin & (1u << v->reg))) {
+            victim = v->reg;
+            tmaterialize(T, i);
+        }
+    }
+    ASSERT(victim >= 0, "Out of xmm registers.");
+    xown(T, victim, XO_TEMP, 0);
+    return victim;
+}
+
+sstatic void tpush(TraceJit* T, TVal v)
+{
+    if(unlikely(T->depth == T->stackcap)) {
+        T->stackcap = GROW_ARRAY_CAPACITY(T->stackcap, 16);
+        T->stack    = REALLOC(T->J.vm, T->stack, T->stackcap * sizeof(TVal));
+    }
+    if(v.kind == TV_XMM) xown(T, v.reg, XO_STACK, T->depth);
+    T->stack[T->depth++] = v;
+}
+
+/* Pop trace stack value, its register is released after the instruction */
+sstatic TVal tpop(TraceJit* T)
+{
+    TVal v = T->stack[--T->depth];
+    if(v.kind == TV_XMM) T->xmm[v.reg].kind = XO_TEMP;
+    return v;
+}
+
+sstatic TVal* tpeek(TraceJit* T, UInt peek)
+{
+    return &T->stack[T->depth - 1 - peek];
+}
+
+/* Push value in 'r' by storing it into its VM stack slot */
+sstatic void tpushmem(TraceJit* T, Reg r, bool num)
+{
+    store(&T->J, SPREG, SLOT(T->depth), r);
+    tpush(T, (TVal){.kind = TV_MEM, .num = num, .idx = T->depth});
+}
+
+sstatic void tpushxmm(TraceJit* T, Byte x)
+{
+    tpush(T, (TVal){.kind = TV_XMM, .num = true, .reg = x});
+}
+
+sstatic void tpushcc(TraceJit* T, Cond cc)
+{
+    tpush(T, (TVal){.kind = TV_CC, .reg = cc});
+}
+
+/*
+ * Trace value of the frame slot, locals declared inside of the loop
+ * body live on the trace stack (returns copy of the stack value).
+ */
+sstatic TVal tslot(TraceJit* T, UInt slot)
+{
+    if(slot < T->base) return (TVal){.kind = TV_SLOT, .idx = slot};
+    return T->stack[slot - T->base];
+}
+
+/* Trace value of the RK operand */
+sstatic TVal trk(TraceJit* T, Byte rk)
+{
+    if(RKISCONST(rk)) {
+        Value k = T->J.fn->chunk.constants.data[RKINDEX(rk)];
+        return (TVal){.kind = TV_CONST, .num = IS_NUMBER(k), .k = numconst(k)};
+    }
+    return tslot(T, rk);
+}
+
+/* Side exit into the interpreter at the current instruction (if 'cc', -1 always) */
+sstatic void texit(TraceJit* T, Int cc)
+{
+    Jit* J = &T->J;
+    if(cc < 0) emit(J, 0xe9);
+    else {
+        emit(J, 0x0f);
+        emit(J, 0x80 | cc);
+    }
+    emit32(J, 0);
+    if(unlikely(T->exitc == T->exitcap)) {
+        T->exitcap = GROW_ARRAY_CAPACITY(T->exitcap, 16);
+        T->exits   = REALLOC(J->vm, T->exits, T->exitcap * sizeof(TExit));
+    }
+    if(unlikely(T->snapc + T->depth > T->snapcap)) {
+        while(T->snapc + T->depth > T->snapcap)
+            T->snapcap = GROW_ARRAY_CAPACITY(T->snapcap, 64);
+        T->snaps = REALLOC(J->vm, T->snaps, T->snapcap * sizeof(TVal));
+    }
+    T->exits[T->exitc++] = (TExit){J->len - 4, J->pc, T->snapc, T->depth};
+    if(T->depth) { // 'stack' is NULL until the first value is tracked
+        memcpy(&T->snaps[T->snapc], T->stack, T->depth * sizeof(TVal));
+        T->snapc += T->depth;
+    }
+}
+
+/*
+ * Load number into xmm register and return it, registers in 'pin'
+ * are left intact. Guards the type unless it is known, loaded locals
+ * and globals stay cached in the register.
+ */
+sstatic Byte xnum(TraceJit* T, TVal* v, uint32_t pin)
+{
+    Jit*   J     = &T->J;
+    XOwner owner = XO_TEMP;
+    if(v->kind == TV_XMM) return v->reg;
+    if(v->kind == TV_SLOT || v->kind == TV_GLOBAL) {
+        owner = (v->kind == TV_SLOT ? XO_SLOT : XO_GLOBAL);
+        Int x = xfind(T, owner, v->idx);
+        if(x >= 0) return x;
+    }
+    gprload(J, v, RAX);
+    Byte x = xalloc(T, pin); // spills before the guard
+    if(v->num) movq_xr(J, x, RAX);
+    else {
+        UInt dbl = numtest(J, RAX);
+        texit(T, CC_NE);
+        numload(J, RAX, x, dbl);
+    }
+    if(owner != XO_TEMP) xown(T, x, owner, v->idx);
+    return x;
+}
+
+/* Arithmetic on numbers 'a' and 'b', returns the result register */
+sstatic Byte tarith(TraceJit* T, OpCode op, TVal* a, TVal* b)
+{
+    Byte xa = xnum(T, a, 0);
+    Byte xb = xnum(T, b, 1u << xa);
+    Byte x  = xalloc(T, (1u << xa) | (1u << xb));
+    movaps(&T->J, x, xa);
+    sse_rr(&T->J, sseop(op), x, xb);
+    return x;
+}
+
+/* Compare numbers 'a' and 'b', returns condition code set if true */
+sstatic Cond tcmp(TraceJit* T, OpCode op, TVal* a, TVal* b)
+{
+    Byte xa = xnum(T, a, 0);
+    Byte xb = xnum(T, b, 1u << xa);
+    return numcmp(&T->J, op, xa, xb);
+}
+
+/* Check 'a' and 'b' for equality, returns condition code set if equal */
+sstatic Cond teq(TraceJit* T, TVal* a, TVal* b)
+{
+    gprload(&T->J, a, RAX);
+    gprload(&T->J, b, RDX);
+    veqal(&T->J);
+    emit(&T->J, 0x84);
+    emit(&T->J, 0xc0); // test al, al
+    return CC_NE;
+}
+
+/* Branch guard, exits if the value is not falsey ('taken') or truthy as recorded */
+sstatic void tbranch(TraceJit* T, TVal* v, bool taken)
+{
+    if(v->kind == TV_CC) texit(T, taken ? v->reg : v->reg ^ 1);
+    else if(v->kind == TV_CONST || v->num) {
+        // known at compile time, recorded direction is the only one
+    } else {
+        gprload(&T->J, v, RAX);
+        testfalsey(&T->J);
+        texit(T, taken ? CC_A : CC_BE);
+    }
+}
+
+/* Replace the trace stack value 'i' (local declared inside of the loop) */
+sstatic void tsetstack(TraceJit* T, UInt i, TVal v)
+{
+    Jit*  J   = &T->J;
+    TVal* old = &T->stack[i];
+    if(old->kind == TV_XMM) T->xmm[old->reg].kind = XO_FREE;
+    if(v.kind == TV_CC || (v.kind == TV_MEM && v.idx != i)) {
+        gprload(J, &v, RAX);
+        store(J, SPREG, SLOT(i), RAX);
+        v = (TVal){.kind = TV_MEM, .num = v.num, .idx = i};
+    } else if(v.kind == TV_XMM) xown(T, v.reg, XO_STACK, i);
+    *old = v;
+}
+
+/* Store 'v' into frame slot 'slot', the register of the number caches it */
+sstatic void tsetslot(TraceJit* T, UInt slot, TVal v)
+{
+    Jit* J = &T->J;
+    if(slot >= T->base) {
+        tsetstack(T, slot - T->base, v);
+        return;
+    }
+    for(UInt i = 0; i < T->depth; i++)
+        if(T->stack[i].kind == TV_SLOT && T->stack[i].idx == slot) tmaterialize(T, i);
+    xdrop(T, XO_SLOT, slot);
+    if(v.kind == TV_XMM) {
+        movsd_mx(J, BASEREG, SLOT(slot), v.reg);
+        xown(T, v.reg, XO_SLOT, slot);
+    } else {
+        gprload(J, &v, RAX);
+        store(J, BASEREG, SLOT(slot), RAX);
+    }
+}
+
+/* Store 'v' into global 'idx', the register of the number caches it */
+sstatic void tsetglobal(TraceJit* T, UInt idx, TVal v)
+{
+    Jit* J    = &T->J;
+    Int  disp = idx * sizeof(Variable) + offsetof(Variable, value);
+    for(UInt i = 0; i < T->depth; i++)
+        if(T->stack[i].kind == TV_GLOBAL && T->stack[i].idx == idx) tmaterialize(T, i);
+    xdrop(T, XO_GLOBAL, idx);
+    if(v.kind == TV_XMM) {
+        load(J, RCX, VMREG, offsetof(VM, globvals));
+        movsd_mx(J, RCX, disp, v.reg);
+        xown(T, v.reg, XO_GLOBAL, idx);
+    } else {
+        gprload(J, &v, RAX);
+        load(J, RCX, VMREG, offsetof(VM, globvals));
+        store(J, RCX, disp, RAX);
+    }
+}
+
+/* Store register instruction result ('ra' 0 pushes) */
+sstatic void tsetra(TraceJit* T, Byte ra, TVal v)
+{
+    if(ra == 0) tpush(T, v);
+    else tsetslot(T, ra, v);
+}
+
+/* Guard the instance 'v' has the 'shape', loads its field slots into rdx */
+sstatic void tguardshape(TraceJit* T, TVal* v, OShape* shape)
+{
+    Jit* J = &T->J;
+    gprload(J, v, RAX);
+    mov_ri(J, RCX, OBJECT_TAG | QNAN);
+    mov_rr(J, R11, RAX);
+    alu_rr(J, ALU_AND, R11, RCX);
+    alu_rr(J, ALU_CMP, R11, RCX);
+    texit(T, CC_NE);
+    mov_ri(J, RCX, 0x0000fffffffffff8);
+    alu_rr(J, ALU_AND, RAX, RCX);
+    cmp8_mi(J, RAX, 7, OBJ_INSTANCE); // type is in the top header byte
+    texit(T, CC_NE);
+    mov_ri(J, RCX, (uint64_t)(uintptr_t)shape);
+    cmp_mr(J, RAX, offsetof(OInstance, shape), RCX);
+    texit(T, CC_NE);
+    load(J, RDX, RAX, offsetof(OInstance, slots));
+    for(UInt i = 0; i < T->shapec; i++)
+        if(T->shapes[i] == shape) return;
+    if(unlikely(T->shapec == T->shapecap)) {
+        T->shapecap = GROW_ARRAY_CAPACITY(T->shapecap, 4);
+        T->shapes   = REALLOC(J->vm, T->shapes, T->shapecap * sizeof(OShape*));
+    }
+    T->shapes[T->shapec++] = shape;
+}
+
+/* Instructions that consume boolean in flags without clobbering them */
+sstatic bool ccuser(OpCode op)
+{
+    switch(op) {
+        case OP_NOT:
+        case OP_POP:
+        case OP_POPN:
+        case OP_JMP:
+        case OP_JMP_AND_POP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_FALSE_POP:
+        case OP_JMP_IF_FALSE_OR_POP:
+        case OP_JMP_IF_FALSE_AND_POP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Compile recorded instruction */
+sstatic void tcode(TraceJit* T, TraceIns* ins)
+{
+    Jit*   J     = &T->J;
+    Chunk* chunk = &J->fn->chunk;
+    Inst*  ip    = &chunk->code.data[ins->pc];
+    J->pc        = ins->pc;
+    xfreetemps(T);
+    if(T->depth > 0 && tpeek(T, 0)->kind == TV_CC && !ccuser(ins->op))
+        tmaterialize(T, T->depth - 1);
+    switch(ins->op) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL: {
+            Value k = (ins->op == OP_TRUE ? TRUE_VAL : ins->op == OP_FALSE ? FALSE_VAL : NIL_VAL);
+            tpush(T, (TVal){.kind = TV_CONST, .k = k});
+            break;
+        }
+        case OP_NILN:
+            for(UInt n = GET_ARG(*ip); n > 0; n--)
+                tpush(T, (TVal){.kind = TV_CONST, .k = NIL_VAL});
+            break;
+        case OP_CONST: {
+            Value k = chunk->constants.data[GET_ARG(*ip)];
+            tpush(T, (TVal){.kind = TV_CONST, .num = IS_NUMBER(k), .k = numconst(k)});
+            break;
+        }
+        case OP_POP:
+            tpop(T);
+            break;
+        case OP_POPN:
+            for(UInt n = GET_ARG(*ip); n > 0; n--)
+                tpop(T);
+            break;
+        case OP_GET_LOCAL: {
+            UInt slot = GET_ARG(*ip);
+            TVal v    = tslot(T, slot);
+            if(v.kind == TV_XMM) { // copy, stack values own their registers
+                Byte x = xalloc(T, 1u << v.reg);
+                movaps(J, x, v.reg);
+                v.reg = x;
+            } else if(v.kind == TV_MEM) {
+                gprload(J, &v, RAX);
+                tpushmem(T, RAX, v.num);
+                break;
+            }
+            tpush(T, v);
+            break;
+        }
+        case OP_SET_LOCAL: {
+            UInt slot = GET_ARG(*ip);
+            tsetslot(T, slot, tpop(T));
+            break;
+        }
+        case OP_GET_GLOBAL: { // defined when recorded, globals are never undefined again
+            UInt idx = GET_ARG(*ip);
+            tpush(T, (TVal){.kind = TV_GLOBAL, .idx = idx});
+            break;
+        }
+        case OP_SET_GLOBAL: { // recorded as not fixed
+            UInt idx = GET_ARG(*ip);
+            tsetglobal(T, idx, tpop(T));
+            break;
+        }
+        case OP_GET_UPVALUE:
+            upvalue(J, GET_ARG(*ip));
+            load(J, RCX, RCX, offsetof(OUpvalue, location));
+            load(J, RAX, RCX, 0);
+            tpushmem(T, RAX, false);
+            break;
+        case OP_GET_FIXED:
+            fixedvalue(J, GET_ARG(*ip));
+            tpushmem(T, RAX, false);
+            break;
+        case OP_SET_UPVALUE: { // recorded as not fixed
+            TVal v = tpop(T);
+            gprload(J, &v, RAX);
+            upvalue(J, GET_ARG(*ip));
+            load(J, RCX, RCX, offsetof(OUpvalue, location));
+            store(J, RCX, 0, RAX);
+            break;
+        }
+        case OP_NEG: {
+            Byte xa = xnum(T, tpeek(T, 0), 0);
+            Byte x  = xalloc(T, 1u << xa);
+            movq_rx(J, RAX, xa);
+            mov_ri(J, RCX, (uint64_t)1 << 63);
+            alu_rr(J, ALU_XOR, RAX, RCX);
+            movq_xr(J, x, RAX);
+            tpop(T);
+            tpushxmm(T, x);
+            break;
+        }
+        case OP_NOT: {
+            TVal v = tpop(T);
+            if(v.kind == TV_CC) tpushcc(T, v.reg ^ 1);
+            else if(v.kind == TV_CONST || v.num) {
+                Value k = (v.kind == TV_CONST ? v.k : NUMBER_VAL(0));
+                tpush(T, (TVal){.kind = TV_CONST, .k = BOOL_VAL(ISFALSEY(k))});
+            } else {
+                gprload(J, &v, RAX);
+                testfalsey(J);
+                tpushcc(T, CC_BE);
+            }
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_ANY:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV: {
+            Byte x = tarith(T, ins->op, tpeek(T, 1), tpeek(T, 0));
+            tpop(T);
+            tpop(T);
+            tpushxmm(T, x);
+            break;
+        }
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL: {
+            Cond cc = tcmp(T, ins->op, tpeek(T, 1), tpeek(T, 0));
+            tpop(T);
+            tpop(T);
+            tpushcc(T, cc);
+            break;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL: {
+            Cond cc = teq(T, tpeek(T, 1), tpeek(T, 0));
+            tpop(T);
+            tpop(T);
+            tpushcc(T, ins->op == OP_EQUAL ? cc : cc ^ 1);
+            break;
+        }
+        case OP_EQ: { // keeps the left operand
+            Cond cc = teq(T, tpeek(T, 1), tpeek(T, 0));
+            tpop(T);
+            tpushcc(T, cc);
+            break;
+        }
+        case OP_ADDRK:
+        case OP_ADDRK_NUM:
+        case OP_ADDRK_ANY:
+        case OP_SUBRK:
+        case OP_MULRK:
+        case OP_DIVRK: {
+            TVal a = trk(T, GET_B(*ip)), b = trk(T, GET_C(*ip));
+            Byte x = tarith(T, ins->op, &a, &b);
+            tsetra(T, GET_A(*ip), (TVal){.kind = TV_XMM, .num = true, .reg = x});
+            break;
+        }
+        case OP_GREATERRK:
+        case OP_GREATER_EQUALRK:
+        case OP_LESSRK:
+        case OP_LESS_EQUALRK: {
+            TVal a = trk(T, GET_B(*ip)), b = trk(T, GET_C(*ip));
+            Cond cc = tcmp(T, ins->op, &a, &b);
+            tsetra(T, GET_A(*ip), (TVal){.kind = TV_CC, .reg = cc});
+            break;
+        }
+        case OP_EQUALRK:
+        case OP_NOT_EQUALRK: {
+            TVal a = trk(T, GET_B(*ip)), b = trk(T, GET_C(*ip));
+            Cond cc = teq(T, &a, &b);
+            if(ins->op == OP_NOT_EQUALRK) cc ^= 1;
+            tsetra(T, GET_A(*ip), (TVal){.kind = TV_CC, .reg = cc});
+            break;
+        }
+        case OP_GREATERRK_JMP:
+        case OP_GREATER_EQUALRK_JMP:
+        case OP_LESSRK_JMP:
+        case OP_LESS_EQUALRK_JMP: {
+            TVal a = trk(T, GET_B(ip[1])), b = trk(T, GET_C(ip[1]));
+            Cond cc = tcmp(T, ins->op, &a, &b);
+            texit(T, ins->taken ? cc : cc ^ 1); // jumps if false
+            break;
+        }
+        case OP_EQUALRK_JMP:
+        case OP_NOT_EQUALRK_JMP: {
+            TVal a = trk(T, GET_B(ip[1])), b = trk(T, GET_C(ip[1]));
+            Cond cc = teq(T, &a, &b);
+            if(ins->op == OP_NOT_EQUALRK_JMP) cc ^= 1;
+            texit(T, ins->taken ? cc : cc ^ 1);
+            break;
+        }
+        case OP_JMP_IF_FALSE:
+            tbranch(T, tpeek(T, 0), ins->taken);
+            break;
+        case OP_JMP_IF_FALSE_POP:
+            tbranch(T, tpeek(T, 0), ins->taken);
+            tpop(T);
+            break;
+        case OP_JMP_IF_FALSE_OR_POP:
+            tbranch(T, tpeek(T, 0), ins->taken);
+            if(!ins->taken) tpop(T);
+            break;
+        case OP_JMP_IF_FALSE_AND_POP:
+            tbranch(T, tpeek(T, 0), ins->taken);
+            if(ins->taken) tpop(T);
+            break;
+        case OP_JMP_AND_POP:
+            tpop(T);
+            break;
+        case OP_JMP:
+        case OP_LOOP: // inner jumps, trace continues at the target
+            break;
+        case OP_FORPREP: {
+            TVal a = tslot(T, GET_B(ip[1])), b = trk(T, GET_C(ip[1]));
+            Cond cc = tcmp(T, FOR_CMP(ip[1]), &a, &b);
+            texit(T, ins->taken ? cc : cc ^ 1); // jumps if done
+            break;
+        }
+        case OP_FORLOOP: { // recorded jumping back, guards exit before the increment
+            Byte counter = GET_B(ip[1]);
+            TVal i = tslot(T, counter), k = trk(T, FOR_STEP(ip[1]));
+            TVal limit = trk(T, GET_C(ip[1]));
+            Byte xl    = xnum(T, &limit, 0);
+            Byte x     = tarith(T, OP_ADD, &i, &k);
+            tsetslot(T, counter, (TVal){.kind = TV_XMM, .num = true, .reg = x});
+            Cond cc = numcmp(J, FOR_CMP(ip[1]), x, xl);
+            J->pc   = ins->pc + 3; // counter is incremented, exit continues after the loop
+            texit(T, cc ^ 1);
+            break;
+        }
+        case OP_GET_PROPERTY:
+            tguardshape(T, tpeek(T, 0), ins->shape);
+            load(J, RAX, RDX, SLOT(ins->slot));
+            tpop(T);
+            tpushmem(T, RAX, false);
+            break;
+        case OP_GET_LOCAL_PROPERTY: {
+            TVal receiver = tslot(T, GET_ARG(*ip));
+            tguardshape(T, &receiver, ins->shape);
+            load(J, RAX, RDX, SLOT(ins->slot));
+            tpushmem(T, RAX, false);
+            break;
+        }
+        case OP_SET_PROPERTY: {
+            tguardshape(T, tpeek(T, 1), ins->shape);
+            TVal v = tpop(T);
+            tpop(T);
+            if(v.kind == TV_XMM) movsd_mx(J, RDX, SLOT(ins->slot), v.reg);
+            else { // rdx survives, loading globals clobbers only rcx
+                gprload(J, &v, RAX);
+                store(J, RDX, SLOT(ins->slot), RAX);
+            }
+            break;
+        }
+        default:
+            unreachable;
+    }
+}
+
+sstatic bool samesnap(TraceJit* T, TExit* a, TExit* b)
+{
+    if(a->pc != b->pc || a->depth != b->depth) return false;
+    for(UInt i = 0; i < a->depth; i++) {
+        TVal* x = &T->snaps[a->snap + i];
+        TVal* y = &T->snaps[b->snap + i];
+        if(x->kind != y->kind || x->reg != y->reg || x->idx != y->idx || x->k != y->k)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Emit exit stubs, each stub writes its stack snapshot into the VM
+ * stack and returns the exit instruction. Boolean in flags is written
+ * first, before the flags get clobbered.
+ */
+sstatic void tstubs(TraceJit* T)
+{
+    Jit*  J    = &T->J;
+    Inst* code = J->fn->chunk.code.data;
+    UInt  stub = 0;
+    for(UInt i = 0; i < T->exitc; i++) {
+        TExit* exit = &T->exits[i];
+        if(i == 0 || !samesnap(T, exit - 1, exit)) {
+            TVal* snap = &T->snaps[exit->snap];
+            stub       = J->len;
+            for(UInt j = 0; j < exit->depth; j++) {
+                if(snap[j].kind != TV_CC) continue;
+                gprload(J, &snap[j], RAX);
+                store(J, SPREG, SLOT(j), RAX);
+            }
+            for(UInt j = 0; j < exit->depth; j++) {
+                TVal* v = &snap[j];
+                if(v->kind == TV_XMM) movsd_mx(J, SPREG, SLOT(j), v->reg);
+                else if(v->kind != TV_MEM && v->kind != TV_CC) {
+                    gprload(J, v, RAX);
+                    store(J, SPREG, SLOT(j), RAX);
+                }
+            }
+            if(exit->depth > 0) lea(J, SPREG, SPREG, SLOT(exit->depth));
+            mov_ri(J, RAX, (uint64_t)(uintptr_t)(code + exit->pc));
+            emit(J, 0xe9);
+            emit32(J, J->epilogue - (J->len + 4));
+        }
+        patch32(J, exit->at, stub - (exit->at + 4));
+    }
+}
+
+/* Compile the recorded trace, returns NULL if it can't be compiled */
+sstatic Trace* compiletrace(VM* vm, OFunction* fn, Recorder* R)
+{
+    TraceJit T;
+    memset(&T, 0, sizeof(TraceJit));
+    T.J.vm = vm;
+    T.J.fn = fn;
+    T.base = R->base;
+    prologue(&T.J);
+    UInt   loop  = T.J.len;
+    Trace* trace = NULL;
+    for(UInt i = 0; i < R->len; i++) // last instruction jumps back to the loop start
+        tcode(&T, &R->ins[i]);
+    if(T.depth == 0) {
+        emit(&T.J, 0xe9);
+        emit32(&T.J, loop - (T.J.len + 4));
+        tstubs(&T);
+        Byte* mem = mapcode(&T.J);
+        if(mem != NULL) {
+            trace         = MALLOC(vm, sizeof(Trace));
+            trace->mem    = mem;
+            trace->size   = T.J.len;
+            trace->loop   = loop;
+            trace->shapes = T.shapes;
+            trace->shapec = T.shapec;
+            T.shapes      = NULL;
+        }
+    }
+    FREE(vm, T.J.code);
+    FREE(vm, T.stack);
+    FREE(vm, T.exits);
+    FREE(vm, T.snaps);
+    FREE(vm, T.shapes);
+    return trace;
+}
+
+Inst* jit_loop(VM* vm, CallFrame* frame, HotLoop* loop, Inst* ip)
+{
+    if(loop->trace == NULL) {
+        Recorder R = {vm, frame, NULL, 0, 0, vm->sp - frame->sp};
+        bool     closed;
+        Inst*    stop = record(&R, ip, &closed);
+        if(closed) loop->trace = compiletrace(vm, frame->closure->fn, &R);
+        FREE(vm, R.ins);
+        if(loop->trace == NULL) {
+            if(GET_OP(*stop) == OP_RET || GET_OP(*stop) == OP_TOPRET) // loop was left, record the next iteration
+                loop->hotcount = 1;
+            else if(++loop->aborts < S_JIT_TRACE_ABORTS)
+                loop->hotcount = vm->config.hotloop << loop->aborts;
+            else loop->hotcount = INT32_MAX; // never traced
+            return stop;
+        }
+    }
+    loop->hotcount = 0; // enter the trace on each back-edge
+    Trace* trace   = loop->trace;
+    return ((JitFn)trace->mem)(vm, frame, trace->mem + trace->loop);
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SKOOMA_JIT_H
+#define SKOOMA_JIT_H
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vmachine.h"
+
+#ifdef S_JIT
+
+/* Machine code of a compiled function */
+struct JitCode { // typedef is inside 'value.h'
+    Byte*  mem; // executable memory, starts with the entry stub
+    size_t size; // 'mem' size in bytes
+    UInt*  entries; // machine code offset of each instruction (by bytecode word offset)
+};
+
+/* Machine code of a loop trace */
+struct Trace { // typedef is inside 'value.h'
+    Byte*    mem; // executable memory, starts with the entry stub
+    size_t   size; // 'mem' size in bytes
+    UInt     loop; // machine code offset of the loop start
+    OShape** shapes; // receiver shapes the trace guards on (kept alive by the GC)
+    UInt     shapec;
+};
+
+/*
+ * Compiled function entry stub, continues executing machine code at
+ * 'entry' until it reaches instruction it can't execute, returns
+ * that instruction so the interpreter can execute it instead.
+ * If the function returned, returned instruction is of the caller.
+ */
+typedef Inst* (*JitFn)(VM* vm, CallFrame* frame, Byte* entry);
+
+bool jit_compile(VM* vm, OFunction* fn);
+void jit_free(VM* vm, OFunction* fn);
+
+/*
+ * Hot loop back-edge, 'ip' is the loop start. Records and compiles
+ * the trace of the loop if it has none, then runs it. Returns the
+ * instruction the interpreter continues at.
+ */
+Inst* jit_loop(VM* vm, CallFrame* frame, HotLoop* loop, Inst* ip);
+
+/* Runtime helpers called from compiled code ('vmachine.c') */
+bool jit_getproperty(Value* sp, InlineCache* cache);
+bool jit_setproperty(Value* sp, InlineCache* cache);
+
+/* Run compiled code of the 'frame' function starting at instruction 'ip' */
+sstatic force_inline Inst* jit_run(VM* vm, CallFrame* frame, Inst* ip)
+{
+    OFunction* fn    = frame->closure->fn;
+    JitCode*   jc    = fn->jit;
+    Byte*      entry = jc->mem + jc->entries[ip - fn->chunk.code.data];
+    return ((JitFn)jc->mem)(vm, frame, entry);
+}
+
+#endif
+
+#endif
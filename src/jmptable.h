@@ -1,7 +1,9 @@
 #ifndef SKOOMA_JMPTABLE_H
 #define SKOOMA_JMPTABLE_H
 
-#if defined(OP_TABLE)
+#if defined(OP_TABLE) || defined(OP_FNTABLE)
+
+    #if defined(OP_TABLE)
 
     #undef DISPATCH
 
@@ -18,74 +20,111 @@
     /* Redefine break into another goto/dispatch */
     #define BREAK DISPATCH(READ_BYTE())
 
+    /* Label addresses inside of 'run' */
+    #define OPADDR(op) &&L_##op
+
+    #else
+
+    /* Handler functions of the tail-call interpreter */
+    #define OPADDR(op) ((const void*)&OPFN(op))
+
+    #endif
+
 /* Make sure the order is the same as in the OpCode enum */
 static const void* const optable[OPCODE_N] = {
-    &&L_OP_TRUE,
-    &&L_OP_FALSE,
-    &&L_OP_NIL,
-    &&L_OP_NILN,
-    &&L_OP_NEG,
-    &&L_OP_ADD,
-    &&L_OP_SUB,
-    &&L_OP_MUL,
-    &&L_OP_DIV,
-    &&L_OP_MOD,
-    &&L_OP_POW,
-    &&L_OP_NOT,
-    &&L_OP_VALIST,
-    &&L_OP_NOT_EQUAL,
-    &&L_OP_EQUAL,
-    &&L_OP_EQ,
-    &&L_OP_GREATER,
-    &&L_OP_GREATER_EQUAL,
-    &&L_OP_LESS,
-    &&L_OP_LESS_EQUAL,
-    &&L_OP_POP,
-    &&L_OP_POPN,
-    &&L_OP_CONST,
-    &&L_OP_DEFINE_GLOBAL,
-    &&L_OP_DEFINE_GLOBALL,
-    &&L_OP_GET_GLOBAL,
-    &&L_OP_GET_GLOBALL,
-    &&L_OP_SET_GLOBAL,
-    &&L_OP_SET_GLOBALL,
-    &&L_OP_GET_LOCAL,
-    &&L_OP_GET_LOCALL,
-    &&L_OP_SET_LOCAL,
-    &&L_OP_SET_LOCALL,
-    &&L_OP_JMP_IF_FALSE,
-    &&L_OP_JMP_IF_FALSE_POP,
-    &&L_OP_JMP_IF_FALSE_OR_POP,
-    &&L_OP_JMP_IF_FALSE_AND_POP,
-    &&L_OP_JMP,
-    &&L_OP_JMP_AND_POP,
-    &&L_OP_LOOP,
-    &&L_OP_CALL,
-    &&L_OP_CLOSURE,
-    &&L_OP_GET_UPVALUE,
-    &&L_OP_SET_UPVALUE,
-    &&L_OP_CLOSE_UPVAL,
-    &&L_OP_CLOSE_UPVALN,
-    &&L_OP_CLASS,
-    &&L_OP_SET_PROPERTY,
-    &&L_OP_GET_PROPERTY,
-    &&L_OP_INDEX,
-    &&L_OP_SET_INDEX,
-    &&L_OP_INVOKE_INDEX,
-    &&L_OP_METHOD,
-    &&L_OP_INVOKE,
-    &&L_OP_OVERLOAD,
-    &&L_OP_INHERIT,
-    &&L_OP_GET_SUPER,
-    &&L_OP_INVOKE_SUPER,
-    &&L_OP_CALLSTART,
-    &&L_OP_RETSTART,
-    &&L_OP_FOREACH,
-    &&L_OP_FOREACH_PREP,
-    &&L_OP_TOPRET,
-    &&L_OP_RET,
+    OPADDR(OP_TRUE),
+    OPADDR(OP_FALSE),
+    OPADDR(OP_NIL),
+    OPADDR(OP_NILN),
+    OPADDR(OP_NEG),
+    OPADDR(OP_ADD),
+    OPADDR(OP_SUB),
+    OPADDR(OP_MUL),
+    OPADDR(OP_DIV),
+    OPADDR(OP_MOD),
+    OPADDR(OP_POW),
+    OPADDR(OP_NOT),
+    OPADDR(OP_VALIST),
+    OPADDR(OP_NOT_EQUAL),
+    OPADDR(OP_EQUAL),
+    OPADDR(OP_EQ),
+    OPADDR(OP_GREATER),
+    OPADDR(OP_GREATER_EQUAL),
+    OPADDR(OP_LESS),
+    OPADDR(OP_LESS_EQUAL),
+    OPADDR(OP_ADDRK),
+    OPADDR(OP_SUBRK),
+    OPADDR(OP_MULRK),
+    OPADDR(OP_DIVRK),
+    OPADDR(OP_NOT_EQUALRK),
+    OPADDR(OP_EQUALRK),
+    OPADDR(OP_GREATERRK),
+    OPADDR(OP_GREATER_EQUALRK),
+    OPADDR(OP_LESSRK),
+    OPADDR(OP_LESS_EQUALRK),
+    OPADDR(OP_ADD_NUM),
+    OPADDR(OP_ADD_STR),
+    OPADDR(OP_ADDRK_NUM),
+    OPADDR(OP_ADDRK_STR),
+    OPADDR(OP_ADD_ANY),
+    OPADDR(OP_ADDRK_ANY),
+    OPADDR(OP_NOT_EQUALRK_JMP),
+    OPADDR(OP_EQUALRK_JMP),
+    OPADDR(OP_GREATERRK_JMP),
+    OPADDR(OP_GREATER_EQUALRK_JMP),
+    OPADDR(OP_LESSRK_JMP),
+    OPADDR(OP_LESS_EQUALRK_JMP),
+    OPADDR(OP_GET_LOCAL_PROPERTY),
+    OPADDR(OP_CONST_ADD_NUM),
+    OPADDR(OP_GET_LOCAL_ADD_NUM),
+    OPADDR(OP_ADD_NUM_SET_LOCAL),
+    OPADDR(OP_SUB_SET_LOCAL),
+    OPADDR(OP_POP),
+    OPADDR(OP_POPN),
+    OPADDR(OP_CONST),
+    OPADDR(OP_DEFINE_GLOBAL),
+    OPADDR(OP_GET_GLOBAL),
+    OPADDR(OP_SET_GLOBAL),
+    OPADDR(OP_GET_LOCAL),
+    OPADDR(OP_SET_LOCAL),
+    OPADDR(OP_JMP_IF_FALSE),
+    OPADDR(OP_JMP_IF_FALSE_POP),
+    OPADDR(OP_JMP_IF_FALSE_OR_POP),
+    OPADDR(OP_JMP_IF_FALSE_AND_POP),
+    OPADDR(OP_JMP),
+    OPADDR(OP_JMP_AND_POP),
+    OPADDR(OP_LOOP),
+    OPADDR(OP_FORPREP),
+    OPADDR(OP_FORLOOP),
+    OPADDR(OP_CALL),
+    OPADDR(OP_TAILCALL),
+    OPADDR(OP_CLOSURE),
+    OPADDR(OP_GET_UPVALUE),
+    OPADDR(OP_GET_FIXED),
+    OPADDR(OP_SET_UPVALUE),
+    OPADDR(OP_CLOSE_UPVAL),
+    OPADDR(OP_CLOSE_UPVALN),
+    OPADDR(OP_CLASS),
+    OPADDR(OP_SET_PROPERTY),
+    OPADDR(OP_GET_PROPERTY),
+    OPADDR(OP_INDEX),
+    OPADDR(OP_SET_INDEX),
+    OPADDR(OP_INVOKE_INDEX),
+    OPADDR(OP_METHOD),
+    OPADDR(OP_INVOKE),
+    OPADDR(OP_TAILINVOKE),
+    OPADDR(OP_OVERLOAD),
+    OPADDR(OP_INHERIT),
+    OPADDR(OP_GET_SUPER),
+    OPADDR(OP_INVOKE_SUPER),
+    OPADDR(OP_FOREACH),
+    OPADDR(OP_FOREACH_PREP),
+    OPADDR(OP_TOPRET),
+    OPADDR(OP_RET),
 };
 
+    #undef OPADDR
+
 #elif defined(OBJ_TABLE)
 
     #undef DISPATCH
@@ -100,7 +139,7 @@ static const void* const optable[OPCODE_N] = {
 
     #define BREAK return
 
-static const void* objtable[OBJ_BOUND_METHOD + 1] = {
+static const void* objtable[OBJ_RANGE + 1] = {
     &&L_OBJ_STRING,
     &&L_OBJ_FUNCTION,
     &&L_OBJ_CLOSURE,
@@ -109,6 +148,8 @@ static const void* objtable[OBJ_BOUND_METHOD + 1] = {
     &&L_OBJ_CLASS,
     &&L_OBJ_INSTANCE,
     &&L_OBJ_BOUND_METHOD,
+    &&L_OBJ_SHAPE,
+    &&L_OBJ_RANGE,
 };
 
 #elif defined(VAL_TABLE)
@@ -202,13 +202,13 @@ sstatic Token numtoken(Lexer* lexer, NumberType type)
     Value number;
     switch(type) {
         case NUM_HEX:
-            number = NUMBER_VAL(strtoll(lexer->start, NULL, 16));
+            number = INTNUM_VAL(strtoll(lexer->start, NULL, 16));
             break;
         case NUM_DEC:
-            number = NUMBER_VAL(strtod(lexer->start, NULL));
+            number = INTNUM_VAL(strtod(lexer->start, NULL));
             break;
         case NUM_OCT:
-            number = NUMBER_VAL(strtoll(lexer->start, NULL, 8));
+            number = INTNUM_VAL(strtoll(lexer->start, NULL, 8));
             break;
         default:
             unreachable;
@@ -219,7 +219,7 @@ sstatic Token numtoken(Lexer* lexer, NumberType type)
             "Too large number constant '%.*s'...",
             ERR_LEN(lexer->_current - lexer->start),
             lexer->start);
-        number = NUMBER_VAL(0);
+        number = INT_VAL(0);
     }
     Token tok = token(lexer, TOK_NUMBER);
     tok.value = number;
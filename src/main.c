@@ -26,20 +26,36 @@ static void File_run(VM* vm, const char* path)
     }
 }
 
+sstatic void usage(void)
+{
+    fprintf(stderr, "Usage: skooma [--jit | --no-jit] [path.sk]\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[])
 {
     runtime = 0;
-    VM* vm  = NULL;
-    if(argc == 1) {
+    Config config;
+    Config_init(&config);
+    const char* path = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--jit") == 0) config.jit = true;
+        else if(strcmp(argv[i], "--no-jit") == 0) config.jit = false;
+        else if(path == NULL && argv[i][0] != '-') path = argv[i];
+        else usage();
+    }
+#ifndef S_JIT
+    if(config.jit) {
+        fprintf(stderr, "JIT is not supported on this platform, running interpreter.\n");
+        config.jit = false;
+    }
+#endif
+    if(path == NULL) {
         fprintf(stderr, "REPL is not implemented!\n");
         return 1;
-    } else if(argc == 2) {
-        vm = VM_new(NULL);
-        File_run(vm, argv[1]);
-        VM_free(vm);
-    } else {
-        fprintf(stderr, "Usage: skooma [path.sk]\n");
-        exit(EXIT_FAILURE);
     }
+    VM* vm = VM_new(&config);
+    File_run(vm, path);
+    VM_free(vm);
     return 0;
 }
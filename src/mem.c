@@ -1,5 +1,6 @@
 #include "debug.h"
 #include "hashtable.h"
+#include "jit.h"
 #include "mem.h"
 #include "object.h"
 #include "parser.h"
@@ -81,8 +82,8 @@ MS_FN(markframes)
 
 MS_FN(markupvalues)
 {
-    for(OUpvalue* upval = vm->open_upvals; upval != NULL; upval = upval->next)
-        omark(vm, (O*)upval);
+    for(Int i = 0; i < vm->upvaltop - vm->stack; i++)
+        omark(vm, (O*)vm->upvals[i]);
 }
 
 MS_FN(markstatics)
@@ -96,12 +97,6 @@ MS_FN(markloaded)
     marktable(vm, &vm->loaded);
 }
 
-MS_FN(marktemp)
-{
-    for(UInt i = 0; i < vm->temp.len; i++)
-        vmark(vm, vm->temp.data[i]);
-}
-
 MS_FN(markroots)
 {
     markstack(vm);
@@ -176,6 +171,22 @@ void mark_black(VM* vm, O* obj)
             omark(vm, (O*)fn->name);
             for(UInt i = 0; i < fn->chunk.constants.len; i++)
                 vmark(vm, fn->chunk.constants.data[i]);
+            for(UInt i = 0; i < fn->chunk.caches.len; i++) {
+                InlineCache* cache = &fn->chunk.caches.data[i];
+                for(UInt j = 0; j < cache->len; j++) {
+                    omark(vm, (O*)cache->entries[j].shape);
+                    omark(vm, (O*)cache->entries[j].next);
+                    omark(vm, (O*)cache->entries[j].method);
+                }
+            }
+#ifdef S_JIT
+            for(UInt i = 0; i < fn->chunk.loops.len; i++) {
+                Trace* trace = fn->chunk.loops.data[i].trace;
+                if(trace == NULL) continue;
+                for(UInt j = 0; j < trace->shapec; j++)
+                    omark(vm, (O*)trace->shapes[j]);
+            }
+#endif
             BREAK;
         }
         CASE(OBJ_CLOSURE)
@@ -184,21 +195,39 @@ void mark_black(VM* vm, O* obj)
             omark(vm, (O*)closure->fn);
             for(UInt i = 0; i < closure->upvalc; i++)
                 omark(vm, (O*)closure->upvals[i]);
+            for(UInt i = 0; i < closure->fixedc; i++)
+                vmark(vm, closure->fixed[i]);
             BREAK;
         }
         CASE(OBJ_CLASS)
         {
             OClass* oclass = (OClass*)obj;
             omark(vm, (O*)oclass->name);
+            omark(vm, (O*)oclass->super);
             marktable(vm, &oclass->methods);
+            for(UInt i = 0; i < oclass->mlen; i++)
+                omark(vm, (O*)oclass->mtable[i]);
             omark(vm, (O*)oclass->overloaded);
+            omark(vm, (O*)oclass->shape);
             BREAK;
         }
         CASE(OBJ_INSTANCE)
         {
             OInstance* instance = (OInstance*)obj;
             omark(vm, (O*)instance->oclass);
-            marktable(vm, &instance->fields);
+            if(instance->shape != NULL) {
+                omark(vm, (O*)instance->shape);
+                for(UInt i = 0; i < instance->shape->len; i++)
+                    vmark(vm, instance->slots[i]);
+            } else marktable(vm, instance->fields);
+            BREAK;
+        }
+        CASE(OBJ_SHAPE)
+        {
+            OShape* shape = (OShape*)obj;
+            omark(vm, (O*)shape->parent);
+            marktable(vm, &shape->slots);
+            marktable(vm, &shape->transitions);
             BREAK;
         }
         CASE(OBJ_BOUND_METHOD)
@@ -215,6 +244,10 @@ void mark_black(VM* vm, O* obj)
             omark(vm, (O*)native->name);
             BREAK;
         }
+        CASE(OBJ_RANGE)
+        {
+            BREAK; // no references
+        }
         CASE(OBJ_STRING)
         unreachable;
     }
@@ -1,5 +1,6 @@
 #include "array.h"
 #include "debug.h"
+#include "jit.h"
 #include "mem.h"
 #include "object.h"
 #include "skconf.h"
@@ -73,6 +74,7 @@ ONative* ONative_new(VM* vm, OString* name, NativeFn fn, Int arity, bool isva)
     ONative* native = ALLOC_OBJ(vm, ONative, OBJ_NATIVE);
     native->name    = name;
     native->fn      = fn;
+    native->next    = NULL;
     native->arity   = arity;
     native->isva    = isva;
     return native;
@@ -83,13 +85,32 @@ sstatic force_inline void ONative_free(VM* vm, ONative* native)
     GC_FREE(vm, native, sizeof(ONative));
 }
 
+ORange* ORange_new(VM* vm, double start, double stop, double step)
+{
+    ORange* range = ALLOC_OBJ(vm, ORange, OBJ_RANGE);
+    range->start  = start;
+    range->stop   = stop;
+    range->step   = step;
+    return range;
+}
+
+sstatic force_inline void ORange_free(VM* vm, ORange* range)
+{
+    GC_FREE(vm, range, sizeof(ORange));
+}
+
 OFunction* OFunction_new(VM* vm)
 {
     OFunction* fn = ALLOC_OBJ(vm, OFunction, OBJ_FUNCTION);
     fn->name      = NULL;
     fn->upvalc    = 0;
+    fn->fixedc    = 0;
     fn->arity     = 0;
     fn->vacnt     = 0;
+    fn->maxstack  = 0;
+    fn->calls     = 0;
+    fn->tier      = TIER_BASE;
+    fn->jit       = NULL;
     fn->isva      = 0;
     fn->isinit    = 0;
     fn->gotret    = 0;
@@ -99,25 +120,38 @@ OFunction* OFunction_new(VM* vm)
 
 sstatic force_inline void ObjFunction_free(VM* vm, OFunction* fn)
 {
+#ifdef S_JIT
+    jit_free(vm, fn);
+#endif
     Chunk_free(&fn->chunk);
     GC_FREE(vm, fn, sizeof(OFunction));
 }
 
 OClosure* OClosure_new(VM* vm, OFunction* fn)
 {
-    OUpvalue** upvals = GC_MALLOC(vm, sizeof(OUpvalue*) * fn->upvalc);
+    // upvalues and 'fixed' values share the allocation
+    OUpvalue** upvals =
+        GC_MALLOC(vm, sizeof(OUpvalue*) * fn->upvalc + sizeof(Value) * fn->fixedc);
     for(UInt i = 0; i < fn->upvalc; i++)
         upvals[i] = NULL;
+    Value* fixed = (Value*)(upvals + fn->upvalc);
+    for(UInt i = 0; i < fn->fixedc; i++)
+        fixed[i] = NIL_VAL;
     OClosure* closure = ALLOC_OBJ(vm, OClosure, OBJ_CLOSURE);
     closure->fn       = fn;
     closure->upvals   = upvals;
     closure->upvalc   = fn->upvalc;
+    closure->fixed    = fixed;
+    closure->fixedc   = fn->fixedc;
     return closure;
 }
 
 sstatic force_inline void OClosure_free(VM* vm, OClosure* closure)
 {
-    GC_FREE(vm, closure->upvals, closure->upvalc * sizeof(OUpvalue*));
+    GC_FREE(
+        vm,
+        closure->upvals,
+        closure->upvalc * sizeof(OUpvalue*) + closure->fixedc * sizeof(Value));
     GC_FREE(vm, closure, sizeof(OClosure));
 }
 
@@ -126,7 +160,6 @@ OUpvalue* OUpvalue_new(VM* vm, Value* valp)
     OUpvalue* upval = ALLOC_OBJ(vm, OUpvalue, OBJ_UPVAL);
     upval->closed   = (Variable){EMPTY_VAL, 0};
     upval->location = valp;
-    upval->next     = NULL;
     return upval;
 }
 
@@ -135,33 +168,169 @@ sstatic force_inline void OUpvalue_free(VM* vm, OUpvalue* upval)
     GC_FREE(vm, upval, sizeof(OUpvalue));
 }
 
+sstatic OShape* OShape_new(VM* vm, OShape* parent)
+{
+    OShape* shape = ALLOC_OBJ(vm, OShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->len    = 0;
+    HashTable_init(&shape->slots);
+    HashTable_init(&shape->transitions);
+    return shape;
+}
+
+sstatic force_inline void OShape_free(VM* vm, OShape* shape)
+{
+    HashTable_free(vm, &shape->slots);
+    HashTable_free(vm, &shape->transitions);
+    GC_FREE(vm, shape, sizeof(OShape));
+}
+
+/* Get (or create) the shape 'shape' transitions into when adding 'key'. */
+sstatic OShape* OShape_transition(VM* vm, OShape* shape, Value key)
+{
+    Value next;
+    if(HashTable_get(&shape->transitions, key, &next)) return AS_SHAPE(next);
+    OShape* child = OShape_new(vm, shape);
+    push(vm, OBJ_VAL(child));
+    HashTable_into(vm, &shape->slots, &child->slots);
+    HashTable_insert(vm, &child->slots, key, NUMBER_VAL(shape->len));
+    child->len = shape->len + 1;
+    HashTable_insert(vm, &shape->transitions, key, OBJ_VAL(child));
+    pop(vm);
+    return child;
+}
+
 OClass* OClass_new(VM* vm, OString* name)
 {
+    OShape* shape = OShape_new(vm, NULL);
+    push(vm, OBJ_VAL(shape));
     OClass* oclass = ALLOC_OBJ(vm, OClass, OBJ_CLASS); // GC
-    oclass->name   = name;
+    pop(vm);
+    oclass->name  = name;
+    oclass->super = NULL;
     HashTable_init(&oclass->methods);
+    oclass->mtable     = NULL;
+    oclass->mlen       = 0;
+    oclass->mcap       = 0;
     oclass->overloaded = NULL;
+    oclass->shape      = shape;
+    oclass->slothint   = 0;
     return oclass;
 }
 
+/* Copy 'superclass' method table into 'subclass', slots are inherited. */
+void OClass_inherit(VM* vm, OClass* subclass, OClass* superclass)
+{
+    subclass->super = superclass;
+    if(superclass->mlen == 0) return;
+    subclass->mtable = GC_MALLOC(vm, superclass->mlen * sizeof(OClosure*));
+    memcpy(subclass->mtable, superclass->mtable, superclass->mlen * sizeof(OClosure*));
+    subclass->mlen = subclass->mcap = superclass->mlen;
+}
+
+/* Define method 'key', overrides the method in the same slot (if any). */
+void OClass_setmethod(VM* vm, OClass* oclass, Value key, OClosure* method)
+{
+    Int slot = OClass_slot(oclass, key);
+    if(slot >= 0) {
+        oclass->mtable[slot] = method;
+        return;
+    }
+    if(oclass->mcap <= oclass->mlen) {
+        UInt cap       = GROW_ARRAY_CAPACITY(oclass->mcap, 4);
+        oclass->mtable = gcrealloc(
+            vm,
+            oclass->mtable,
+            oclass->mcap * sizeof(OClosure*),
+            cap * sizeof(OClosure*));
+        oclass->mcap = cap;
+    }
+    oclass->mtable[oclass->mlen] = method;
+    HashTable_insert(vm, &oclass->methods, key, NUMBER_VAL(oclass->mlen));
+    oclass->mlen++;
+}
+
 sstatic force_inline void OClass_free(VM* vm, OClass* oclass)
 {
     HashTable_free(vm, &oclass->methods);
+    GC_FREE(vm, oclass->mtable, oclass->mcap * sizeof(OClosure*));
     GC_FREE(vm, oclass, sizeof(OClass));
 }
 
 
 OInstance* OInstance_new(VM* vm, OClass* oclass)
 {
+    Value* slots = NULL;
+    if(oclass->slothint > 0)
+        slots = GC_MALLOC(vm, oclass->slothint * sizeof(Value));
     OInstance* instance = ALLOC_OBJ(vm, OInstance, OBJ_INSTANCE);
     instance->oclass    = oclass;
-    HashTable_init(&instance->fields);
+    instance->shape     = oclass->shape;
+    instance->slots     = slots;
+    instance->cap       = oclass->slothint;
     return instance;
 }
 
+/* Move instance fields into its own table, instance stops using shapes. */
+sstatic void OInstance_todict(VM* vm, OInstance* instance)
+{
+    HashTable* fields = GC_MALLOC(vm, sizeof(HashTable));
+    HashTable_init(fields);
+    OShape* shape = instance->shape;
+    for(UInt i = 0; i < shape->slots.cap; i++) {
+        Entry* entry = &shape->slots.entries[i];
+        if(!IS_EMPTY(entry->key)) {
+            Value value = instance->slots[(UInt)AS_NUMBER(entry->value)];
+            HashTable_insert(vm, fields, entry->key, value);
+        }
+    }
+    // While building, keys and values are still reachable through the shape
+    GC_FREE(vm, instance->slots, instance->cap * sizeof(Value));
+    instance->shape  = NULL;
+    instance->fields = fields;
+    instance->cap    = 0;
+}
+
+void OInstance_set(VM* vm, OInstance* instance, Value key, Value value)
+{
+    if(unlikely(instance->shape == NULL)) {
+        HashTable_insert(vm, instance->fields, key, value);
+        return;
+    }
+    Value slot;
+    if(likely(HashTable_get(&instance->shape->slots, key, &slot))) {
+        instance->slots[(UInt)AS_NUMBER(slot)] = value;
+        return;
+    }
+    if(unlikely(instance->shape->len >= S_SHAPE_SLOTS_MAX)) {
+        OInstance_todict(vm, instance);
+        HashTable_insert(vm, instance->fields, key, value);
+        return;
+    }
+    OShape* shape = OShape_transition(vm, instance->shape, key);
+    if(instance->cap < shape->len) {
+        UInt cap = GROW_ARRAY_CAPACITY(instance->cap, 4);
+        instance->slots = gcrealloc(
+            vm,
+            instance->slots,
+            instance->cap * sizeof(Value),
+            cap * sizeof(Value));
+        instance->cap = cap;
+    }
+    instance->slots[shape->len - 1] = value;
+    instance->shape                 = shape;
+    if(instance->oclass->slothint < shape->len)
+        instance->oclass->slothint = shape->len;
+}
+
 sstatic force_inline void OInstance_free(VM* vm, OInstance* instance)
 {
-    HashTable_free(vm, &instance->fields);
+    if(instance->shape != NULL)
+        GC_FREE(vm, instance->slots, instance->cap * sizeof(Value));
+    else {
+        HashTable_free(vm, instance->fields);
+        GC_FREE(vm, instance->fields, sizeof(HashTable));
+    }
     GC_FREE(vm, instance, sizeof(OInstance));
 }
 
@@ -206,6 +375,12 @@ sdebug void otypeprint(OType type)
         case OBJ_BOUND_METHOD:
             printf("OBJ_BOUND_METHOD");
             break;
+        case OBJ_SHAPE:
+            printf("OBJ_SHAPE");
+            break;
+        case OBJ_RANGE:
+            printf("OBJ_RANGE");
+            break;
         default:
             unreachable;
     }
@@ -268,6 +443,17 @@ void oprint(Value value)
             fnprint(AS_BOUND_METHOD(value)->method->fn);
             BREAK;
         }
+        CASE(OBJ_SHAPE)
+        {
+            printf("<shape %p: %u fields>", AS_OBJ(value), AS_SHAPE(value)->len);
+            BREAK;
+        }
+        CASE(OBJ_RANGE)
+        {
+            ORange* range = AS_RANGE(value);
+            printf("<range %g, %g, %g>", range->start, range->stop, range->step);
+            BREAK;
+        }
     }
     unreachable;
 #ifdef SKOOMA_JMPTABLE_H
@@ -351,6 +537,16 @@ void ofree(VM* vm, O* object)
             OBoundMethod_free(vm, (OBoundMethod*)object);
             BREAK;
         }
+        CASE(OBJ_SHAPE)
+        {
+            OShape_free(vm, (OShape*)object);
+            BREAK;
+        }
+        CASE(OBJ_RANGE)
+        {
+            ORange_free(vm, (ORange*)object);
+            BREAK;
+        }
     }
     unreachable;
 #ifdef SKOOMA_JMPTABLE_H
@@ -413,6 +609,12 @@ OString* otostr(VM* vm, O* object)
         {
             return ((OBoundMethod*)object)->method->fn->name;
         }
+        CASE(OBJ_RANGE)
+        {
+            return vm->statics[SS_RANGE];
+        }
+        CASE(OBJ_SHAPE)
+        unreachable;
     }
     unreachable;
 #ifdef SKOOMA_JMPTABLE_H
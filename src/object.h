@@ -34,6 +34,12 @@
 #define IS_BOUND_METHOD(value) isotype(value, OBJ_BOUND_METHOD)
 #define AS_BOUND_METHOD(value) ((OBoundMethod*)AS_OBJ(value))
 
+#define IS_SHAPE(value) isotype(value, OBJ_SHAPE)
+#define AS_SHAPE(value) ((OShape*)AS_OBJ(value))
+
+#define IS_RANGE(value) isotype(value, OBJ_RANGE)
+#define AS_RANGE(value) ((ORange*)AS_OBJ(value))
+
 typedef enum {
     OBJ_STRING = 0,
     OBJ_FUNCTION,
@@ -43,6 +49,8 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_RANGE,
 } OType;
 
 /*
@@ -108,16 +116,27 @@ struct OUpvalue { // typedef is inside 'value.h'
     O         obj; // shared header
     Variable  closed; // is upvalue closed over
     Value*    location; // ptr to 'closed' or VM stack
-    OUpvalue* next; // chain
 };
 
+/* Execution tier of the function, functions only tier up */
+typedef enum {
+    TIER_BASE = 0, // bytecode as emitted by the compiler
+    TIER_OPT, // bytecode rewritten by 'Chunk_optimize'
+    TIER_JIT, // compiled into machine code
+} Tier;
+
 struct OFunction { // typedef is inside 'value.h'
     O        obj; // shared header
     Chunk    chunk; // bytecode and constants
     OString* name; // script name
     UInt     upvalc; // number of upvalues
+    UInt     fixedc; // number of captured 'fixed' values
     UInt     arity; // Min amount of arguments required
     UInt     vacnt; // Variable arguments count
+    UInt     maxstack; // Max stack growth above the arguments
+    UInt     calls; // call count (tier-up hotness counter)
+    Byte     tier; // current execution tier ('Tier')
+    JitCode* jit; // compiled machine code (NULL if not compiled)
     Byte     isva : 1; // If this function takes valist
     Byte     isinit : 1; // If this function is class initializer
     Byte     gotret : 1; // last instruction is 'OP_TOP/RET'
@@ -128,19 +147,54 @@ struct OClosure { // typedef is inside 'value.h'
     OFunction* fn; // wrapped function
     OUpvalue** upvals; // array of ptr to OUpvalue
     UInt       upvalc; // array len
+    Value*     fixed; // captured 'fixed' variables (copied by value)
+    UInt       fixedc; // array len
 };
 
-struct OClass { // typedef is inside 'value.h'
+/*
+ * Hidden class (shape) of an instance.
+ * Instances that got the same fields assigned in the same
+ * order share the same shape, which maps each field name
+ * into the index of the instance slot holding the value.
+ * Shapes form a transition tree rooted in the class.
+ */
+struct OShape { // typedef is inside 'value.h'
     O         obj; // shared header
-    OString*  name; // class name
-    HashTable methods; // class methods
-    OClosure* overloaded; // @TODO: array of overloadable ops
+    OShape*   parent; // shape we transitioned from (NULL if root)
+    UInt      len; // number of fields (slots)
+    HashTable slots; // field name -> slot index
+    HashTable transitions; // field name -> next OShape
+};
+
+/*
+ * Class methods are kept in a dense method table (vtable), subclass
+ * starts with a copy of the superclass table so inherited methods keep
+ * their slot indices and overrides replace the inherited slot.
+ * 'methods' maps only the names introduced by this class into their
+ * slot, names of inherited methods are found in the superclass chain.
+ */
+struct OClass { // typedef is inside 'value.h'
+    O          obj; // shared header
+    OString*   name; // class name
+    OClass*    super; // superclass (NULL if none)
+    HashTable  methods; // method name -> slot index (introduced methods)
+    OClosure** mtable; // method table (indexed by slot)
+    UInt       mlen; // number of methods in 'mtable'
+    UInt       mcap; // 'mtable' capacity
+    OClosure*  overloaded; // @TODO: array of overloadable ops
+    OShape*    shape; // root shape of instances
+    UInt       slothint; // most fields any instance had (initial slots)
 };
 
 struct OInstance { // typedef is inside 'value.h'
-    O         obj; // shared header
-    OClass*   oclass; // ptr to class we instantiated from
-    HashTable fields; // Instance fields
+    O       obj; // shared header
+    OClass* oclass; // ptr to class we instantiated from
+    OShape* shape; // hidden class, NULL if in dictionary mode
+    union {
+        Value*     slots; // field values (indexed by 'shape' slots)
+        HashTable* fields; // fields table (dictionary mode)
+    };
+    UInt cap; // 'slots' capacity
 };
 
 struct OBoundMethod { // typedef is inside 'value.h'
@@ -151,23 +205,76 @@ struct OBoundMethod { // typedef is inside 'value.h'
 
 typedef struct {
     O        obj; // shared header
-    NativeFn fn; // native functions signature
-    OString* name; // native function name
-    Int      arity; // how many arguments
-    bool     isva; // is this vararg function
+    NativeFn   fn; // native functions signature
+    NativeNext next; // iterator step called by 'OP_FOREACH_PREP' (or NULL)
+    OString*   name; // native function name
+    Int        arity; // how many arguments
+    bool       isva; // is this vararg function
 } ONative; // Native function written in C
 
+typedef struct {
+    O      obj; // shared header
+    double start; // first value
+    double stop; // end of range (exclusive)
+    double step; // non-zero increment
+} ORange; // Numeric range iterator, see 'native_range'
+
 OString*      OString_from(VM* vm, const char* chars, size_t len);
 OBoundMethod* OBoundMethod_new(VM* vm, Value receiver, OClosure* method);
 OInstance*    OInstance_new(VM* vm, OClass* cclass);
+void          OInstance_set(VM* vm, OInstance* instance, Value key, Value value);
 OClass*       OClass_new(VM* vm, OString* name);
+void          OClass_inherit(VM* vm, OClass* subclass, OClass* superclass);
+void          OClass_setmethod(VM* vm, OClass* oclass, Value key, OClosure* method);
 OUpvalue*     OUpvalue_new(VM* vm, Value* var_ref);
 OClosure*     OClosure_new(VM* vm, OFunction* fn);
 ONative*   ONative_new(VM* vm, OString* name, NativeFn fn, Int arity, bool isva);
+ORange*    ORange_new(VM* vm, double start, double stop, double step);
 OFunction* OFunction_new(VM* vm);
 void       otypeprint(OType type); // Debug
 OString*   otostr(VM* vm, O* object);
 
+/* Get instance field 'key', returns false if there is no such field. */
+sstatic force_inline bool
+OInstance_get(OInstance* instance, Value key, Value* out)
+{
+    if(likely(instance->shape != NULL)) {
+        Value slot;
+        if(!HashTable_get(&instance->shape->slots, key, &slot)) return false;
+        *out = instance->slots[(UInt)AS_NUMBER(slot)];
+        return true;
+    }
+    return HashTable_get(instance->fields, key, out);
+}
+
+/* Get method table slot of method 'key', returns -1 if there is no such method. */
+sstatic force_inline Int OClass_slot(OClass* oclass, Value key)
+{
+    Value slot;
+    for(; oclass != NULL; oclass = oclass->super)
+        if(HashTable_get(&oclass->methods, key, &slot)) return (Int)AS_NUMBER(slot);
+    return -1;
+}
+
+/* Get method 'key', returns false if there is no such method. */
+sstatic force_inline bool OClass_get(OClass* oclass, Value key, OClosure** out)
+{
+    Int slot = OClass_slot(oclass, key);
+    if(slot < 0) return false;
+    *out = oclass->mtable[slot];
+    return true;
+}
+
+/*
+ * Advance 'range' past the control variable 'cntl' (nil before the
+ * first iteration), returns false once the range is exhausted.
+ */
+sstatic force_inline bool ORange_next(ORange* range, Value cntl, double* i)
+{
+    *i = (IS_NIL(cntl) ? range->start : AS_NUMBER(cntl) + range->step);
+    return (range->step > 0 ? *i < range->stop : *i > range->stop);
+}
+
 void oprint(const Value value);
 Hash ohash(Value value);
 void ofree(VM* vm, O* object);
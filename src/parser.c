@@ -20,10 +20,6 @@
 
 
 
-// Get instruction length
-#define GET_OP_TYPE(idx, op, E)                                                          \
-    ((idx <= UINT8_MAX) ? ((E)->ins.l = false, op) : ((E)->ins.l = true, op##L))
-
 // Return current chunk code offset
 #define codeoffset(F) (CHUNK(F)->code.len)
 
@@ -82,6 +78,7 @@ typedef struct { /* Control Flow context */
      * This approach would be similar for 'continue' in
      * case of 'do while' loop.*/
     Array_Array_Int breaks; /* Break statement offsets */
+    Array_Int*      continues; /* Innermost numeric for-loop continue offsets */
 
     Int innerlstart; /* Innermost loop start offset */
     Int innerldepth; /* Innermost loop scope depth */
@@ -103,11 +100,16 @@ typedef struct { /* Control Flow context */
  * another function).
  * The 'local' field indicates if the capture occurred in the enclosing
  * function.
+ * Variables declared 'fixed' can't change, they are copied into the closure
+ * by value and are numbered separately from the other upvalues, 'slot' is
+ * the index into one of those two closure arrays.
  **/
 typedef struct {
-    UInt idx; // Stack index
-    Byte flags; // Local flags
-    bool local;
+    Token name; // Variable name
+    UInt  idx; // Stack index (or slot in the enclosing function)
+    UInt  slot; // Closure upvalue index (or fixed value index)
+    Byte  flags; // Local flags
+    bool  local;
 } Upvalue;
 
 
@@ -178,7 +180,6 @@ typedef struct {
     } jmp; // code jumps
     struct {
         Int  code; // instruction index
-        bool l; // is this long instruction
         bool set; // should it be a setter or getter
         bool binop; // is this instruction a simple binary operator
     } ins; // instruction info
@@ -201,7 +202,7 @@ sstatic force_inline void Exp_init(Exp* E, ExpType type, Int code, Int value)
 // Get constant
 #define CONSTANT(F, E) Array_Value_index(&CHUNK(F)->constants, (E)->value)
 // Get instruction
-#define INSTRUCTION(F, E) byteptr(Array_Byte_index(&CHUNK(F)->code, (E)->ins.code))
+#define INSTRUCTION(F, E) Array_Inst_index(&CHUNK(F)->code, (E)->ins.code)
 
 // Expressions are constants and their Values are equal
 #define eareconstandeq(F, E1, E2)                                                        \
@@ -209,46 +210,16 @@ sstatic force_inline void Exp_init(Exp* E, ExpType type, Int code, Int value)
      veq(*CONSTANT(F, E1), *CONSTANT(F, E2)))
 
 
-// Set first long parameter
-#define SET_LPARAM(F, E, val) PUT_BYTES3(INSTRUCTION(F, E) + 1, val)
-// Set second long parameter
-#define SET_LLPARAM(F, E, val) PUT_BYTES3(INSTRUCTION(F, E) + 4, val)
-// Set first short parameter
-#define SET_SPARAM(F, E, val) PUT_BYTE(INSTRUCTION(F, E) + 1, val)
-// Set instruction return count (first param)
-#define SET_RETCNT(F, E, cnt) SET_LPARAM(F, E, cnt)
-// Set instruction return count (second param)
-#define SET_RETCNTL(F, E, cnt) SET_LLPARAM(F, E, cnt)
+// Set instruction return count (first operand)
+#define SET_RETCNT(F, E, cnt) SET_ARG(*INSTRUCTION(F, E), cnt)
+// Set instruction return count (first extension word)
+#define SET_RETCNTL(F, E, cnt) (INSTRUCTION(F, E)[1] = (cnt))
 
-// Pop last instruction parameter (1 byte)
-#define PARAM_POP(F)                                                                     \
-    do {                                                                                 \
-        ASSERT(CHUNK(F)->code.len >= 1, "Invalid PARAM_POP.");                           \
-        CHUNK(F)->code.len--;                                                            \
-    } while(false)
-// Pop last instruction long parameter (3 bytes)
-#define LPARAM_POP(F)                                                                    \
-    do {                                                                                 \
-        ASSERT(CHUNK(F)->code.len >= 3, "Invalid LPARAM_POP.");                          \
-        CHUNK(F)->code.len -= 3;                                                         \
-    } while(false)
-// Pop last short/simple instruction (1 byte)
-#define SINSTRUCTION_POP(F)                                                              \
-    do {                                                                                 \
-        ASSERT(CHUNK(F)->code.len >= 1, "Invalid SINSTRUCTION_POP.");                    \
-        CHUNK(F)->code.len--;                                                            \
-    } while(false)
-// Pop last instruction with parameter (2 bytes)
-#define INSTRUCTION_POP(F)                                                               \
-    do {                                                                                 \
-        ASSERT(CHUNK(F)->code.len >= 2, "Invalid INSTRUCTION_POP.");                     \
-        CHUNK(F)->code.len -= 2;                                                         \
-    } while(false)
-// Pop last instruction with long parameter (4 bytes)
-#define LINSTRUCTION_POP(F)                                                              \
+// Pop last 'n' words (instruction and its extension words)
+#define CODE_POP(F, n)                                                                   \
     do {                                                                                 \
-        ASSERT(CHUNK(F)->code.len >= 4, "Invalid LINSTRUCTION_POP.");                    \
-        CHUNK(F)->code.len -= 4;                                                         \
+        ASSERT(CHUNK(F)->code.len >= (n), "Invalid CODE_POP.");                          \
+        CHUNK(F)->code.len -= (n);                                                       \
     } while(false)
 
 // Pop last constant
@@ -258,6 +229,13 @@ sstatic force_inline void Exp_init(Exp* E, ExpType type, Int code, Int value)
         Array_Value_pop(&CHUNK(F)->constants);                                           \
     } while(false)
 
+// Pop last inline cache
+#define CACHE_POP(F)                                                                     \
+    do {                                                                                 \
+        ASSERT(CHUNK(F)->caches.len > 0, "Invalid CACHE_POP.");                          \
+        Array_IC_pop(&CHUNK(F)->caches);                                                 \
+    } while(false)
+
 
 
 
@@ -272,6 +250,7 @@ struct Scope {
     Byte   isloop : 1; // This scope is loop
     Byte   isswitch : 1; // This scope is switch
     Byte   isgloop : 1; // This scope is generic loop
+    Byte   isfloop : 1; // This scope is numeric for-loop
     Int    depth; // scope depth (index)
 };
 
@@ -359,16 +338,24 @@ sstatic force_inline Scope* getscope(Function* F, Int depth)
 typedef struct {
     Int codeoffset;
     Int constlen;
+    Int cachelen;
+    Int looplen;
     Int localc;
     Int upvalc;
+    Int fnupvalc;
+    Int fixedc;
 } Context;
 
 sstatic force_inline void savecontext(Function* F, Context* C)
 {
     C->codeoffset = codeoffset(F);
     C->constlen   = CHUNK(F)->constants.len;
+    C->cachelen   = CHUNK(F)->caches.len;
+    C->looplen    = CHUNK(F)->loops.len;
     C->localc     = F->locals.len;
     C->upvalc     = F->upvalues->len;
+    C->fnupvalc   = F->fn->upvalc;
+    C->fixedc     = F->fn->fixedc;
 }
 
 // Trim/set length of code and/or constant array
@@ -381,8 +368,12 @@ sstatic force_inline void concatcode(Function* F, Int codeoffset, Int constoffse
 sstatic force_inline void restorecontext(Function* F, Context* C)
 {
     concatcode(F, C->codeoffset, C->constlen);
-    F->locals.len    = C->localc;
+    CHUNK(F)->caches.len = C->cachelen;
+    CHUNK(F)->loops.len  = C->looplen;
+    F->locals.len        = C->localc;
     F->upvalues->len = C->upvalc;
+    F->fn->upvalc    = C->fnupvalc;
+    F->fn->fixedc    = C->fixedc;
 }
 
 
@@ -430,32 +421,26 @@ sstatic void error(Function* F, const char* error, ...)
 
 //======================= CODE =======================//
 
-// Multi-byte instruction (up to 4 bytes)
+// Instruction with operand
 #define CODEOP(F, code, param)                                                           \
-    Chunk_write_codewparam(CHUNK(F), code, param, PREVT(F).line)
-
-// Single byte instruction
-#define CODE(F, byte)                                                                    \
     ({                                                                                   \
-        (F)->fn->gotret = (((byte) == OP_RET) | ((byte) == OP_TOPRET));                  \
-        Chunk_write(CHUNK(F), byte, PREVT(F).line);                                      \
+        (F)->fn->gotret = 0;                                                             \
+        Chunk_write_codewparam(CHUNK(F), code, param, PREVT(F).line);                    \
     })
 
-// 3 byte parameter
-#define CODEL(F, bytes)                                                                  \
-    do {                                                                                 \
-        CODE(F, BYTE(bytes, 0));                                                         \
-        CODE(F, BYTE(bytes, 1));                                                         \
-        CODE(F, BYTE(bytes, 2));                                                         \
-    } while(false)
-
-// Emit jump instruction
-#define CODEJMP(F, jmp)                                                                  \
+// Instruction without operand
+#define CODE(F, op)                                                                      \
     ({                                                                                   \
-        CODEOP(F, jmp, 0);                                                               \
-        codeoffset(F) - 3;                                                               \
+        (F)->fn->gotret = (((op) == OP_RET) | ((op) == OP_TOPRET));                      \
+        Chunk_write(CHUNK(F), MAKE_INS(op, 0), PREVT(F).line);                           \
     })
 
+// Extension word (whole operand)
+#define CODEL(F, word) Chunk_write(CHUNK(F), (Inst)(word), PREVT(F).line)
+
+// Emit jump instruction, returns its index
+#define CODEJMP(F, jmp) CODEOP(F, jmp, 0)
+
 // Emit pop instruction
 #define CODEPOP(F, n)                                                                    \
     do {                                                                                 \
@@ -465,6 +450,28 @@ sstatic void error(Function* F, const char* error, ...)
         }                                                                                \
     } while(false)
 
+// Emit inline cache index (extension word)
+#define CODECACHE(F)                                                                     \
+    do {                                                                                 \
+        UInt _cache = Chunk_make_cache(CHUNK(F));                                        \
+        CODEL(F, _cache);                                                                \
+    } while(false)
+
+// Emit instruction with inline cache (operand + cache index)
+#define CODECACHED(F, code, param)                                                       \
+    ({                                                                                   \
+        UInt _start = CODEOP(F, code, param);                                            \
+        CODECACHE(F);                                                                    \
+        _start;                                                                          \
+    })
+
+// Emit return instruction, 'retcnt' is the return values count operand
+#define CODERET(F, op, retcnt)                                                           \
+    do {                                                                                 \
+        CODEOP(F, op, retcnt);                                                           \
+        (F)->fn->gotret = 1;                                                             \
+    } while(false)
+
 // Emit unary instruction
 #define CODEUN(F, opr) CODE(F, unopr2op(opr))
 
@@ -472,39 +479,39 @@ sstatic void error(Function* F, const char* error, ...)
 #define CODEBIN(F, opr) CODE(F, binopr2op(opr))
 
 // Emit return instruction
-sstatic force_inline void coderet(Function* F, bool explicit, bool gotret)
+sstatic force_inline void coderet(Function* F, bool gotret)
 {
     if(gotret) {
         F->fn->gotret = 1;
         return;
     }
-    if(!explicit) CODE(F, OP_RETSTART);
     if(F->fn_type == FN_INIT) CODEOP(F, OP_GET_LOCAL, 0);
     else {
         if(F->fn_type == FN_SCRIPT) {
             CODE(F, OP_TRUE);
-            CODE(F, OP_TOPRET);
+            CODERET(F, OP_TOPRET, 1);
             return;
         }
         CODE(F, OP_NIL);
     }
-    CODE(F, OP_RET);
+    CODERET(F, OP_RET, 1);
 }
 
-// Emit loop instruction
+// Emit loop instruction (jump offset + loop counter index)
 sstatic force_inline void codeloop(Function* F, UInt start)
 {
-    CODE(F, OP_LOOP);
-    UInt offset = codeoffset(F) - start + 3;
+    UInt offset = codeoffset(F) - start + 2;
     if(offset >= BYTECODE_MAX) JUMP_LIMIT_ERR(F, BYTECODE_MAX);
-    CODEL(F, offset);
+    CODEOP(F, OP_LOOP, offset);
+    CODEL(F, Chunk_make_loop(F->vm, CHUNK(F)));
 }
 
 // Initialize global variable
-#define INIT_GLOBAL(F, idx, vflags, E)                                                   \
+#define INIT_GLOBAL(F, idx, vflags)                                                      \
     do {                                                                                 \
-        (F)->vm->globvals[idx].flags = vflags;                                           \
-        CODEOP(F, GET_OP_TYPE(idx, OP_DEFINE_GLOBAL, E), idx);                           \
+        UInt _idx                     = (idx);                                           \
+        (F)->vm->globvals[_idx].flags = vflags;                                          \
+        CODEOP(F, OP_DEFINE_GLOBAL, _idx);                                               \
     } while(false)
 
 // Check if Tokens are equal
@@ -527,22 +534,25 @@ sstatic force_inline Int get_local(Function* F, Token* name)
     return -1;
 }
 
-sstatic force_inline UInt add_upval(Function* F, UInt idx, Byte flags, bool local)
+#define UPVAL_ISFIXED(upval) BIT_CHECK((upval)->flags, VFIXED_BIT)
+
+// Returns index into 'F->upvalues'
+sstatic force_inline UInt
+add_upval(Function* F, Token* name, UInt idx, Byte flags, bool local)
 {
-    Int upvalc = F->fn->upvalc;
-    ASSERT(upvalc < (Int)F->upvalues->len + 1, "Invalid upvalc.");
-    for(Int i = 0; i < upvalc; i++) {
+    bool fixed = BIT_CHECK(flags, VFIXED_BIT);
+    for(UInt i = 0; i < F->upvalues->len; i++) {
         Upvalue* upvalue = Array_Upvalue_index(F->upvalues, i);
-        if(upvalue->idx == idx && upvalue->local == local) return i; // already exists
+        if(upvalue->idx == idx && upvalue->local == local && UPVAL_ISFIXED(upvalue) == fixed)
+            return i; // already exists
     }
-    if(unlikely(upvalc >= INDEX_MAX)) {
+    if(unlikely(F->upvalues->len >= (size_t)INDEX_MAX)) {
         UPVALUE_LIMIT_ERR(F, INDEX_MAX, F->fn->name->storage);
         return 0;
     }
-    Upvalue upval = {idx, flags, local};
-    if(upvalc == (Int)F->upvalues->len) Array_Upvalue_push(F->upvalues, upval);
-    else *Array_Upvalue_index(F->upvalues, upvalc) = upval;
-    return F->fn->upvalc++;
+    UInt    slot  = (fixed ? F->fn->fixedc++ : F->fn->upvalc++);
+    Upvalue upval = {*name, idx, slot, flags, local};
+    return Array_Upvalue_push(F->upvalues, upval);
 }
 
 sstatic Int get_upval(Function* F, Token* name)
@@ -551,13 +561,13 @@ sstatic Int get_upval(Function* F, Token* name)
     Int idx = get_local(F->enclosing, name);
     if(idx != -1) {
         Local* l = Array_Local_index(&F->enclosing->locals, idx);
-        LFLAG_SET(l, VCAPTURED_BIT);
-        return add_upval(F, (UInt)idx, l->flags, true);
+        if(!BIT_CHECK(l->flags, VFIXED_BIT)) LFLAG_SET(l, VCAPTURED_BIT); // copied if fixed
+        return add_upval(F, name, (UInt)idx, l->flags, true);
     }
     idx = get_upval(F->enclosing, name);
     if(idx != -1) {
-        Local* l = Array_Local_index(&F->enclosing->locals, idx);
-        return add_upval(F, (UInt)idx, l->flags, false);
+        Upvalue* u = Array_Upvalue_index(F->enclosing->upvalues, idx);
+        return add_upval(F, name, u->slot, u->flags, false);
     }
     return -1;
 }
@@ -595,15 +605,18 @@ sstatic force_inline Int codevar(Function* F, Token name, Exp* E)
     Int    idx = get_local(F, &name);
     if(idx != -1) {
         E->type = EXP_LOCAL;
-        getop   = GET_OP_TYPE(idx, OP_GET_LOCAL, E);
+        getop   = OP_GET_LOCAL;
     } else if((idx = get_upval(F, &name)) != -1) {
-        E->type  = EXP_UPVAL;
-        E->ins.l = true;
-        getop    = OP_GET_UPVALUE;
+        Upvalue* upval = Array_Upvalue_index(F->upvalues, idx);
+        E->type        = EXP_UPVAL;
+        E->value       = idx;
+        getop          = (UPVAL_ISFIXED(upval) ? OP_GET_FIXED : OP_GET_UPVALUE);
+        if(!E->ins.set) return (E->ins.code = CODEOP(F, getop, upval->slot));
+        else return (E->ins.code = -1); // this is assignment
     } else {
         E->type = EXP_GLOBAL;
         idx     = MAKE_GLOBAL(F, &name);
-        getop   = GET_OP_TYPE(idx, OP_GET_GLOBAL, E);
+        getop   = OP_GET_GLOBAL;
     }
     E->value = idx;
     if(!E->ins.set) return (E->ins.code = CODEOP(F, getop, idx));
@@ -622,19 +635,26 @@ sstatic force_inline void popvarins(Function* F, Exp* E)
         case EXP_UPVAL:
         case EXP_LOCAL:
         case EXP_GLOBAL:
-            if(E->ins.l) LINSTRUCTION_POP(F);
-            else INSTRUCTION_POP(F);
+            CODE_POP(F, 1);
             break;
         case EXP_INDEXED:
             // @?: setters are not reachable ?
-            switch(*INSTRUCTION(F, E)) {
+            switch(GET_OP(*INSTRUCTION(F, E))) {
                 case OP_INDEX:
-                    SINSTRUCTION_POP(F);
+                    CODE_POP(F, 1);
                     break;
-                case OP_GET_PROPERTY:
                 case OP_GET_SUPER:
-                    LINSTRUCTION_POP(F);
+                case OP_GET_PROPERTY:
+                    CODE_POP(F, 2);
+                    CACHE_POP(F);
+                    break;
+                case OP_GET_LOCAL_PROPERTY: { // split back into receiver load
+                    UInt slot = GET_ARG(*INSTRUCTION(F, E));
+                    CODE_POP(F, 3);
+                    CACHE_POP(F);
+                    CODEOP(F, OP_GET_LOCAL, slot);
                     break;
+                }
                 default:
                     unreachable;
             }
@@ -650,11 +670,11 @@ sstatic force_inline void popcallins(Function* F, Exp* E)
     switch(E->type) {
         case EXP_CALL:
         case EXP_INVOKE_INDEX:
-            LINSTRUCTION_POP(F);
+            CODE_POP(F, 2);
             break;
         case EXP_INVOKE:
-            LINSTRUCTION_POP(F);
-            LPARAM_POP(F);
+            CODE_POP(F, 4);
+            CACHE_POP(F);
             break;
         default:
             unreachable;
@@ -664,8 +684,7 @@ sstatic force_inline void popcallins(Function* F, Exp* E)
 sstatic void rmlastins(Function* F, Exp* E)
 {
     ExpType type = E->type;
-    if(etisliteral(type)) SINSTRUCTION_POP(F);
-    else if(etisconst(type)) LINSTRUCTION_POP(F);
+    if(etisliteral(type) || etisconst(type)) CODE_POP(F, 1);
     else if(etisvar(type)) popvarins(F, E);
     else if(etiscall(type)) popcallins(F, E);
     else switch(type)
@@ -674,7 +693,7 @@ sstatic void rmlastins(Function* F, Exp* E)
                 goto panic;
             case EXP_EXPR:
                 if(E->ins.binop) {
-                    LINSTRUCTION_POP(F);
+                    CODE_POP(F, 1);
                     break;
                 } else {
                 panic: // FALLTHRU
@@ -702,6 +721,8 @@ sstatic force_inline void startscope(Function* F, Scope* S, Byte isloop, Byte is
     S->localc   = F->locals.len;
     S->isloop   = isloop;
     S->isswitch = isswitch;
+    S->isgloop  = 0;
+    S->isfloop  = 0;
     S->depth    = F->S->depth + 1;
     S->prev     = F->S;
     F->S        = S;
@@ -748,6 +769,7 @@ sstatic void ControlFlow_init(VM* vm, ControlFlow* cflow)
     cflow->innerlstart = -1;
     cflow->innerldepth = 0;
     cflow->innersdepth = 0;
+    cflow->continues   = NULL;
     Array_Array_Int_init(&cflow->breaks, vm);
 }
 
@@ -783,6 +805,8 @@ sstatic void F_init(
     globscope->depth    = 0;
     globscope->isloop   = 0;
     globscope->isswitch = 0;
+    globscope->isgloop  = 0;
+    globscope->isfloop  = 0;
     globscope->localc   = 1;
     // Initialize Function state
     F->vm        = vm;
@@ -796,10 +820,8 @@ sstatic void F_init(
     F->fn_type   = fn_type;
     F->vflags    = 0;
     ControlFlow_init(vm, &F->cflow);
-    if(enclosing == NULL) {
-        F->upvalues = GC_MALLOC(vm, sizeof(Array_Upvalue));
-        Array_Upvalue_init(F->upvalues, vm);
-    } else F->upvalues = enclosing->upvalues;
+    F->upvalues = GC_MALLOC(vm, sizeof(Array_Upvalue));
+    Array_Upvalue_init(F->upvalues, vm);
     Array_Local_init(&F->locals, vm);
     Array_Local_init_cap(&F->locals, SHORT_STACK_SIZE);
     /* Reserve first stack slot for VM ('self' ObjInstance) */
@@ -822,13 +844,11 @@ void F_free(Function* F)
 {
     VM* vm = F->vm;
     ControlFlow_free(&F->cflow);
-    if(F->enclosing == NULL) {
-        ASSERT(
-            F->fn_type == FN_SCRIPT,
-            "Function is top-level but the type is not 'FN_SCRIPT'.");
-        Array_Upvalue_free(F->upvalues, NULL);
-        GC_FREE(vm, F->upvalues, sizeof(Array_Upvalue));
-    }
+    ASSERT(
+        F->enclosing != NULL || F->fn_type == FN_SCRIPT,
+        "Function is top-level but the type is not 'FN_SCRIPT'.");
+    Array_Upvalue_free(F->upvalues, NULL);
+    GC_FREE(vm, F->upvalues, sizeof(Array_Upvalue));
     Array_Local_free(&F->locals, NULL);
     vm->F = F->enclosing;
     GC_FREE(vm, F, sizeof(Function));
@@ -929,7 +949,8 @@ sstatic force_inline void expect(Function* F, TokenType type, const char* err)
 // End compilation of the function and emit return instruction
 sstatic force_inline OFunction* compile_end(Function* F)
 {
-    coderet(F, false, F->fn->gotret);
+    coderet(F, F->fn->gotret);
+    if(!F->lexer->error) F->fn->maxstack = Chunk_maxstack(CHUNK(F), F->vm);
 #ifdef DEBUG_PRINT_CODE
     if(!F->lexer->error) {
         OFunction* fn = F->fn;
@@ -981,12 +1002,12 @@ sstatic void make_local(Function* F, Token* name)
     local_new(F, *name);
 }
 
-// Patch jump instruction
-sstatic force_inline void patchjmp(Function* F, Int jmp_offset)
+// Patch jump instruction at 'jmp', offset is relative to the end of the instruction
+sstatic force_inline void patchjmp(Function* F, Int jmp)
 {
-    Int offset = codeoffset(F) - jmp_offset - 3;
+    Int offset = codeoffset(F) - (jmp + Chunk_oplen(CHUNK(F), jmp));
     if(unlikely(offset >= BYTECODE_MAX)) JUMP_LIMIT_ERR(F, BYTECODE_MAX);
-    PUT_BYTES3(&CHUNK(F)->code.data[jmp_offset], offset);
+    SET_ARG(CHUNK(F)->code.data[jmp], offset);
 }
 
 sstatic force_inline void startbreaklist(Function* F)
@@ -1150,6 +1171,35 @@ sstatic OpCode binopr2op(BinaryOpr opr)
     }
 }
 
+// Fetch register (RK) variant of binary instruction, -1 if there is none
+sstatic Int binopr2rkop(BinaryOpr opr)
+{
+    switch(opr) {
+        case OPR_ADD:
+            return OP_ADDRK;
+        case OPR_SUB:
+            return OP_SUBRK;
+        case OPR_MUL:
+            return OP_MULRK;
+        case OPR_DIV:
+            return OP_DIVRK;
+        case OPR_NE:
+            return OP_NOT_EQUALRK;
+        case OPR_EQ:
+            return OP_EQUALRK;
+        case OPR_LT:
+            return OP_LESSRK;
+        case OPR_LE:
+            return OP_LESS_EQUALRK;
+        case OPR_GT:
+            return OP_GREATERRK;
+        case OPR_GE:
+            return OP_GREATER_EQUALRK;
+        default:
+            return -1;
+    }
+}
+
 sstatic const struct {
     Byte left; // Left priority
     Byte right; // Right priority
@@ -1204,6 +1254,15 @@ sstatic void setmulret(Function* F, Exp* E)
     }
 }
 
+// Get count operand for the list of 'cnt' expressions
+// where 'E' is the last expression (see 'VARCNT_BIT').
+sstatic UInt varcnt(Function* F, Exp* E, UInt cnt)
+{
+    if(!ethasmulret(E->type)) return cnt;
+    setmulret(F, E);
+    return (cnt - 1) | VARCNT_BIT;
+}
+
 // Adjust assign expressions in case last expression is a function call
 sstatic void adjustassign(Function* F, Exp* E, Int left, Int right)
 {
@@ -1249,41 +1308,50 @@ sstatic Int name(Function* F, const char* errmsg)
     return MAKE_GLOBAL(F, name);
 }
 
-sstatic Local* upvalvar(Function* F, Int idx)
-{
-    Upvalue* upval = &F->upvalues->data[idx];
-    if(!upval->local) upvalvar(F->enclosing, idx);
-    return &F->locals.data[upval->idx];
-}
-
 // helper [exprstm]
 sstatic void codeset(Function* F, Exp* E)
 {
     switch(E->type) {
         case EXP_UPVAL: {
-            Local* local = upvalvar(F, E->value);
-            if(BIT_CHECK(local->flags, VFIXED_BIT)) LOCAL_FIXED_ERR(F, local->name);
-            CODEOP(F, OP_SET_UPVALUE, E->value);
+            Upvalue* upval = Array_Upvalue_index(F->upvalues, E->value);
+            if(UPVAL_ISFIXED(upval)) LOCAL_FIXED_ERR(F, upval->name);
+            CODEOP(F, OP_SET_UPVALUE, upval->slot);
             break;
         }
         case EXP_LOCAL: {
             Local* local = &F->locals.data[E->value];
             if(BIT_CHECK(local->flags, VFIXED_BIT)) LOCAL_FIXED_ERR(F, local->name);
-            CODEOP(F, GET_OP_TYPE(E->value, OP_SET_LOCAL, E), E->value);
+            CODEOP(F, OP_SET_LOCAL, E->value);
             break;
         }
         case EXP_GLOBAL:
-            CODEOP(F, GET_OP_TYPE(E->value, OP_SET_GLOBAL, E), E->value);
+            CODEOP(F, OP_SET_GLOBAL, E->value);
             break;
         case EXP_INDEXED:
             if(E->value == NO_VAL) CODE(F, OP_SET_INDEX);
-            else CODEOP(F, OP_SET_PROPERTY, E->value);
+            else CODECACHED(F, OP_SET_PROPERTY, E->value);
             break;
         default:
             return;
     }
 }
 
+// helper [exprstm]
+// Try storing the result of register instruction 'E' directly
+// into local variable 'V' instead of emitting 'OP_SET_LOCAL'.
+sstatic bool codesetrk(Function* F, Exp* V, const Exp* E)
+{
+    if(V->type != EXP_LOCAL || V->value == 0 || V->value > UINT8_MAX ||
+       E->type != EXP_EXPR || !E->ins.binop || E->ins.code + 1 != (Int)codeoffset(F))
+        return false;
+    Inst* ip = INSTRUCTION(F, E);
+    if(GET_OP(*ip) < OP_ADDRK || GET_OP(*ip) > OP_LESS_EQUALRK) return false;
+    Local* local = &F->locals.data[V->value];
+    if(BIT_CHECK(local->flags, VFIXED_BIT)) LOCAL_FIXED_ERR(F, local->name);
+    *ip |= MAKE_INS(0, V->value); // A
+    return true;
+}
+
 ARRAY_NEW(Array_Exp, Exp);
 // helper [exprstm]
 sstatic void codesetall(Function* F, Array_Exp* Earr)
@@ -1321,7 +1389,8 @@ sstatic void exprstm(Function* F, bool lastclause)
         E.ins.set = false;
         Int expc  = explist(F, vars, &E);
         if(vars != expc) adjustassign(F, &E, vars, expc);
-        codesetall(F, &Earr);
+        if(vars != 1 || !codesetrk(F, Array_Exp_index(&Earr, 0), &E))
+            codesetall(F, &Earr);
         Array_Exp_free(&Earr, NULL);
     } else {
         if(etisvar(E.type)) {
@@ -1389,8 +1458,7 @@ sstatic void codeassign(Function* F, Int names, Array_Int* nameidx)
     ASSERT(names == (Int)nameidx->len, "name count != indexes array len.");
     while(nameidx->len > 0) {
         Int idx = Array_Int_pop(nameidx);
-        Exp _; // dummy
-        INIT_GLOBAL(F, idx, F->vflags, &_);
+        INIT_GLOBAL(F, idx, F->vflags);
     }
 }
 
@@ -1445,11 +1513,9 @@ sstatic void fn(Function* F, FunctionType type)
     OFunction* fn = compile_end(Fnew);
     fn->isinit    = (type == FN_INIT);
     CODEOP(F, OP_CLOSURE, make_constant(F, OBJ_VAL(fn)));
-    for(UInt i = 0; i < fn->upvalc; i++) {
+    for(UInt i = 0; i < Fnew->upvalues->len; i++) {
         Upvalue* upval = Array_Upvalue_index(Fnew->upvalues, i);
-        CODE(F, upval->local ? 1 : 0);
-        CODE(F, upval->flags);
-        CODEL(F, upval->idx);
+        CODEL(F, MAKE_UPVAL(upval->local ? 1 : 0, upval->flags, upval->idx));
     }
     F_free(Fnew);
 }
@@ -1460,8 +1526,7 @@ sstatic void fndec(Function* F)
     UInt idx = name(F, "Expect function name.");
     if(F->S->depth > 0) INIT_LOCAL(F, 0); // initialize to allow recursion
     fn(F, FN_FUNCTION);
-    Exp _; // dummy
-    if(F->S->depth == 0) INIT_GLOBAL(F, idx, 0, &_);
+    if(F->S->depth == 0) INIT_GLOBAL(F, idx, 0);
 }
 
 sstatic void method(Function* F)
@@ -1488,7 +1553,7 @@ sstatic void classdec(Function* F)
     if(F->S->depth > 0) {
         make_local(F, &class_name);
         INIT_LOCAL(F, 0);
-    } else INIT_GLOBAL(F, MAKE_GLOBAL(F, &class_name), 0, &_);
+    } else INIT_GLOBAL(F, MAKE_GLOBAL(F, &class_name), 0);
     Class cclass;
     cclass.enclosing  = F->cclass;
     cclass.superclass = false;
@@ -1518,28 +1583,89 @@ sstatic void classdec(Function* F)
 
 /// call ::= '(' ')'
 ///        | '(' explist ')'
-sstatic void call(Function* F, Exp* E)
+// Returns argument count operand for the call instruction
+sstatic UInt call(Function* F, Exp* E)
 {
-    CODE(F, OP_CALLSTART);
-    if(!check(F, TOK_RPAREN)) explist(F, BYTECODE_MAX, E);
+    UInt argc = 0;
+    if(!check(F, TOK_RPAREN)) argc = explist(F, BYTECODE_MAX, E);
     else E->type = EXP_NONE;
     expect(F, TOK_RPAREN, "Expect ')'.");
-    if(ethasmulret(E->type)) setmulret(F, E);
+    return varcnt(F, E, argc);
 }
 
 sstatic void codecall(Function* F, Exp* E)
 {
-    call(F, E);
+    UInt argc   = call(F, E);
     E->type     = EXP_CALL;
     E->ins.code = CODEOP(F, OP_CALL, 1);
+    CODEL(F, argc);
 }
 
 sstatic void codeinvoke(Function* F, Exp* E, Int idx)
 {
-    call(F, E);
+    UInt argc   = call(F, E);
     E->type     = EXP_INVOKE;
     E->ins.code = CODEOP(F, OP_INVOKE, idx);
     CODEL(F, 1); // retcnt
+    CODEL(F, argc);
+    CODECACHE(F);
+}
+
+sstatic void codeinvokesuper(Function* F, Exp* E, Int idx)
+{
+    Exp _; // dummy
+    _.ins.set   = false;
+    UInt argc   = call(F, E);
+    codevar(F, syntoken("super"), &_);
+    E->ins.code = CODEOP(F, OP_INVOKE_SUPER, idx);
+    CODEL(F, 1); // retcnt
+    CODEL(F, argc);
+    CODECACHE(F);
+    E->type = EXP_INVOKE;
+}
+
+// Call of a method fetched right before ('(obj.name)()', '(obj[key])()' or
+// '(super.name)()'), the getter and the call get fused into an invoke so
+// the bound method is never created. Returns false if 'E' is not a getter.
+sstatic bool codecallgetter(Function* F, Exp* E)
+{
+    if(E->type != EXP_INDEXED) return false;
+    Int len;
+    switch(GET_OP(*INSTRUCTION(F, E))) {
+        case OP_INDEX:
+            len = 1;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_GET_SUPER:
+            len = 2;
+            break;
+        case OP_GET_LOCAL_PROPERTY:
+            len = 3;
+            break;
+        default:
+            return false;
+    }
+    if(E->ins.code + len != (Int)codeoffset(F)) return false;
+    switch(GET_OP(*INSTRUCTION(F, E))) {
+        case OP_INDEX: {
+            CODE_POP(F, 1);
+            UInt argc   = call(F, E);
+            E->type     = EXP_INVOKE_INDEX;
+            E->ins.code = CODEOP(F, OP_INVOKE_INDEX, 1);
+            CODEL(F, argc);
+            break;
+        }
+        case OP_GET_SUPER:
+            CODE_POP(F, 3); // 'super' load and 'OP_GET_SUPER'
+            CACHE_POP(F);
+            codeinvokesuper(F, E, E->value);
+            break;
+        default:
+            popvarins(F, E);
+            codeinvoke(F, E, E->value);
+            break;
+    }
+    return true;
 }
 
 sstatic void dec(Function* F)
@@ -1693,6 +1819,24 @@ sstatic void switchstm(Function* F)
     F->S->isswitch       = inswitch;
 }
 
+// Emit jump taken if condition 'E' is false, returns the index
+// of the jump instruction (for 'patchjmp').
+// Register comparison right before the jump is fused with it.
+// Example: OP_LESSRK 0 1 K(0), OP_JMP_IF_FALSE_POP => OP_LESSRK_JMP 1 K(0)
+sstatic Int codecondjmp(Function* F, Exp* E)
+{
+    if(E->type != EXP_EXPR || E->ins.code < 0 || E->ins.code + 1 != (Int)codeoffset(F))
+        return CODEJMP(F, OP_JMP_IF_FALSE_POP);
+    Inst*  ip = INSTRUCTION(F, E);
+    OpCode op = GET_OP(*ip);
+    if(GET_A(*ip) != 0 || op < OP_NOT_EQUALRK || op > OP_LESS_EQUALRK)
+        return CODEJMP(F, OP_JMP_IF_FALSE_POP);
+    Inst ext = *ip & 0xffff0000; // B and C
+    *ip      = MAKE_INS(op - OP_NOT_EQUALRK + OP_NOT_EQUALRK_JMP, 0); // jump offset
+    CODEL(F, ext);
+    return E->ins.code;
+}
+
 sstatic void ifstm(Function* F)
 {
     Exp     E;
@@ -1709,7 +1853,7 @@ sstatic void ifstm(Function* F)
         rmlastins(F, &E);
         if(etisfalse(E.type)) remove = true;
         else istrue = true;
-    } else jmptoelse = CODEJMP(F, OP_JMP_IF_FALSE_POP);
+    } else jmptoelse = codecondjmp(F, &E);
     stm(F);
     if(!remove) {
         jmptoend = CODEJMP(F, OP_JMP);
@@ -1759,7 +1903,7 @@ sstatic void whilestm(Function* F)
         rmlastins(F, &E);
         if(etisfalse(E.type)) remove = true;
         else infinite = true;
-    } else jmptoend = CODEJMP(F, OP_JMP_IF_FALSE_POP);
+    } else jmptoend = codecondjmp(F, &E);
     expect(F, TOK_RPAREN, "Expect ')' after condition.");
     stm(F); // body
     bool gotret = F->fn->gotret;
@@ -1778,16 +1922,92 @@ sstatic void whilestm(Function* F)
     endbreaklist(F);
 }
 
+/*
+ * Check if the for-loop condition (register jump at 'prep') and the
+ * last clause (single instruction at 'step') form a numeric loop,
+ * condition compares the local counter and the last clause adds number
+ * constant to the counter (or subtracts it).
+ */
+sstatic bool fornumeric(Function* F, Int prep, Int step)
+{
+    Chunk* chunk = CHUNK(F);
+    if(prep < 0 || step + 1 != (Int)codeoffset(F)) return false;
+    OpCode cond    = GET_OP(chunk->code.data[prep]);
+    Inst   ext     = chunk->code.data[prep + 1];
+    Inst   ins     = chunk->code.data[step];
+    Byte   counter = GET_A(ins);
+    if(cond < OP_GREATERRK_JMP || cond > OP_LESS_EQUALRK_JMP) return false;
+    if(GET_OP(ins) != OP_ADDRK && GET_OP(ins) != OP_SUBRK) return false;
+    return !RKISCONST(counter) && counter == GET_B(ins) && counter == GET_B(ext) &&
+           RKISCONST(GET_C(ins)) && IS_NUMBER(chunk->constants.data[RKINDEX(GET_C(ins))]);
+}
+
+// Check if the local 'rk' is captured or written by the code since 'start'
+sstatic bool slotwritten(Function* F, UInt start, Byte rk)
+{
+    Chunk* chunk = CHUNK(F);
+    if(RKISCONST(rk)) return false;
+    if(LFLAG_CHECK(Array_Local_index(&F->locals, rk), VCAPTURED_BIT)) return true;
+    for(UInt pc = start; pc < codeoffset(F); pc += Chunk_oplen(chunk, pc)) {
+        Inst*  ip = &chunk->code.data[pc];
+        OpCode op = GET_OP(*ip);
+        if((op == OP_SET_LOCAL && GET_ARG(*ip) == rk) ||
+           (op >= OP_ADDRK && op <= OP_LESS_EQUALRK && GET_A(*ip) == rk) ||
+           (op == OP_FORLOOP && GET_B(ip[1]) == rk))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Emit the numeric for-loop 'step' after the loop body. Counter and
+ * limit checked by 'OP_FORPREP' stay numbers only if the body never
+ * writes them, otherwise the loop keeps the generic step and condition.
+ */
+sstatic void codeforstep(Function* F, Int prep, Inst step)
+{
+    Chunk* chunk   = CHUNK(F);
+    Byte   counter = GET_B(chunk->code.data[prep + 1]);
+    Byte   limit   = GET_C(chunk->code.data[prep + 1]);
+    Byte   k       = GET_C(step);
+    bool   numeric = !slotwritten(F, prep + 2, counter) && !slotwritten(F, prep + 2, limit);
+    if(numeric && GET_OP(step) == OP_SUBRK) { // count with the negated step
+        double n   = AS_NUMBER(chunk->constants.data[RKINDEX(k)]);
+        UInt   idx = make_constant(F, INTNUM_VAL(-n));
+        numeric    = (idx <= RK_MAX);
+        k          = RKCONST(idx);
+    }
+    if(!numeric) {
+        CODEL(F, step);
+        codeloop(F, prep);
+        return;
+    }
+    OpCode cmp      = GET_OP(chunk->code.data[prep]) - OP_GREATERRK_JMP + OP_GREATERRK;
+    Inst   operands = MAKE_FOR(k, cmp, counter, limit);
+    SET_OP(chunk->code.data[prep], OP_FORPREP);
+    chunk->code.data[prep + 1] = operands;
+    UInt offset                = codeoffset(F) - (prep + 2) + 3;
+    if(offset >= BYTECODE_MAX) JUMP_LIMIT_ERR(F, BYTECODE_MAX);
+    CODEOP(F, OP_FORLOOP, offset);
+    CODEL(F, operands);
+    CODEL(F, Chunk_make_loop(F->vm, CHUNK(F)));
+}
+
 sstatic void forstm(Function* F)
 {
-    Scope   S;
-    Context C;
-    Exp     E;
-    Int     lstart, ldepth;
-    Int     jmptoend = -1;
-    bool    remove   = false;
-    bool    infinite = false;
-    startscope(F, &S, 1, 0);
+    Scope      S, L;
+    Context    C;
+    Exp        E;
+    Int        lstart, ldepth;
+    Int        jmptoend  = -1;
+    Int        prep      = -1; // condition of numeric loop
+    Inst       step      = 0; // last clause of numeric loop
+    Array_Int  continues;
+    Array_Int* ocontinues = F->cflow.continues;
+    bool       remove     = false;
+    bool       infinite   = false;
+    bool       numeric    = false;
+    startscope(F, &S, 0, 0);
     startbreaklist(F);
     expect(F, TOK_LPAREN, "Expect '(' after 'for'.");
     if(match(F, TOK_SEMICOLON)) // Initializer for-clause
@@ -1795,16 +2015,21 @@ sstatic void forstm(Function* F)
     else if(match(F, TOK_VAR)) vardec(F);
     else if(match(F, TOK_FIXED)) fvardec(F);
     else exprstm(F, false);
+    startscope(F, &L, 1, 0); // 'break' and 'continue' keep initializer locals
     savecontext(F, &C);
     startloop(F, &lstart, &ldepth);
     if(!match(F, TOK_SEMICOLON)) { // conditional
-        E.ins.set = false;
+        Int condstart = codeoffset(F);
+        E.ins.set     = false;
         expr(F, &E);
         if(etisconst(E.type)) {
             rmlastins(F, &E);
             if(etistrue(E.type)) infinite = true;
             else remove = true;
-        } else jmptoend = CODEJMP(F, OP_JMP_IF_FALSE_POP);
+        } else {
+            jmptoend = codecondjmp(F, &E);
+            if(jmptoend == condstart) prep = jmptoend;
+        }
         expect(F, TOK_SEMICOLON, "Expect ';' after for-loop condition clause.");
     } else infinite = true;
     if(!match(F, TOK_RPAREN)) { // last for-clause
@@ -1814,21 +2039,41 @@ sstatic void forstm(Function* F)
         if(!remove) jmptoincr = codeoffset(F);
         exprstm(F, true);
         if(!infinite && !remove) {
-            codeloop(F, (F)->cflow.innerlstart);
-            patchjmp(F, jmptobody);
-            (F)->cflow.innerlstart = jmptoincr;
+            if(fornumeric(F, prep, jmptoincr)) { // step goes after the body
+                step = CHUNK(F)->code.data[jmptoincr];
+                CODE_POP(F, 2); // last clause and the jump over it
+                numeric = true;
+            } else {
+                codeloop(F, (F)->cflow.innerlstart);
+                patchjmp(F, jmptobody);
+                (F)->cflow.innerlstart = jmptoincr;
+            }
         }
         expect(F, TOK_RPAREN, "Expect ')' after last for-loop clause.");
     }
+    if(numeric) { // 'continue' jumps forward to the step
+        L.isfloop = 1;
+        Array_Int_init(&continues, F->vm);
+        F->cflow.continues = &continues;
+    }
     stm(F); // Loop body
     if(!remove) {
-        codeloop(F, (F)->cflow.innerlstart);
+        if(numeric) {
+            for(UInt i = 0; i < continues.len; i++)
+                patchjmp(F, continues.data[i]);
+            codeforstep(F, prep, step);
+        } else codeloop(F, (F)->cflow.innerlstart);
         if(!infinite) patchjmp(F, jmptoend);
         else if(F->fn->gotret) { // 'stm' was 'returnstm' and conditional is true
             // @TODO: Implement optimizations
         }
         patchbreaklist(F);
     } else restorecontext(F, &C);
+    if(numeric) {
+        Array_Int_free(&continues, NULL);
+        F->cflow.continues = ocontinues;
+    }
+    endscope(F);
     endscope(F);
     endloop(F, lstart, ldepth);
     endbreaklist(F);
@@ -1937,7 +2182,8 @@ sstatic void continuestm(Function* F)
         ASSERT(S != NULL, "Loop scope not found but cflow offset is set.");
         Int popn = F->locals.len - (S->isgloop * 3) - S->localc + switchcnt(F);
         CODEPOP(F, popn);
-        codeloop(F, F->cflow.innerlstart);
+        if(S->isfloop) Array_Int_push(F->cflow.continues, CODEJMP(F, OP_JMP));
+        else codeloop(F, F->cflow.innerlstart);
     }
 }
 
@@ -1964,6 +2210,20 @@ sstatic void breakstm(Function* F)
     Array_Int_push(last, CODEJMP(F, OP_JMP));
 }
 
+// If the returned expression is a call (or method invocation) that
+// was emitted right before, turn it into its tail call variant.
+// 'OP_RET' is still emitted, it returns the value of the callee
+// that finished in place (native function or class without initializer).
+sstatic void codetailcall(Function* F, Exp* E)
+{
+    if(E->type != EXP_CALL && E->type != EXP_INVOKE) return;
+    Inst* code = CHUNK(F)->code.data;
+    Int   pc   = E->ins.code;
+    Int   len  = (Int)codeoffset(F) - pc;
+    if(len == 2 && GET_OP(code[pc]) == OP_CALL) SET_OP(code[pc], OP_TAILCALL);
+    else if(len == 4 && GET_OP(code[pc]) == OP_INVOKE) SET_OP(code[pc], OP_TAILINVOKE);
+}
+
 /// return ::= 'return' ';'
 ///          | 'return' explist ';'
 sstatic void returnstm(Function* F)
@@ -1976,21 +2236,22 @@ sstatic void returnstm(Function* F)
     bool         gotret = F->fn->gotret;
     FunctionType type   = F->fn_type;
     savecontext(F, &C);
-    CODE(F, OP_RETSTART);
-    if(match(F, TOK_SEMICOLON)) coderet(F, true, gotret);
+    if(match(F, TOK_SEMICOLON)) coderet(F, gotret);
     else {
         if(type == FN_INIT) RETURN_INIT_ERR(F, static_str[SS_INIT].name);
         Exp E;
         E.ins.set = false;
-        explist(F, BYTECODE_MAX, &E);
+        UInt retcnt = explist(F, BYTECODE_MAX, &E);
         expect(F, TOK_SEMICOLON, "Expect ';' after return statement value/s.");
         if(gotret) {
             F->fn->gotret = 1;
             restorecontext(F, &C);
         } else {
-            if(ethasmulret(E.type)) setmulret(F, &E);
-            if(type == FN_SCRIPT) CODE(F, OP_TOPRET);
-            else CODE(F, OP_RET);
+            bool tail = (retcnt == 1 && type != FN_SCRIPT);
+            retcnt    = varcnt(F, &E, retcnt);
+            if(tail) codetailcall(F, &E);
+            if(type == FN_SCRIPT) CODERET(F, OP_TOPRET, retcnt);
+            else CODERET(F, OP_RET, retcnt);
         }
     }
 }
@@ -1998,6 +2259,19 @@ sstatic void returnstm(Function* F)
 
 /// dot ::= '.' name
 ///       | '.' name call
+// Emit property getter, if the receiver is a local variable loaded
+// right before, fuse both into 'OP_GET_LOCAL_PROPERTY'.
+sstatic Int codegetproperty(Function* F, Exp* E, UInt idx)
+{
+    if(E->type != EXP_LOCAL || E->ins.code + 1 != (Int)codeoffset(F))
+        return CODECACHED(F, OP_GET_PROPERTY, idx);
+    CODE_POP(F, 1); // remove 'OP_GET_LOCAL'
+    Int start = CODEOP(F, OP_GET_LOCAL_PROPERTY, E->value);
+    CODEL(F, idx);
+    CODECACHE(F);
+    return start;
+}
+
 sstatic void dot(Function* F, Exp* E)
 {
     expect(F, TOK_IDENTIFIER, "Expect property name after '.'.");
@@ -2005,9 +2279,9 @@ sstatic void dot(Function* F, Exp* E)
     UInt  idx        = make_constant(F, identifier);
     if(match(F, TOK_LPAREN)) codeinvoke(F, E, idx);
     else {
+        if(!E->ins.set) E->ins.code = codegetproperty(F, E, idx);
         E->type  = EXP_INDEXED;
         E->value = idx;
-        if(!E->ins.set) E->ins.code = CODEOP(F, OP_GET_PROPERTY, idx);
     }
 }
 
@@ -2037,10 +2311,16 @@ sstatic force_inline void indexed(Function* F, Exp* E)
     expr(F, &E2);
     expect(F, TOK_RBRACK, "Expect ']'.");
     if(match(F, TOK_LPAREN)) {
+        if(E2.type == EXP_STRING && E2.ins.code + 1 == (Int)codeoffset(F)) {
+            CODE_POP(F, 1); // constant key, invoke the method by name
+            codeinvoke(F, E, E2.value);
+            return;
+        }
         if(etisconst(E2.type)) CALL_CONST_ERR(F);
-        call(F, E);
+        UInt argc   = call(F, E);
         E->type     = EXP_INVOKE_INDEX;
         E->ins.code = CODEOP(F, OP_INVOKE_INDEX, 1);
+        CODEL(F, argc);
     } else {
         E->type  = EXP_INDEXED;
         E->value = NO_VAL;
@@ -2085,17 +2365,13 @@ sstatic void _super(Function* F, Exp* E)
     Exp   _; // dummy
     _.ins.set = false;
     codevar(F, syntoken("self"), &_);
-    if(match(F, TOK_LPAREN)) {
-        call(F, E);
-        codevar(F, syntoken("super"), &_);
-        E->ins.code = CODEOP(F, OP_INVOKE_SUPER, idx);
-        CODEL(F, 1);
-        E->type = EXP_INVOKE;
-    } else {
+    if(match(F, TOK_LPAREN)) codeinvokesuper(F, E, idx);
+    else {
         codevar(F, syntoken("super"), &_);
         if(E->ins.set) error(F, "Can't assign to methods from superclass.");
-        E->ins.code = CODEOP(F, OP_GET_SUPER, idx);
+        E->ins.code = CODECACHED(F, OP_GET_SUPER, idx);
         E->type     = EXP_INDEXED; // superclass method
+        E->value    = idx;
     }
 }
 
@@ -2140,7 +2416,7 @@ sstatic void suffixedexp(Function* F, Exp* E)
             case TOK_LPAREN:
                 if(etisconst(E->type)) CALL_CONST_ERR(F);
                 advance(F);
-                codecall(F, E);
+                if(!codecallgetter(F, E)) codecall(F, E);
                 break;
             case TOK_LBRACK:
                 advance(F);
@@ -2202,7 +2478,7 @@ sstatic bool foldunary(Function* F, UnaryOpr opr, Exp* E)
     if(E->type == EXP_NUMBER && opr == OPR_NEGATE) {
         double val = AS_NUMBER(*CONSTANT(F, E));
         if(sisnan(val) || val == 0.0) return false;
-        *CONSTANT(F, E) = NUMBER_VAL(-val);
+        *CONSTANT(F, E) = INTNUM_VAL(-val);
         return true;
     }
     return false;
@@ -2212,7 +2488,7 @@ sstatic bool foldunary(Function* F, UnaryOpr opr, Exp* E)
 sstatic void
 calcnum(Function* F, BinaryOpr opr, const Exp* E1, const Exp* E2, Value* result)
 {
-#define BINOP(op, n1, n2) NUMBER_VAL((n1)op(n2))
+#define BINOP(op, n1, n2) INTNUM_VAL((n1)op(n2))
 
     double n1 = AS_NUMBER(*CONSTANT(F, E1));
     double n2 = AS_NUMBER(*CONSTANT(F, E2));
@@ -2233,7 +2509,7 @@ calcnum(Function* F, BinaryOpr opr, const Exp* E1, const Exp* E2, Value* result)
             *result = BINOP(%, (long int)n1, (long int)n2);
             break;
         case OPR_POW:
-            *result = NUMBER_VAL((spowl(n1, n2)));
+            *result = INTNUM_VAL((spowl(n1, n2)));
             break;
         default:
             unreachable;
@@ -2247,7 +2523,7 @@ sstatic bool validop(Function* F, BinaryOpr opr, const Exp* E1, const Exp* E2)
 {
     double n1 = AS_NUMBER(*CONSTANT(F, E1));
     double n2 = AS_NUMBER(*CONSTANT(F, E2));
-    return !(opr == OPR_MOD && (sfloor(n1) != n1 || sfloor(n2) != n2));
+    return !(opr == OPR_MOD && (sfloor(n1) != n1 || sfloor(n2) != n2 || n2 == 0));
 }
 
 // Try folding binary operation
@@ -2261,7 +2537,7 @@ sstatic bool foldbinary(Function* F, BinaryOpr opr, Exp* E1, const Exp* E2)
     if(sisnan(AS_NUMBER(result))) return false;
     CONSTANT_POP(F); // Pop constant (E2)
     *CONSTANT(F, E1) = result; // Set new constant value (E1)
-    LINSTRUCTION_POP(F); // Pop off the last OP_CONST instruction
+    CODE_POP(F, 1); // Pop off the last OP_CONST instruction
     return true;
 }
 
@@ -2270,18 +2546,18 @@ sstatic void codeand(Function* F, Exp* E)
 {
     switch(E->type) {
         case EXP_TRUE:
-            INSTRUCTION_POP(F);
+            CODE_POP(F, 1);
             goto fin;
         case EXP_STRING:
         case EXP_NUMBER:
-            LINSTRUCTION_POP(F);
+            CODE_POP(F, 1);
             CONSTANT_POP(F);
         fin:
             E->jmp.f = NO_JMP;
             break;
         default:
             E->jmp.f    = CODEJMP(F, OP_JMP_IF_FALSE_OR_POP);
-            E->ins.code = codeoffset(F) - 4; // Index of jump instruction
+            E->ins.code = E->jmp.f; // Index of jump instruction
             break;
     }
     E->jmp.t = NO_JMP;
@@ -2294,7 +2570,7 @@ sstatic void codeor(Function* F, Exp* E)
     switch(E->type) {
         case EXP_NIL:
         case EXP_FALSE:
-            INSTRUCTION_POP(F);
+            CODE_POP(F, 1);
             E->jmp.t = NO_JMP;
             break;
         case EXP_STRING:
@@ -2313,10 +2589,50 @@ sstatic void codeor(Function* F, Exp* E)
     E->jmp.t = EXP_JMP;
 }
 
+// Length of the instruction that loaded 'E' if it can be
+// converted into RK operand, otherwise 0.
+sstatic Int rklen(const Exp* E)
+{
+    switch(E->type) {
+        case EXP_LOCAL:
+        case EXP_STRING:
+        case EXP_NUMBER:
+            return (E->value <= RK_MAX) ? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+// Get RK operand of 'E' (see 'rklen')
+#define exprk(E) (((E)->type == EXP_LOCAL) ? (E)->value : RKCONST((E)->value))
+
+// Try replacing the two operand loads and the binary instruction
+// with a single register instruction.
+// Example: OP_GET_LOCAL (1), OP_CONST (0), OP_ADD => OP_ADDRK 0 1 K(0)
+sstatic bool coderk(Function* F, BinaryOpr opr, Exp* E1, const Exp* E2)
+{
+    Int op   = binopr2rkop(opr);
+    Int len1 = rklen(E1);
+    Int len2 = rklen(E2);
+    if(op == -1 || len1 == 0 || len2 == 0 || E1->ins.code + len1 != E2->ins.code ||
+       E2->ins.code + len2 != (Int)codeoffset(F))
+        return false;
+    Byte b             = exprk(E1);
+    Byte c             = exprk(E2);
+    CHUNK(F)->code.len = E1->ins.code; // remove both loads
+    E1->ins.code = Chunk_write(CHUNK(F), MAKE_ABC(op, 0, b, c), PREVT(F).line); // A (push)
+    return true;
+}
+
 // Emit binary instruction
 sstatic void postfix(Function* F, BinaryOpr opr, Exp* E1, Exp* E2)
 {
     if(FOLDABLE(opr) && foldbinary(F, opr, E1, E2)) return;
+    if(coderk(F, opr, E1, E2)) {
+        E1->type      = EXP_EXPR;
+        E1->ins.binop = true;
+        return;
+    }
     switch(opr) {
         case OPR_ADD:
         case OPR_SUB:
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -140,22 +141,79 @@ static_assert(
 #endif
 
 /**
- * Max stack size in bytes, default set to 524 KiB.
+ * Initial stack size in bytes, default set to 4 KiB.
+ * Stack grows on demand up to 'S_STACK_MAX'.
  **/
-#define S_STACK_MAX (1 << 19)
+#define S_STACK_INIT (1 << 12)
 
 /**
- * Max temporary values VM can hold when
- * returning from a function.
+ * Max stack size in bytes, default set to 128 MiB.
  **/
-#define S_TEMP_MAX 0xffffff
+#define S_STACK_MAX (1 << 27)
+
+/**
+ * Initial count of function call frames.
+ * Frames grow on demand up to 'S_CALLFRAMES_MAX'.
+ **/
+#define S_CALLFRAMES_INIT 16
 
 /**
  * Max function call frames.
  * This grows each time user calls a
  * callable value.
  **/
-#define S_CALLFRAMES_MAX 256
+#define S_CALLFRAMES_MAX (1 << 20)
+
+/**
+ * Max fields an instance can have before it stops sharing
+ * shapes and falls back to its own fields table (dictionary mode).
+ **/
+#define S_SHAPE_SLOTS_MAX 64
+
+/**
+ * Baseline JIT compiler, translates bytecode of hot functions
+ * into x86-64 machine code, supported only on x86-64 Linux.
+ * Compiler is opt-in, enabled with 'Config' 'jit' field.
+ **/
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+    #define S_JIT
+#endif
+
+/**
+ * Execution tiers, hot functions move from the bytecode emitted
+ * by the compiler to optimized bytecode and then (if JIT is enabled)
+ * to machine code. Defaults below are tunable through 'Config',
+ * zero disables the tier-up.
+ **/
+
+/**
+ * Number of calls after which the function bytecode gets optimized.
+ **/
+#define S_OPT_HOTCALLS 2
+
+/**
+ * Number of calls after which the function gets compiled by the JIT.
+ **/
+#define S_JIT_HOTCALLS 8
+
+/**
+ * Number of iterations after which the loop gets hot, the function
+ * running it tiers up in place (on-stack replacement) and the JIT
+ * records a trace of the loop body and compiles it.
+ **/
+#define S_HOTLOOP 56
+
+/**
+ * Max instructions in a recorded trace, longer traces are aborted.
+ **/
+#define S_JIT_TRACE_MAX 512
+
+/**
+ * Failed trace recordings of a loop after which the loop is no
+ * longer traced, each failure doubles the iterations until the
+ * next recording.
+ **/
+#define S_JIT_TRACE_ABORTS 4
 
 /**
  * Allow NaN boxing of values.
@@ -167,6 +225,50 @@ static_assert(
  **/
 #define GC_HEAP_GROW_FACTOR 2
 
+/**
+ * Count executed opcode pairs and dump them to stderr
+ * when VM is freed, see 'bench/oppairs.sh'.
+ **/
+// #define S_OPCODE_PAIRS
+
+/**
+ * Keep the stack pointer of the interpreter loop in a register
+ * instead of going through 'vm->sp' on every push and pop,
+ * it is written back only around calls, allocations and errors.
+ * Only the pointer is cached, the top of stack value stays in memory
+ * because locals and RK operands access the same slots via 'frame->sp'.
+ **/
+// #define S_STACK_CACHE
+
+/**
+ * Interpreter built out of separate opcode handler functions that
+ * dispatch with tail calls instead of one loop, enabled with the CMake
+ * option 'SKOOMA_TAILCALL'. Tail calls must be guaranteed, either by
+ * 'musttail' (clang, GCC 15) or by a build that CMake configured with
+ * '-foptimize-sibling-calls' and without sanitizers ('S_SIBCALLS'),
+ * otherwise every dispatch grows the C stack.
+ * Keeps the stack pointer in a register ('S_STACK_CACHE').
+ **/
+// #define S_TAILCALL
+
+#ifdef S_TAILCALL
+    #if defined(__has_attribute)
+        #if __has_attribute(musttail)
+            #define S_MUSTTAIL __attribute__((musttail))
+        #endif
+    #endif
+    #ifndef S_MUSTTAIL
+        #if defined(S_SIBCALLS) && defined(__OPTIMIZE__) && !defined(__SANITIZE_ADDRESS__)
+            #define S_MUSTTAIL
+        #else
+            #error "'S_TAILCALL' requires 'musttail' or 'S_SIBCALLS' (see CMake option 'SKOOMA_TAILCALL')."
+        #endif
+    #endif
+    #ifndef S_STACK_CACHE
+        #define S_STACK_CACHE
+    #endif
+#endif
+
 
 
 /* For debug builds comment out 'defines' you dont want. */
@@ -190,6 +292,9 @@ static_assert(
     /* Dump stack of local variables on compile error */
     #define DEBUG_LOCAL_STACK
 
+    /* Count inline cache hits/misses (shown when disassembling) */
+    #define DEBUG_IC_STATS
+
 #endif
 
 
@@ -254,6 +359,10 @@ typedef struct {
     size_t         gc_init_heap_size; // Initial heap allocation
     size_t         gc_min_heap_size; // Minimum size of heap after recalculation
     double         gc_grow_factor; // Heap grow factor
+    bool           jit; // Compile hot functions into machine code (if supported)
+    uint32_t       opt_hotcalls; // Calls until the function bytecode is optimized
+    uint32_t       jit_hotcalls; // Calls until the function is compiled by the JIT
+    uint32_t       hotloop; // Loop iterations until the running function tiers up
 } Config;
 
 void Config_init(Config* config);
@@ -18,6 +18,7 @@
 #define sfabsf(x)         fabsf(x)
 #define sfabsl(x)         fabsfl(x)
 #define smod(x, y)        mod(x, y)
+#define sfmod(x, y)       fmod(x, y)
 #define smodf(x, y)       modf(x, y)
 #define smodl(x, y)       modl(x, y)
 #define sremainder(x, y)  remainder(x, y)
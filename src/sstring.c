@@ -41,7 +41,7 @@ snative(strlen)
         argv[-1] = OBJ_VAL(ERR_NEW(vm, STRLEN_FIRST_ARG_TYPE_ERR));
         return false;
     }
-    argv[-1] = NUMBER_VAL(AS_STRING(string)->len);
+    argv[-1] = INTNUM_VAL(AS_STRING(string)->len);
     return true;
 }
 
@@ -73,7 +73,7 @@ fin:;
     OString* haystack = AS_STRING(string);
     OString* needle   = AS_STRING(pattern);
     char*      start    = strstr(haystack->storage, needle->storage);
-    argv[-1]            = start == NULL ? NIL_VAL : NUMBER_VAL(start - haystack->storage);
+    argv[-1]            = start == NULL ? NIL_VAL : INTNUM_VAL(start - haystack->storage);
     return true;
 }
 
@@ -164,7 +164,7 @@ fin:;
     if(idx < 0 || idx > slen - 1) { // Index out of range
         argv[-1] = NIL_VAL;
     } else {
-        argv[-1] = NUMBER_VAL(string->storage[idx]);
+        argv[-1] = INT_VAL(string->storage[idx]);
     }
     return true;
 }
@@ -283,6 +283,6 @@ snative(byte)
         argv[-1] = OBJ_VAL(ERR_NEW(vm, BYTE_ARG_ERR));
         return false;
     }
-    argv[-1] = NUMBER_VAL(AS_STRING(string)->storage[0]);
+    argv[-1] = INT_VAL(AS_STRING(string)->storage[0]);
     return true;
 }
@@ -200,10 +200,12 @@ Hash vhash(Value value)
 #ifdef S_NAN_BOX
     if(IS_BOOL(value)) return AS_BOOL(value) ? 1 : 0;
     else if(IS_OBJ(value)) return ohash(value);
-    else if(IS_NUMBER(value)) {
+    else if(IS_INT(value)) return (uint32_t)AS_INT(value);
+    else if(IS_NUMBER(value)) { // integral doubles hash the same as integers
         double num = AS_NUMBER(value);
-        if(floor(num) != num || num < 0) return dblhash(num);
-        else return num;
+        if(num >= INT32_MIN && num <= INT32_MAX && (int32_t)num == num)
+            return (uint32_t)(int32_t)num;
+        else return dblhash(num);
     }
 #else
     #ifdef S_PRECOMPUTED_GOTO
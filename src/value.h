@@ -12,7 +12,10 @@ typedef struct OClosure     OClosure;
 typedef struct OUpvalue     OUpvalue;
 typedef struct OClass       OClass;
 typedef struct OInstance    OInstance;
+typedef struct OShape       OShape;
 typedef struct OBoundMethod OBoundMethod;
+typedef struct JitCode      JitCode;
+typedef struct Trace        Trace;
 
 #ifdef S_NAN_BOX
 
@@ -25,12 +28,20 @@ typedef struct OBoundMethod OBoundMethod;
 // bit  51                -> QNaN Floating-Point Indefinite bit
 //                           (Intel Manual Volume 1: Chapter 4, 4-3 Table),
 // bit  52                -> Quiet NaN bit,
-// bits 53..62            -> NaN bits (exponent).
+// bits 53..62            -> NaN bits (exponent),
+// bit  63                -> sign bit, set only for integers.
+//
+// Integers are numbers too, 32-bit integer is stored in bits 0..31
+// (bits 32..49 are 0). Integer arithmetic stays integer unless it
+// overflows, then the result is a 'double'.
 typedef uint64_t Value;
 
     // NAN 'box' mask
     #define QNAN 0x7ffc000000000000
 
+    // Integer 'box' mask
+    #define INT_TAG 0xfffc000000000000
+
     // Value type tags
     #define NIL_TAG    0x01
     #define FALSE_TAG  0x02
@@ -40,10 +51,14 @@ typedef uint64_t Value;
 
     #define AS_OBJ(val)        ((O*)((uintptr_t)((val) & 0x0000fffffffffff8)))
     #define AS_BOOL(val)       ((bool)((val) == TRUE_VAL))
-    #define AS_NUMBER(val)     (vton(val))
+    #define AS_NUMBER(val)     (vtonum(val))
+    #define AS_DOUBLE(val)     (vton(val))
     #define AS_NUMBER_REF(val) *(val)
+    #define AS_INT(val)        ((int32_t)(uint32_t)(val))
 
     #define NUMBER_VAL(num) (ntov(num))
+    #define INT_VAL(i)      ((Value)(INT_TAG | (uint32_t)(i)))
+    #define INTNUM_VAL(num) (ntoint(num))
     #define OBJ_VAL(ptr)                                                        \
         ((Value)((((uint64_t)(ptr)) & 0x0000fffffffffff8) | (OBJECT_TAG | QNAN)))
     #define BOOL_VAL(boolean) ((Value)((FALSE_TAG | ((boolean) & 0x01)) | QNAN))
@@ -53,9 +68,12 @@ typedef uint64_t Value;
     #define EMPTY_VAL         ((Value)(QNAN | EMPTY_TAG))
     #define UNDEFINED_VAL     EMPTY_VAL
 
-    #define IS_NUMBER(val)    (((val) & QNAN) != QNAN)
+    #define IS_DOUBLE(val)    (((val) & QNAN) != QNAN)
+    #define IS_INT(val)       (((val) >> 32) == (INT_TAG >> 32))
+    #define IS_NUMBER(val)    (IS_DOUBLE(val) || IS_INT(val))
+    #define IS_INTS(a, b)     (((((a) ^ INT_TAG) | ((b) ^ INT_TAG)) >> 32) == 0)
     #define IS_NIL(val)       ((val) == NIL_VAL)
-    #define IS_OBJ(val)       (((val) & (OBJECT_TAG | QNAN)) == (OBJECT_TAG | QNAN))
+    #define IS_OBJ(val)       (((val) & (INT_TAG | OBJECT_TAG)) == (OBJECT_TAG | QNAN))
     #define IS_BOOL(val)      (((val) | 0x01) == TRUE_VAL)
     #define IS_EMPTY(val)     ((val) == EMPTY_VAL)
     #define IS_UNDEFINED(val) IS_EMPTY(val)
@@ -83,8 +101,23 @@ static inline double vton(Value val)
     return bitcast.n;
 }
 
+static force_inline double vtonum(Value val)
+{
+    return (IS_INT(val) ? (double)AS_INT(val) : vton(val));
+}
+
+/* Integer if 'n' is integral and fits (except -0), 'double' otherwise */
+static force_inline Value ntoint(double n)
+{
+    if(n >= INT32_MIN && n <= INT32_MAX && (double)(int32_t)n == n &&
+       (n != 0 || ntov(n) == 0))
+        return INT_VAL((int32_t)n);
+    return NUMBER_VAL(n);
+}
+
 static force_inline bool veq(Value a, Value b)
 {
+    if(IS_INT(a) && IS_INT(b)) return a == b;
     if(IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
     return a == b;
 }
@@ -104,10 +137,14 @@ typedef enum {
     #define AS_BOOL(value)       ((value).as.boolean)
     #define AS_NUMBER(value)     ((value).as.number)
     #define AS_NUMBER_REF(value) ((value)->as.number)
+    #define AS_DOUBLE(value)     AS_NUMBER(value)
 
     #define IS_OBJ(value)     ((value).type == VAL_OBJ)
     #define IS_BOOL(value)    ((value).type == VAL_BOOL)
     #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+    #define IS_DOUBLE(value)  IS_NUMBER(value)
+    #define IS_INT(value)     false
+    #define IS_INTS(a, b)     false
     #define IS_NIL(value)     ((value).type == VAL_NIL)
     #define IS_EMPTY(value)   ((value).type == VAL_EMPTY)
     #define IS_UNDEFINED(val) IS_EMPTY(val)
@@ -115,6 +152,9 @@ typedef enum {
     #define OBJ_VAL(value)    ((Value){.type = VAL_OBJ, {.object = (O*)value}})
     #define BOOL_VAL(value)   ((Value){.type = VAL_BOOL, {.boolean = value}})
     #define NUMBER_VAL(value) ((Value){.type = VAL_NUMBER, {.number = value}})
+    #define INT_VAL(value)    NUMBER_VAL((double)(value))
+    #define INTNUM_VAL(value) NUMBER_VAL(value)
+    #define AS_INT(value)     ((int32_t)AS_NUMBER(value))
     #define EMPTY_VAL         ((Value){.type = VAL_EMPTY, {0}})
     #define NIL_VAL           ((Value){.type = VAL_NIL, {0}})
     #define UNDEFINED_VAL     EMPTY_VAL
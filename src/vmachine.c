@@ -5,6 +5,7 @@
 #include "debug.h"
 #include "err.h"
 #include "hash.h"
+#include "jit.h"
 #include "mem.h"
 #include "object.h"
 #include "parser.h"
@@ -24,6 +25,7 @@
 #define stackpeek(top)  ((vm)->sp - ((top) + 1))
 #define stack_reset(vm) (vm)->sp = (vm)->stack
 #define stack_size(vm)  ((vm)->sp - (vm)->stack)
+#define stackfits(vm, n) ((n) <= (vm)->stackcap - stack_size(vm))
 
 
 
@@ -33,6 +35,27 @@
 volatile Int runtime = 0; // VM is running?
 
 
+#ifdef S_OPCODE_PAIRS
+// Executed opcode pairs [previous][current]
+static uint64_t oppairs[OPCODE_N][OPCODE_N];
+static Byte     prevop;
+
+sstatic force_inline void oppair(Byte op)
+{
+    oppairs[prevop][op]++;
+    prevop = op;
+}
+
+// Dump non-zero pairs as 'count previous current' lines
+sstatic void oppairs_dump(void)
+{
+    for(UInt i = 0; i < OPCODE_N; i++)
+        for(UInt j = 0; j < OPCODE_N; j++)
+            if(oppairs[i][j] > 0) fprintf(stderr, "%lu %u %u\n", oppairs[i][j], i, j);
+}
+#endif
+
+
 #define FFN(frame) frame->closure->fn
 
 void runerror(VM* vm, const char* errfmt, ...)
@@ -60,25 +83,110 @@ void runerror(VM* vm, const char* errfmt, ...)
     stack_reset(vm);
 }
 
-void push(VM* vm, Value val)
+sstatic void stackoverflow(VM* vm)
+{
+    fprintf(stderr, "VM stack overflow. Limit [%u].\n", (UInt)VM_STACK_MAX);
+    _cleanupvm(vm);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Stack slots reserved on top of the function 'maxstack' and for
+ * natives, covers the values pushed by 'push' to protect them from
+ * the GC while allocating.
+ */
+#define STACK_EXTRA 8
+
+/*
+ * Values spread by calls and '...' are checked where they are produced,
+ * plus 'SPREAD_EXTRA' slots for the superclass 'super' invoke pushes after.
+ */
+#define SPREAD_EXTRA 1
+
+/*
+ * Grow the stack to fit at least 'n' more values, returns false if
+ * that would exceed 'VM_STACK_MAX'. Stack is moved so all pointers
+ * into it (frames, open upvalues) are relocated, callers must not
+ * hold on to any other stack pointer across the call.
+ */
+sstatic bool growstack(VM* vm, Int n)
 {
-    if(likely(vm->sp - vm->stack < (UInt)VM_STACK_MAX)) *vm->sp++ = val;
-    else {
-        fprintf(stderr, "VM stack overflow. Limit [%u].\n", (UInt)VM_STACK_MAX);
-        _cleanupvm(vm);
-        exit(EXIT_FAILURE);
+    Int size = stack_size(vm);
+    if(n > VM_STACK_MAX - size) return false;
+    Int cap = vm->stackcap;
+    while(cap - size < n)
+        cap *= 2;
+    cap          = MIN(cap, VM_STACK_MAX);
+    Value* stack = MALLOC(vm, cap * sizeof(Value));
+    if(unlikely(stack == NULL)) return false;
+    OUpvalue** upvals = REALLOC(vm, vm->upvals, cap * sizeof(OUpvalue*));
+    if(unlikely(upvals == NULL)) {
+        FREE(vm, stack);
+        return false;
     }
+    memset(upvals + vm->stackcap, 0, (cap - vm->stackcap) * sizeof(OUpvalue*));
+    memcpy(stack, vm->stack, size * sizeof(Value));
+    for(Int i = 0; i < vm->fc; i++)
+        vm->frames[i].sp = stack + (vm->frames[i].sp - vm->stack);
+    Int top = vm->upvaltop - vm->stack;
+    for(Int i = 0; i < top; i++)
+        if(upvals[i] != NULL) upvals[i]->location = stack + i;
+    FREE(vm, vm->stack);
+    vm->stack    = stack;
+    vm->sp       = stack + size;
+    vm->stackcap = cap;
+    vm->upvals   = upvals;
+    vm->upvaltop = stack + top;
+    return true;
 }
 
-force_inline Value pop(VM* vm)
+/* Grow the call frames array, returns false if it is at 'VM_FRAMES_MAX'. */
+sstatic bool growframes(VM* vm)
 {
-    return *--vm->sp;
+    if(vm->fcap == VM_FRAMES_MAX) return false;
+    Int        cap    = MIN(vm->fcap * 2, VM_FRAMES_MAX);
+    CallFrame* frames = REALLOC(vm, vm->frames, cap * sizeof(CallFrame));
+    if(unlikely(frames == NULL)) return false;
+    vm->frames = frames;
+    vm->fcap   = cap;
+    return true;
+}
+
+/* Shrink stack and frames back to initial size, VM must be idle. */
+sstatic void shrinkstacks(VM* vm)
+{
+    ASSERT(vm->fc == 0 && vm->sp == vm->stack, "VM is not idle.");
+    if(vm->stackcap > VM_STACK_INIT) {
+        Value* stack = REALLOC(vm, vm->stack, VM_STACK_INIT * sizeof(Value));
+        if(stack != NULL) {
+            vm->stack    = stack;
+            vm->stackcap = VM_STACK_INIT;
+            // all upvalues are closed, on failure keep the larger map
+            OUpvalue** upvals =
+                REALLOC(vm, vm->upvals, VM_STACK_INIT * sizeof(OUpvalue*));
+            if(upvals != NULL) vm->upvals = upvals;
+        }
+        vm->upvaltop = vm->stack;
+        stack_reset(vm);
+    }
+    if(vm->fcap > VM_FRAMES_INIT) {
+        CallFrame* frames = REALLOC(vm, vm->frames, VM_FRAMES_INIT * sizeof(CallFrame));
+        if(frames != NULL) {
+            vm->frames = frames;
+            vm->fcap   = VM_FRAMES_INIT;
+        }
+    }
+}
+
+void push(VM* vm, Value val)
+{
+    if(unlikely(!stackfits(vm, 1)) && !growstack(vm, 1)) stackoverflow(vm);
+    *vm->sp++ = val;
 }
 
-sstatic force_inline void pushn(VM* vm, Int n, Value val)
+force_inline Value pop(VM* vm)
 {
-    while(n-- > 0)
-        push(vm, val);
+    return *--vm->sp;
 }
 
 sstatic force_inline void popn(VM* vm, UInt n)
@@ -86,6 +194,20 @@ sstatic force_inline void popn(VM* vm, UInt n)
     vm->sp -= n;
 }
 
+/* Integer power 'b^e', false if 'e' is negative or the result overflows */
+sstatic force_inline bool ipow(int32_t b, int32_t e, int32_t* r)
+{
+    int32_t acc = 1;
+    if(e < 0) return false;
+    while(e > 0) {
+        if((e & 1) && __builtin_mul_overflow(acc, b, &acc)) return false;
+        e >>= 1;
+        if(e > 0 && __builtin_mul_overflow(b, b, &b)) return false;
+    }
+    *r = acc;
+    return true;
+}
+
 sstatic force_inline Byte concat_bool(bool boolean, char** dest)
 {
     if(boolean) {
@@ -119,15 +241,108 @@ sstatic OString* concatenate(VM* vm, Value a, Value b)
 sstatic force_inline OBoundMethod*
 bindmethod(VM* vm, OClass* oclass, Value name, Value receiver)
 {
-    Value method;
-    if(unlikely(!HashTable_get(&oclass->methods, name, &method))) {
+    OClosure* method;
+    if(unlikely(!OClass_get(oclass, name, &method))) {
         UNDEFINED_PROPERTY_ERR(vm, AS_CSTRING(name), oclass->name->storage);
         return NULL;
     }
-    OBoundMethod* bound_method = OBoundMethod_new(vm, receiver, AS_CLOSURE(method));
+    OBoundMethod* bound_method = OBoundMethod_new(vm, receiver, method);
     return bound_method;
 }
 
+
+#ifdef DEBUG_IC_STATS
+    #define IC_HIT(cache)  ((cache)->hits++)
+    #define IC_MISS(cache) ((cache)->misses++)
+#else
+    #define IC_HIT(cache)
+    #define IC_MISS(cache)
+#endif
+
+/* Find inline cache entry for receiver 'shape', NULL on cache miss. */
+sstatic force_inline ICEntry* IC_find(InlineCache* cache, OShape* shape)
+{
+    for(UInt i = 0; i < cache->len; i++) {
+        if(cache->entries[i].shape == shape) {
+            IC_HIT(cache);
+            return &cache->entries[i];
+        }
+    }
+    IC_MISS(cache);
+    return NULL;
+}
+
+/* Get free inline cache entry for 'shape' or NULL if cache is megamorphic. */
+sstatic force_inline ICEntry* IC_new(InlineCache* cache, OShape* shape)
+{
+    if(unlikely(shape == NULL || cache->megamorphic)) return NULL;
+    if(unlikely(cache->len == IC_ENTRIES)) {
+        cache->megamorphic = 1;
+        cache->len         = 0;
+        return NULL;
+    }
+    ICEntry* entry = &cache->entries[cache->len++];
+    entry->shape   = shape;
+    entry->next    = NULL;
+    entry->method  = NULL;
+    entry->slot    = 0;
+    return entry;
+}
+
+/*
+ * Cache field 'name' access for receivers of 'shape',
+ * 'next' is the receiver shape after the access
+ * (differs from 'shape' only if the field was added).
+ */
+sstatic force_inline void
+IC_addfield(InlineCache* cache, OShape* shape, OShape* next, Value name)
+{
+    Value slot;
+    if(next == NULL || !HashTable_get(&next->slots, name, &slot)) return;
+    ICEntry* entry = IC_new(cache, shape);
+    if(entry == NULL) return;
+    entry->slot = (UInt)AS_NUMBER(slot);
+    if(next != shape) entry->next = next;
+}
+
+/* Cache method for receivers of 'shape'. */
+sstatic force_inline void
+IC_addmethod(InlineCache* cache, OShape* shape, OClosure* method)
+{
+    ICEntry* entry = IC_new(cache, shape);
+    if(entry != NULL) entry->method = method;
+}
+
+#ifdef S_JIT
+/* Field getter of compiled code, succeeds only on inline cache field hit. */
+bool jit_getproperty(Value* sp, InlineCache* cache)
+{
+    Value receiver = sp[-1];
+    if(unlikely(!IS_INSTANCE(receiver))) return false;
+    OInstance* instance = AS_INSTANCE(receiver);
+    ICEntry*   entry    = IC_find(cache, instance->shape);
+    if(entry == NULL || entry->method != NULL) return false;
+    sp[-1] = instance->slots[entry->slot];
+    return true;
+}
+
+/* Field setter of compiled code, succeeds only on inline cache hit. */
+bool jit_setproperty(Value* sp, InlineCache* cache)
+{
+    Value receiver = sp[-2];
+    if(unlikely(!IS_INSTANCE(receiver))) return false;
+    OInstance* instance = AS_INSTANCE(receiver);
+    ICEntry*   entry    = IC_find(cache, instance->shape);
+    if(entry == NULL) return false;
+    if(entry->next != NULL) {
+        if(instance->cap < entry->next->len) return false;
+        instance->shape = entry->next;
+    }
+    instance->slots[entry->slot] = sp[-1];
+    return true;
+}
+#endif
+
 sstatic force_inline void
 VM_define_native(VM* vm, const char* name, NativeFn native, UInt arity, bool isva)
 {
@@ -147,6 +362,10 @@ void Config_init(Config* config)
     config->gc_init_heap_size = 10 * (1 << 20); // 10 MiB
     config->gc_min_heap_size  = (1 << 20); // 1 MiB
     config->gc_grow_factor    = GC_HEAP_GROW_FACTOR;
+    config->jit               = false;
+    config->opt_hotcalls      = S_OPT_HOTCALLS;
+    config->jit_hotcalls      = S_JIT_HOTCALLS;
+    config->hotloop           = S_HOTLOOP;
 }
 
 VM* VM_new(Config* config)
@@ -163,10 +382,17 @@ VM* VM_new(Config* config)
         memcpy(&vm->config, config, sizeof(Config));
         vm->config.reallocate = allocate;
     } else Config_init(&vm->config);
+    vm->frames       = MALLOC(vm, VM_FRAMES_INIT * sizeof(CallFrame));
     vm->fc           = 0;
+    vm->fcap         = VM_FRAMES_INIT;
+    vm->stack        = MALLOC(vm, VM_STACK_INIT * sizeof(Value));
+    vm->stackcap     = VM_STACK_INIT;
+    vm->upvals       = MALLOC(vm, VM_STACK_INIT * sizeof(OUpvalue*));
+    vm->upvaltop     = vm->stack;
+    memset(vm->upvals, 0, VM_STACK_INIT * sizeof(OUpvalue*));
+    vm->mulretc      = 0;
     vm->objects      = NULL;
     vm->F            = NULL;
-    vm->open_upvals  = NULL;
     vm->script       = NIL_VAL;
     vm->gc_allocated = 0;
     vm->gc_next      = (1 << 20); // 1 MiB
@@ -176,9 +402,6 @@ VM* VM_new(Config* config)
     HashTable_init(&vm->globids); // Global variable identifiers
     GARRAY_INIT(vm); // Global values array
     GSARRAY_INIT(vm); // Gray stack array (no GC)
-    Array_Value_init(&vm->temp, vm); // Temp values storage (return values)
-    Array_VRef_init(&vm->callstart, vm);
-    Array_VRef_init(&vm->retstart, vm);
     HashTable_init(&vm->strings); // Interned strings table (Weak_refs)
     memset(vm->statics, 0, sizeof(vm->statics));
     for(UInt i = 0; i < SS_SIZE; i++)
@@ -222,9 +445,46 @@ VM* VM_new(Config* config)
     VM_define_native(vm, "error", native_error, 1, false); // GC
     VM_define_native(vm, "typeof", native_typeof, 1, false); // GC
     VM_define_native(vm, "loadscript", native_loadscript, 1, false); // GC
+    VM_define_native(vm, "range", native_range, 2, true); // GC
     return vm;
 }
 
+/*
+ * Move 'fn' up to the 'tier' (skipping the tiers it is already past).
+ * Bytecode is optimized in place keeping the instruction offsets and
+ * compiled code can be entered at any instruction, frames already
+ * running the function continue in the new tier (on-stack replacement).
+ */
+sstatic void tierup(VM* vm, OFunction* fn, Tier tier)
+{
+    if(fn->tier < TIER_OPT) {
+        Chunk_optimize(&fn->chunk);
+        fn->tier = TIER_OPT;
+    }
+#ifdef S_JIT
+    if(tier == TIER_JIT && fn->jit == NULL && vm->config.jit && jit_compile(vm, fn))
+        fn->tier = TIER_JIT;
+#else
+    UNUSED(vm);
+    UNUSED(tier);
+#endif
+}
+
+/*
+ * Loop back-edge got hot, the running function tiers up and the loop
+ * trace is recorded or entered (if JIT is enabled).
+ * Returns the instruction the interpreter continues at.
+ */
+sstatic Inst* hotloop(VM* vm, CallFrame* frame, HotLoop* loop, Inst* ip)
+{
+    tierup(vm, FFN(frame), TIER_JIT);
+#ifdef S_JIT
+    if(vm->config.jit) return jit_loop(vm, frame, loop, ip);
+#endif
+    loop->hotcount = INT32_MAX; // nothing left to tier up
+    return ip;
+}
+
 bool fncall(VM* vm, OClosure* callee, Int argc, Int retcnt)
 {
     OFunction* fn = callee->fn;
@@ -236,10 +496,20 @@ bool fncall(VM* vm, OClosure* callee, Int argc, Int retcnt)
         FN_VA_ARGC_ERR(vm, fn->arity, argc);
         return false;
     }
-    if(unlikely(vm->fc == VM_FRAMES_MAX)) {
+    if(unlikely(vm->fc == vm->fcap) && !growframes(vm)) {
         FRAME_LIMIT_ERR(vm, VM_FRAMES_MAX);
         return false;
     }
+    Int need = fn->maxstack + STACK_EXTRA;
+    if(unlikely(!stackfits(vm, need)) && !growstack(vm, need)) {
+        STACK_LIMIT_ERR(vm, VM_STACK_MAX);
+        return false;
+    }
+    if(unlikely(fn->tier != TIER_JIT)) {
+        UInt calls = ++fn->calls;
+        if(calls == vm->config.opt_hotcalls) tierup(vm, fn, TIER_OPT);
+        if(calls == vm->config.jit_hotcalls) tierup(vm, fn, TIER_JIT);
+    }
     fn->vacnt        = argc - fn->arity;
     CallFrame* frame = &vm->frames[vm->fc++];
     frame->retcnt    = retcnt;
@@ -257,10 +527,23 @@ sstatic force_inline bool nativecall(VM* vm, ONative* native, Int argc, Int retc
     } else if(unlikely(!native->isva && native->arity != argc)) {
         FN_ARGC_ERR(vm, native->arity, argc);
         return false;
-    } else if(likely(native->fn(vm, vm->sp - argc, argc, retcnt))) {
+    }
+    if(unlikely(!stackfits(vm, STACK_EXTRA)) && !growstack(vm, STACK_EXTRA)) {
+        STACK_LIMIT_ERR(vm, VM_STACK_MAX);
+        return false;
+    }
+    Int base = stack_size(vm) - argc; // natives might move the stack
+    if(likely(native->fn(vm, vm->sp - argc, argc, retcnt))) {
+        // Not every native pops its arguments, argument count
+        // is static so leave exactly the result on the stack,
+        // missing results the caller expects are nil.
+        vm->sp = vm->stack + base;
+        for(Int i = 1; i < retcnt; i++)
+            *vm->sp++ = NIL_VAL;
+        vm->mulretc = (retcnt > 1 ? retcnt : 1);
         return true;
     } else {
-        runerror(vm, AS_CSTRING(vm->sp[-argc - 1]));
+        runerror(vm, AS_CSTRING(vm->stack[base - 1]));
         return false;
     }
 }
@@ -274,6 +557,7 @@ sstatic force_inline bool instancecall(VM* vm, OClass* oclass, Int argc)
         FN_ARGC_ERR(vm, 0, argc);
         return false;
     }
+    vm->mulretc = 1;
     return true;
 }
 
@@ -301,15 +585,47 @@ sstatic force_inline bool vcall(VM* vm, Value callee, Int argc, Int retcnt)
     return false;
 }
 
-sstatic force_inline bool
-invokefrom(VM* vm, OClass* oclass, Value methodname, Int argc, Int retcnt)
+/*
+ * Resolve method table slot of 'oclass' (superclass) method, 'super' is
+ * bound once per class declaration so the slot gets resolved on the first
+ * execution, 'cache' is keyed on the class root shape.
+ * Returns -1 if there is no such method.
+ */
+sstatic force_inline Int
+superslot(VM* vm, OClass* oclass, Value methodname, InlineCache* cache)
 {
-    Value method;
-    if(unlikely(!HashTable_get(&oclass->methods, methodname, &method))) {
+    ICEntry* entry = IC_find(cache, oclass->shape);
+    if(likely(entry != NULL)) return entry->slot;
+    Int slot = OClass_slot(oclass, methodname);
+    if(unlikely(slot < 0)) {
         UNDEFINED_PROPERTY_ERR(vm, AS_CSTRING(methodname), oclass->name->storage);
-        return false;
+        return -1;
     }
-    return vcall(vm, method, argc, retcnt);
+    entry = IC_new(cache, oclass->shape);
+    if(entry != NULL) entry->slot = slot;
+    return slot;
+}
+
+/* Invoke method of 'oclass' (superclass). */
+sstatic force_inline bool invokefrom(
+    VM*          vm,
+    OClass*      oclass,
+    Value        methodname,
+    Int          argc,
+    Int          retcnt,
+    InlineCache* cache)
+{
+    Int slot = superslot(vm, oclass, methodname, cache);
+    if(unlikely(slot < 0)) return false;
+    return fncall(vm, oclass->mtable[slot], argc, retcnt);
+}
+
+/* Remove the 'name' of indexed invoke, it sits right below the call arguments. */
+sstatic force_inline void popindexname(VM* vm, Int argc)
+{
+    Value* args = vm->sp - argc + 1; // arguments above the 'name'
+    memmove(args - 1, args, (argc - 1) * sizeof(Value));
+    vm->sp--;
 }
 
 sstatic force_inline bool invokeindex(VM* vm, Value name, Int argc, Int retcnt)
@@ -321,23 +637,30 @@ sstatic force_inline bool invokeindex(VM* vm, Value name, Int argc, Int retcnt)
     }
     OInstance* instance = AS_INSTANCE(receiver);
     Value      value;
-    if(HashTable_get(&instance->fields, name, &value)) {
+    if(OInstance_get(instance, name, &value)) {
         vm->sp[-argc - 1] = value;
-        vm->sp--; // additional argument on stack ('name')
+        popindexname(vm, argc);
         return vcall(vm, value, argc - 1, retcnt);
     }
-    if(unlikely(!HashTable_get(&instance->oclass->methods, name, &value))) {
+    OClosure* method;
+    if(unlikely(!OClass_get(instance->oclass, name, &method))) {
         UNDEFINED_PROPERTY_ERR(
             vm,
             vtostr(vm, name)->storage,
             instance->oclass->name->storage);
         return false;
     }
-    pop(vm); // pop the name
-    return vcall(vm, value, argc - 1, retcnt);
+    popindexname(vm, argc);
+    return fncall(vm, method, argc - 1, retcnt);
 }
 
-sstatic force_inline bool invoke(VM* vm, Value name, Int argc, Int retcnt)
+/*
+ * Invoke method 'name' on the receiver, fields with the same name
+ * shadow the methods. 'cache' is keyed on the receiver shape, shape
+ * determines both the class and the fields of the receiver.
+ */
+sstatic force_inline bool
+invoke(VM* vm, Value name, Int argc, Int retcnt, InlineCache* cache)
 {
     Value receiver = *stackpeek(argc);
     if(unlikely(!IS_INSTANCE(receiver))) {
@@ -345,36 +668,83 @@ sstatic force_inline bool invoke(VM* vm, Value name, Int argc, Int retcnt)
         return false;
     }
     OInstance* instance = AS_INSTANCE(receiver);
+    ICEntry*   entry    = IC_find(cache, instance->shape);
     Value      value;
-    if(HashTable_get(&instance->fields, name, &value)) {
+    if(likely(entry != NULL)) {
+        if(likely(entry->method != NULL))
+            return fncall(vm, entry->method, argc, retcnt);
+        value             = instance->slots[entry->slot];
+        vm->sp[-argc - 1] = value;
+        return vcall(vm, value, argc, retcnt);
+    }
+    if(OInstance_get(instance, name, &value)) {
+        IC_addfield(cache, instance->shape, instance->shape, name);
         vm->sp[-argc - 1] = value;
         return vcall(vm, value, argc, retcnt);
     }
-    return invokefrom(vm, instance->oclass, name, argc, retcnt);
+    OClass*   oclass = instance->oclass;
+    OClosure* method;
+    if(unlikely(!OClass_get(oclass, name, &method))) {
+        UNDEFINED_PROPERTY_ERR(vm, AS_CSTRING(name), oclass->name->storage);
+        return false;
+    }
+    IC_addmethod(cache, instance->shape, method);
+    return fncall(vm, method, argc, retcnt);
 }
 
+/*
+ * Open upvalues are indexed by the stack slot they point to, so finding
+ * the upvalue of a captured variable is a single lookup. Stack slots of
+ * a frame are contiguous, 'upvals' indexed from the frame base is the
+ * slot -> upvalue map of that frame.
+ */
 sstatic force_inline OUpvalue* captureupval(VM* vm, Value* valp)
 {
-    OUpvalue** upvalpp = &vm->open_upvals;
-    while(*upvalpp != NULL && (*upvalpp)->location > valp)
-        upvalpp = &(*upvalpp)->next;
-    if(*upvalpp != NULL && (*upvalpp)->location == valp) return *upvalpp;
+    OUpvalue** upvalpp = &vm->upvals[valp - vm->stack];
+    if(*upvalpp != NULL) return *upvalpp;
     OUpvalue* upvalp = OUpvalue_new(vm, valp);
-    upvalp->next     = *upvalpp;
     *upvalpp         = upvalp;
+    if(vm->upvaltop <= valp) vm->upvaltop = valp + 1;
     return upvalp;
 }
 
+/*
+ * Close open upvalues of stack slots at and above 'last', 'last' is
+ * below the stack when closing the main script frame.
+ */
 sstatic force_inline void closeupval(VM* vm, Value* last)
 {
-    while(vm->open_upvals != NULL && vm->open_upvals->location >= last) {
-        OUpvalue* upvalp     = vm->open_upvals;
-        upvalp->closed.value = *upvalp->location;
-        upvalp->location     = &upvalp->closed.value;
-        vm->open_upvals      = upvalp->next;
+    while(vm->upvaltop > last && vm->upvaltop > vm->stack) {
+        Value*     valp    = --vm->upvaltop;
+        OUpvalue** upvalpp = &vm->upvals[valp - vm->stack];
+        if(*upvalpp != NULL) {
+            OUpvalue* upvalp     = *upvalpp;
+            upvalp->closed.value = *valp;
+            upvalp->location     = &upvalp->closed.value;
+            *upvalpp             = NULL;
+        }
     }
 }
 
+/*
+ * Tail call, frame that was just pushed for the callee replaces the
+ * frame of the caller. Caller upvalues are closed and the callee with
+ * its arguments is moved down into the caller slot, callee inherits
+ * the expected return count of the caller.
+ */
+sstatic force_inline void tailframe(VM* vm)
+{
+    CallFrame* callee = &vm->frames[vm->fc - 1];
+    CallFrame* caller = callee - 1;
+    Int        n      = vm->sp - callee->sp; // callee and its arguments
+    closeupval(vm, caller->sp);
+    memmove(caller->sp, callee->sp, n * sizeof(Value));
+    vm->sp          = caller->sp + n;
+    caller->closure = callee->closure;
+    caller->ip      = callee->ip;
+    vm->fc--;
+}
+
 /* Unescape strings before printing them when ERROR occurs. */
 sstatic OString* unescape(VM* vm, OString* string)
 {
@@ -446,7 +816,7 @@ sstatic force_inline OString* globalname(VM* vm, UInt idx)
     unreachable;
 }
 
-sstatic sdebug void dumpstack(VM* vm, CallFrame* frame, Byte* ip)
+sstatic sdebug void dumpstack(VM* vm, CallFrame* frame, Inst* ip)
 {
     printf("           ");
     for(Value* ptr = vm->stack; ptr < vm->sp; ptr++) {
@@ -458,675 +828,351 @@ sstatic sdebug void dumpstack(VM* vm, CallFrame* frame, Byte* ip)
     Instruction_debug(&FFN(frame)->chunk, (UInt)(ip - FFN(frame)->chunk.code.data));
 }
 
-sstatic InterpretResult run(VM* vm)
+/*
+ * Threaded code instruction at the 'frame' ip, threaded code of the
+ * function is built on its first run and after its bytecode got rewritten.
+ */
+sstatic force_inline TInst* threadip(CallFrame* frame, const void* const* table)
 {
-#define READ_BYTE()     (*ip++)
-#define READ_BYTEL()    (ip += 3, GET_BYTES3(ip - 3))
-#define READ_CONSTANT() FFN(frame)->chunk.constants.data[READ_BYTEL()]
+    Chunk* chunk = &FFN(frame)->chunk;
+    if(unlikely(chunk->tcode.len == 0)) Chunk_thread(chunk, table);
+    return chunk->tcode.data + (frame->ip - chunk->code.data);
+}
+
+/*
+ * 'ip' points into the threaded code ('TInst'), frames and everything
+ * outside of the interpreter loop use the bytecode ip, SAVE_IP and
+ * LOAD_IP convert between the two.
+ * 'ins' is the word of the instruction being executed, READ_EXT reads
+ * the extension words that follow it.
+ */
+#define READ_OP()       (ins = ip->ins, (ip++)->handler)
+#define READ_ARG()      GET_ARG(ins)
+#define READ_EXT()      ((ip++)->ins)
+#define READ_CONSTANT() FFN(frame)->chunk.constants.data[READ_ARG()]
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                                                        \
+#define READ_CACHE()    (&FFN(frame)->chunk.caches.data[READ_EXT()])
+#define READ_LOOP()     (&FFN(frame)->chunk.loops.data[READ_EXT()])
+#define VARCNT(cnt)                                                                      \
+    ({                                                                                   \
+        UInt _cnt = (cnt);                                                               \
+        (Int)(_cnt & VARCNT_BIT ? (_cnt & ~VARCNT_BIT) + vm->mulretc : _cnt);            \
+    })
+#define RK(rk)                                                                           \
+    ({                                                                                   \
+        Byte _rk = (rk);                                                                 \
+        RKISCONST(_rk) ? FFN(frame)->chunk.constants.data[RKINDEX(_rk)] : frame->sp[_rk]; \
+    })
+/*
+ * Stack caching ('S_STACK_CACHE'), the loop works on its own copy 'sp'
+ * of the stack pointer that can stay in a register, 'vm->sp' is
+ * written back only where the VM escapes the loop (calls, allocations
+ * and errors) and reloaded after it. Values are not cached, the top
+ * of stack may be a local that is accessed through 'frame->sp'.
+ * SAVE_IP and LOAD_IP mark such places, they sync the stack pointer too.
+ * PUSH is unchecked, 'fncall' already made sure the frame fits on the stack.
+ */
+#ifdef S_STACK_CACHE
+    #define SP        sp
+    #define SAVE_SP() (vm->sp = sp)
+    #define LOAD_SP() (sp = vm->sp)
+#else
+    #define SP        vm->sp
+    #define SAVE_SP() ((void)0)
+    #define LOAD_SP() ((void)0)
+#endif
+#define PEEK(top) (SP - ((top) + 1))
+#define PUSH(val) (*SP++ = (val))
+#define POP()     (*--SP)
+#define POPN(n)   (SP -= (n))
+#define BCIP(ip)  (FFN(frame)->chunk.code.data + ((ip) - FFN(frame)->chunk.tcode.data))
+#define SAVE_IP() (SAVE_SP(), frame->ip = BCIP(ip))
+#define LOAD_IP() (LOAD_SP(), ip = threadip(frame, OPTABLE))
+/*
+ * Quickening, 'len' is the length (in words) of the instruction that was just read.
+ * QUICKEN patches the instruction in place into its specialized variant
+ * 'op' that the next execution will dispatch to.
+ * UNQUICKEN reverts the instruction into the generic form 'op' when
+ * the specialized type guard fails and re-executes it, 'op' is the
+ * '_ANY' variant that never quickens again, so polymorphic sites
+ * don't keep patching the code.
+ * Both the bytecode and the threaded code are patched.
+ */
+#define PATCH(tip, op)                                                                   \
+    (SET_OP(BCIP(tip)[0], op), SET_OP((tip)->ins, op), (tip)->handler = OPHANDLER(op))
+#define QUICKEN(len, op) PATCH(ip - (len), op)
+#define UNQUICKEN(len, op)                                                               \
+    {                                                                                    \
+        ip -= (len);                                                                     \
+        PATCH(ip, op);                                                                   \
+        BREAK;                                                                           \
+    }
+#define REGISTER_SET(ra, val)                                                            \
+    do {                                                                                 \
+        if((ra) == 0) PUSH(val);                                                         \
+        else frame->sp[ra] = val;                                                        \
+    } while(false)
+/*
+ * Number arithmetic on values 'a' and 'b', result is stored with 'set'
+ * and 'fail' runs if operands are not numbers. Integers stay integers
+ * unless the result 'overflow's 32 bits, doubles skip the conversions.
+ */
+#define NUM_ARITH(set, a, b, op, overflow, fail)                                         \
+    do {                                                                                 \
+        int32_t _r;                                                                      \
+        if(IS_INTS(a, b) && !overflow(AS_INT(a), AS_INT(b), &_r)) set(INT_VAL(_r));      \
+        else if(IS_DOUBLE(a) && IS_DOUBLE(b))                                            \
+            set(NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b)));                               \
+        else if(likely(IS_NUMBER(a) && IS_NUMBER(b)))                                    \
+            set(NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));                               \
+        else {                                                                           \
+            fail;                                                                        \
+        }                                                                                \
+    } while(false)
+#define NUM_CMP(a, b, op)                                                                \
+    (IS_INTS(a, b) ? AS_INT(a) op AS_INT(b) : AS_NUMBER(a) op AS_NUMBER(b))
+/* 'NUM_ARITH' result setters, binary instruction pops and register instruction sets 'ra' */
+#define BINARY_SET(val)   (SP--, *PEEK(0) = (val))
+#define REGISTER_RA(val)  REGISTER_SET(ra, val)
+/* Fused instruction setters, skip the second opcode or store into its local */
+#define FUSED_SET(val)    (ip++, *PEEK(0) = (val))
+#define LOCAL_SET(val)    (SP -= 2, frame->sp[GET_ARG(READ_EXT())] = (val))
+/* String concatenation, pops the operands 'a' and 'b' and stores the result with 'set' */
+#define CONCAT(set, a, b)                                                                \
+    do {                                                                                 \
+        SAVE_SP();                                                                       \
+        OString* _s = concatenate(vm, a, b);                                             \
+        LOAD_SP();                                                                       \
+        set(OBJ_VAL(_s));                                                                \
+    } while(false)
+#define BINARYOP_FAIL(op)                                                                \
+    SAVE_IP();                                                                           \
+    BINARYOP_ERR(vm, op);                                                                \
+    return INTERPRET_RUNTIME_ERROR
+#define REGISTER_ARITH(op, overflow)                                                     \
+    do {                                                                                 \
+        Byte  ra = GET_A(ins);                                                           \
+        Value a  = RK(GET_B(ins));                                                       \
+        Value b  = RK(GET_C(ins));                                                       \
+        NUM_ARITH(REGISTER_RA, a, b, op, overflow, BINARYOP_FAIL(op));                   \
+    } while(false)
+#define REGISTER_OP(op, result)                                                          \
+    do {                                                                                 \
+        Byte  ra = GET_A(ins);                                                           \
+        Value a  = RK(GET_B(ins));                                                       \
+        Value b  = RK(GET_C(ins));                                                       \
+        if(unlikely(!IS_NUMBER(a) || !IS_NUMBER(b))) {                                   \
+            BINARYOP_FAIL(op);                                                           \
+        }                                                                                \
+        REGISTER_SET(ra, result);                                                        \
+    } while(false)
+#define REGISTER_JMP(op)                                                                 \
+    do {                                                                                 \
+        UInt  skip = READ_ARG();                                                         \
+        Inst  ext  = READ_EXT();                                                         \
+        Value a    = RK(GET_B(ext));                                                     \
+        Value b    = RK(GET_C(ext));                                                     \
+        if(unlikely(!IS_NUMBER(a) || !IS_NUMBER(b))) {                                   \
+            BINARYOP_FAIL(op);                                                           \
+        }                                                                                \
+        ip += !NUM_CMP(a, b, op) * skip;                                                 \
+    } while(false)
+#define BINARY_ARITH(op, overflow)                                                       \
+    do {                                                                                 \
+        Value b = *PEEK(0);                                                              \
+        Value a = *PEEK(1);                                                              \
+        NUM_ARITH(BINARY_SET, a, b, op, overflow, BINARYOP_FAIL(op));                    \
+    } while(false)
+#define BINARY_OP(op, result)                                                            \
     do {                                                                                 \
-        if(unlikely(!IS_NUMBER(*stackpeek(0)) || !IS_NUMBER(*stackpeek(1)))) {           \
-            frame->ip = ip;                                                              \
-            BINARYOP_ERR(vm, op);                                                        \
-            return INTERPRET_RUNTIME_ERROR;                                              \
+        Value b = *PEEK(0);                                                              \
+        Value a = *PEEK(1);                                                              \
+        if(unlikely(!IS_NUMBER(a) || !IS_NUMBER(b))) {                                   \
+            BINARYOP_FAIL(op);                                                           \
         }                                                                                \
-        double b = AS_NUMBER(pop(vm));                                                   \
-        double a = AS_NUMBER(pop(vm));                                                   \
-        push(vm, value_type(a op b));                                                    \
+        BINARY_SET(result);                                                              \
     } while(false)
 
-    runtime = 1;
-    // cache these hopefully in a register
-    register CallFrame* frame = &vm->frames[vm->fc - 1];
-    register Byte*      ip    = frame->ip;
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("\n=== VM - execution ===\n");
+#ifdef S_JIT
+    // Continue in compiled code if the function of the frame got compiled,
+    // compiled code that returned continues in the caller (if compiled).
+    #define JIT_ENTER()                                                                  \
+        if(FFN(frame)->jit != NULL) {                                                    \
+            SAVE_IP();                                                                   \
+            while(FFN(frame)->jit != NULL) {                                             \
+                CallFrame* _entered = frame;                                             \
+                Inst*      _ip      = jit_run(vm, frame, frame->ip);                     \
+                frame               = &vm->frames[vm->fc - 1];                           \
+                frame->ip           = _ip;                                               \
+                if(frame == _entered) break;                                             \
+            }                                                                            \
+            LOAD_IP();                                                                   \
+        }
+#else
+    #define JIT_ENTER()
 #endif
-    while(true) {
-#ifdef S_PRECOMPUTED_GOTO
+
+#ifdef S_TAILCALL
+/*
+ * Tail-call threaded interpreter, each opcode handler is a separate
+ * function with the same signature and BREAK tail calls the handler
+ * of the next instruction. The interpreter state ('frame', 'ip', 'sp'
+ * and 'ins') is passed along in the argument registers.
+ */
+typedef InterpretResult (
+    *OpFn)(VM* vm, CallFrame* frame, TInst* ip, Value* sp, Inst ins);
+
+    #define OPFN(op) H_##op
+    #define CASE(op)                                                                     \
+        sstatic InterpretResult OPFN(op)(                                                \
+            VM* vm,                                                                      \
+            CallFrame* frame,                                                            \
+            TInst* ip,                                                                   \
+            Value* sp,                                                                   \
+            Inst ins)
+    #define DISPATCH(x)                                                                  \
+        do {                                                                             \
+            const void* _handler = (x);                                                  \
+            S_MUSTTAIL return ((OpFn)_handler)(vm, frame, ip, sp, ins);                  \
+        } while(false);
+    #define JUMP(op, label) S_MUSTTAIL return OPFN(op)(vm, frame, ip, sp, ins)
+    #define LABEL(label)
+    #define OPTABLE       optable
+    #define OPHANDLER(op) optable[op]
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define BREAK                                                                    \
+            SAVE_SP();                                                                   \
+            dumpstack(vm, frame, BCIP(ip));                                              \
+            DISPATCH(READ_OP())
+    #elif defined(S_OPCODE_PAIRS)
+        #define BREAK                                                                    \
+            oppair(GET_OP(*BCIP(ip)));                                                   \
+            DISPATCH(READ_OP())
+    #else
+        #define BREAK DISPATCH(READ_OP())
+    #endif
+
+static const void* const optable[OPCODE_N];
+
+/* Targets of JUMP */
+CASE(OP_ADD_ANY);
+CASE(OP_ADDRK_ANY);
+CASE(OP_GET_PROPERTY);
+CASE(OP_RET);
+
+    #include "vmops.h"
+
+    #define OP_FNTABLE
+    #include "jmptable.h"
+    #undef OP_FNTABLE
+#endif
+
+sstatic InterpretResult run(VM* vm)
+{
+#if defined(S_TAILCALL)
+    // handlers and dispatch are defined above
+#elif defined(S_PRECOMPUTED_GOTO)
     #define OP_TABLE
     #include "jmptable.h"
     #undef OP_TABLE
+    #undef DISPATCH
+    #define DISPATCH(x)    goto*(x);
+    #define OPTABLE        optable
+    #define OPHANDLER(op)  optable[op]
+    #undef BREAK
     #ifdef DEBUG_TRACE_EXECUTION
-        #undef BREAK
         #define BREAK                                                                    \
-            dumpstack(vm, frame, ip);                                                    \
-            DISPATCH(READ_BYTE())
+            SAVE_SP();                                                                   \
+            dumpstack(vm, frame, BCIP(ip));                                              \
+            DISPATCH(READ_OP())
+    #elif defined(S_OPCODE_PAIRS)
+        #define BREAK                                                                    \
+            oppair(GET_OP(*BCIP(ip)));                                                   \
+            DISPATCH(READ_OP())
+    #else
+        #define BREAK DISPATCH(READ_OP())
     #endif
 #else
-    #define DISPATCH(x) switch(x)
-    #define CASE(label) case label:
+    #define DISPATCH(x)   switch((uintptr_t)(x))
+    #define CASE(label)   case label:
+    #define OPTABLE       NULL
+    #define OPHANDLER(op) ((const void*)(uintptr_t)(op))
     #ifdef DEBUG_TRACE_EXECUTION
         #define BREAK                                                                    \
-            dumpstack(vm, frame, ip);                                                    \
+            SAVE_SP();                                                                   \
+            dumpstack(vm, frame, BCIP(ip));                                              \
+            break
+    #elif defined(S_OPCODE_PAIRS)
+        #define BREAK                                                                    \
+            oppair(GET_OP(*BCIP(ip)));                                                   \
             break
     #else
         #define BREAK break
     #endif
 #endif
-        DISPATCH(READ_BYTE())
+#ifndef S_TAILCALL
+    #define JUMP(op, label) goto label
+    #define LABEL(label)    label:
+#endif
+
+    runtime = 1;
+    // cache these hopefully in a register
+    register CallFrame* frame = &vm->frames[vm->fc - 1];
+    register TInst*     ip    = threadip(frame, OPTABLE);
+    register Inst       ins; // current instruction word
+#ifdef S_STACK_CACHE
+    register Value* sp = vm->sp;
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    printf("\n=== VM - execution ===\n");
+#endif
+#ifdef S_TAILCALL
+    DISPATCH(READ_OP())
+#else
+    while(true) {
+        DISPATCH(READ_OP())
         {
-            CASE(OP_TRUE)
-            {
-                push(vm, BOOL_VAL(true));
-                BREAK;
-            }
-            CASE(OP_FALSE)
-            {
-                push(vm, BOOL_VAL(false));
-                BREAK;
-            }
-            CASE(OP_NIL)
-            {
-                push(vm, NIL_VAL);
-                BREAK;
-            }
-            CASE(OP_NILN)
-            {
-                pushn(vm, READ_BYTEL(), NIL_VAL);
-                BREAK;
-            }
-            CASE(OP_NEG)
-            {
-                Value val = *stackpeek(0);
-                if(unlikely(!IS_NUMBER(val))) {
-                    frame->ip = ip;
-                    UNARYNEG_ERR(vm, vtostr(vm, val)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                AS_NUMBER_REF(vm->sp - 1) = NUMBER_VAL(-AS_NUMBER(val));
-                BREAK;
-            }
-            CASE(OP_ADD)
-            {
-                Value b = *stackpeek(0);
-                Value a = *stackpeek(1);
-                if(IS_NUMBER(b) && IS_NUMBER(a)) {
-                    double b = AS_NUMBER(pop(vm));
-                    double a = AS_NUMBER(pop(vm));
-                    push(vm, NUMBER_VAL((a + b)));
-                } else if(IS_STRING(b) && IS_STRING(a)) {
-                    push(vm, OBJ_VAL(concatenate(vm, a, b)));
-                } else {
-                    frame->ip = ip;
-                    ADD_OPERATOR_ERR(vm, a, b);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                BREAK;
-            }
-            CASE(OP_SUB)
-            {
-                BINARY_OP(NUMBER_VAL, -);
-                BREAK;
-            }
-            CASE(OP_MUL)
-            {
-                BINARY_OP(NUMBER_VAL, *);
-                BREAK;
-            }
-            CASE(OP_MOD)
-            {
-                TODO("Implement OP_MOD");
-                BREAK;
-            }
-            CASE(OP_POW)
-            {
-                TODO("Implement OP_POW");
-                BREAK;
-            }
-            CASE(OP_DIV)
-            {
-                BINARY_OP(NUMBER_VAL, /);
-                BREAK;
-            }
-            CASE(OP_NOT)
-            {
-                *(vm->sp - 1) = BOOL_VAL(ISFALSEY(*stackpeek(0)));
-                BREAK;
-            }
-            CASE(OP_VALIST)
-            {
-                OFunction* fn    = FFN(frame);
-                UInt       vacnt = READ_BYTEL();
-                vacnt            = (vacnt == 0 ? fn->vacnt : vacnt);
-                for(UInt i = 1; i <= vacnt; i++) {
-                    Value* next = frame->sp + fn->arity + i;
-                    push(vm, *next);
-                }
-                BREAK;
-            }
-            CASE(OP_NOT_EQUAL)
-            {
-                Value b = pop(vm);
-                Value a = pop(vm);
-                push(vm, BOOL_VAL(!veq(a, b)));
-                BREAK;
-            }
-            {
-                Value a, b;
-                CASE(OP_EQUAL)
-                {
-                    b = pop(vm);
-                    a = pop(vm);
-                    goto op_equal_fin;
-                }
-                CASE(OP_EQ)
-                {
-                    b = pop(vm);
-                    a = *stackpeek(0);
-                op_equal_fin:
-                    push(vm, BOOL_VAL(veq(a, b)));
-                    BREAK;
-                }
-            }
-            CASE(OP_GREATER)
-            {
-                BINARY_OP(BOOL_VAL, >);
-                BREAK;
-            }
-            CASE(OP_GREATER_EQUAL)
-            {
-                BINARY_OP(BOOL_VAL, >=);
-                BREAK;
-            }
-            CASE(OP_LESS)
-            {
-                BINARY_OP(BOOL_VAL, <);
-                BREAK;
-            }
-            CASE(OP_LESS_EQUAL)
-            {
-                BINARY_OP(BOOL_VAL, <=);
-                BREAK;
-            }
-            CASE(OP_POP)
-            {
-                pop(vm);
-                BREAK;
-            }
-            CASE(OP_POPN)
-            {
-                popn(vm, READ_BYTEL());
-                BREAK;
-            }
-            CASE(OP_CONST)
-            {
-                push(vm, READ_CONSTANT());
-                BREAK;
-            }
-            CASE(OP_CALL)
-            {
-                Int retcnt = READ_BYTEL();
-                Int argc   = vm->sp - Array_VRef_pop(&vm->callstart);
-                frame->ip  = ip;
-                if(unlikely(!vcall(vm, *stackpeek(argc), argc, retcnt)))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm->frames[vm->fc - 1];
-                ip    = frame->ip;
-                BREAK;
-            }
-            CASE(OP_METHOD)
-            {
-                Value   methodname = READ_CONSTANT();
-                Value   method     = *stackpeek(0); // OFunction or OClosure
-                OClass* oclass     = AS_CLASS(*stackpeek(1));
-                HashTable_insert(vm, &oclass->methods, methodname, method);
-                pop(vm); // pop method
-                BREAK;
-            }
-            CASE(OP_INVOKE)
-            {
-                Value methodname = READ_CONSTANT();
-                Int   retcnt     = READ_BYTEL();
-                Int   argc       = vm->sp - Array_VRef_pop(&vm->callstart);
-                frame->ip        = ip;
-                if(unlikely(!invoke(vm, methodname, argc, retcnt)))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm->frames[vm->fc - 1];
-                ip    = frame->ip;
-                BREAK;
-            }
-            CASE(OP_GET_SUPER)
-            {
-                Value   methodname = READ_CONSTANT();
-                OClass* superclass = AS_CLASS(pop(vm));
-                frame->ip          = ip;
-                OBoundMethod* bound =
-                    bindmethod(vm, superclass, methodname, *stackpeek(0));
-                if(unlikely(bound == NULL)) return INTERPRET_RUNTIME_ERROR;
-                vm->sp[-1] = OBJ_VAL(bound);
-                BREAK;
-            }
-            CASE(OP_INVOKE_SUPER)
-            {
-                Value methodname = READ_CONSTANT();
-                ASSERT(IS_CLASS(*stackpeek(0)), "superclass must be class.");
-                OClass* superclass = AS_CLASS(pop(vm));
-                UInt    argc       = vm->sp - Array_VRef_pop(&vm->callstart);
-                Int     retcnt     = READ_BYTEL();
-                frame->ip          = ip;
-                if(unlikely(!invokefrom(vm, superclass, methodname, argc, retcnt)))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm->frames[vm->fc - 1];
-                ip    = frame->ip;
-                BREAK;
-            }
-            CASE(OP_SET_PROPERTY)
-            {
-                Value property_name = READ_CONSTANT();
-                Value receiver      = *stackpeek(1);
-                if(unlikely(!IS_INSTANCE(receiver))) {
-                    frame->ip = ip;
-                    NOT_INSTANCE_ERR(vm, vtostr(vm, receiver)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                HashTable_insert(
-                    vm,
-                    &AS_INSTANCE(receiver)->fields,
-                    property_name,
-                    *stackpeek(0));
-                popn(vm, 2);
-                BREAK;
-            }
-            CASE(OP_GET_PROPERTY)
-            {
-                Value property_name = READ_CONSTANT();
-                Value receiver      = *stackpeek(0);
-                if(unlikely(!IS_INSTANCE(receiver))) {
-                    frame->ip = ip;
-                    NOT_INSTANCE_ERR(vm, vtostr(vm, receiver)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                OInstance* instance = AS_INSTANCE(receiver);
-                Value      property;
-                if(HashTable_get(&instance->fields, property_name, &property)) {
-                    *(vm->sp - 1) = property;
-                    BREAK;
-                }
-                frame->ip = ip;
-                OBoundMethod* bound =
-                    bindmethod(vm, instance->oclass, property_name, receiver);
-                if(unlikely(bound == NULL)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                *(vm->sp - 1) = OBJ_VAL(bound);
-                BREAK;
-            }
-            {
-                // Short and long instructions have identical code
-                Int bcp; // Bytecode parameter
-                CASE(OP_DEFINE_GLOBAL)
-                {
-                    bcp = READ_BYTE();
-                    goto define_global_fin;
-                }
-                CASE(OP_DEFINE_GLOBALL)
-                {
-                    bcp = READ_BYTEL();
-                    goto define_global_fin;
-                }
-            define_global_fin:;
-                {
-                    if(unlikely(!veq(vm->globvals[bcp].value, EMPTY_VAL))) {
-                        frame->ip = ip;
-                        GLOBALVAR_REDEFINITION_ERR(vm, globalname(vm, bcp)->storage);
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    vm->globvals[bcp].value = *stackpeek(0);
-                    pop(vm);
-                    BREAK;
-                }
-                CASE(OP_GET_GLOBAL)
-                {
-                    bcp = READ_BYTE();
-                    goto get_global_fin;
-                }
-                CASE(OP_GET_GLOBALL)
-                {
-                    bcp = READ_BYTEL();
-                    goto get_global_fin;
-                }
-            get_global_fin:;
-                {
-                    Variable* global = &vm->globvals[bcp];
-                    if(unlikely(IS_UNDEFINED(global->value))) {
-                        frame->ip = ip;
-                        UNDEFINED_GLOBAL_ERR(vm, globalname(vm, bcp)->storage);
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    push(vm, global->value);
-                    BREAK;
-                }
-                CASE(OP_SET_GLOBAL)
-                {
-                    bcp = READ_BYTE();
-                    goto set_global_fin;
-                }
-                CASE(OP_SET_GLOBALL)
-                {
-                    bcp = READ_BYTEL();
-                    goto set_global_fin;
-                }
-            set_global_fin:;
-                {
-                    Variable* global = &vm->globvals[bcp];
-                    if(unlikely(IS_UNDEFINED(global->value))) {
-                        frame->ip = ip;
-                        UNDEFINED_GLOBAL_ERR(vm, globalname(vm, bcp)->storage);
-                        return INTERPRET_RUNTIME_ERROR;
-                    } else if(unlikely(VAR_CHECK(global, VAR_FIXED_BIT))) {
-                        frame->ip     = ip;
-                        OString* name = globalname(vm, bcp);
-                        VARIABLE_FIXED_ERR(vm, name->len, name->storage);
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    global->value = pop(vm);
-                    BREAK;
-                }
-                CASE(OP_GET_LOCAL)
-                {
-                    bcp = READ_BYTE();
-                    goto get_local_fin;
-                }
-                CASE(OP_GET_LOCALL)
-                {
-                    bcp = READ_BYTEL();
-                    goto get_local_fin;
-                }
-            get_local_fin:;
-                {
-                    push(vm, frame->sp[bcp]);
-                    BREAK;
-                }
-                CASE(OP_SET_LOCAL)
-                {
-                    bcp = READ_BYTE();
-                    goto set_local_fin;
-                }
-                CASE(OP_SET_LOCALL)
-                {
-                    bcp = READ_BYTEL();
-                    goto set_local_fin;
-                }
-            set_local_fin:;
-                {
-                    frame->sp[bcp] = pop(vm);
-                    BREAK;
-                }
-                CASE(OP_TOPRET) // return from script
-                {
-                    HashTable_insert(
-                        vm,
-                        &vm->loaded,
-                        OBJ_VAL(FFN(frame)->name),
-                        TRUE_VAL);
-                    goto ret_fin;
-                }
-                CASE(OP_RET) // function return
-                {
-                ret_fin:;
-                    Int retcnt = vm->sp - Array_VRef_pop(&vm->retstart);
-                    Int pushc;
-                    if(frame->retcnt == 0) {
-                        pushc         = 0;
-                        frame->retcnt = retcnt;
-                    } else pushc = frame->retcnt - retcnt;
-                    if(pushc < 0) popn(vm, sabs(pushc));
-                    else pushn(vm, pushc, NIL_VAL);
-                    ASSERT(vm->temp.len == 0, "Temporary array must be empty.");
-                    for(Int returns = frame->retcnt; returns--;) {
-                        Array_Value_push(&vm->temp, *stackpeek(0));
-                        pop(vm);
-                    }
-                    closeupval(vm, frame->sp);
-                    vm->fc--;
-                    if(vm->fc == 0) { // end of main script
-                        popn(vm, vm->sp - vm->stack);
-                        return INTERPRET_OK;
-                    }
-                    vm->sp = frame->sp;
-                    while(vm->temp.len > 0)
-                        push(vm, Array_Value_pop(&vm->temp));
-                    ASSERT(vm->temp.len == 0, "Temporary array must be empty.");
-                    frame = &vm->frames[vm->fc - 1];
-                    ip    = frame->ip;
-                    BREAK;
-                }
-            }
-            CASE(OP_JMP_IF_FALSE)
-            {
-                UInt skip_offset  = READ_BYTEL();
-                ip               += ((Byte)ISFALSEY(*stackpeek(0)) * skip_offset);
-                BREAK;
-            }
-            CASE(OP_JMP_IF_FALSE_POP)
-            {
-                UInt skip_offset  = READ_BYTEL();
-                ip               += ISFALSEY(*stackpeek(0)) * skip_offset;
-                pop(vm);
-                BREAK;
-            }
-            CASE(OP_JMP_IF_FALSE_OR_POP)
-            {
-                UInt skip_offset = READ_BYTEL();
-                if(ISFALSEY(*stackpeek(0))) ip += skip_offset;
-                else pop(vm);
-                BREAK;
-            }
-            CASE(OP_JMP_IF_FALSE_AND_POP)
-            {
-                UInt skip_offset = READ_BYTEL();
-                if(ISFALSEY(*stackpeek(0))) {
-                    ip += skip_offset;
-                    pop(vm);
-                }
-                BREAK;
-            }
-            CASE(OP_JMP)
-            {
-                UInt skip_offset  = READ_BYTEL();
-                ip               += skip_offset;
-                BREAK;
-            }
-            CASE(OP_JMP_AND_POP)
-            {
-                UInt skip_offset  = READ_BYTEL();
-                ip               += skip_offset;
-                pop(vm);
-                BREAK;
-            }
-            CASE(OP_LOOP)
-            {
-                UInt offset  = READ_BYTEL();
-                ip          -= offset;
-                BREAK;
-            }
-            CASE(OP_CLOSURE)
-            {
-                OFunction* fn      = AS_FUNCTION(READ_CONSTANT());
-                OClosure*  closure = OClosure_new(vm, fn);
-                push(vm, OBJ_VAL(closure));
-                for(UInt i = 0; i < closure->upvalc; i++) {
-                    Byte local = READ_BYTE();
-                    Byte flags = READ_BYTE();
-                    UInt idx   = READ_BYTEL();
-                    if(local) closure->upvals[i] = captureupval(vm, frame->sp + idx);
-                    else closure->upvals[i] = frame->closure->upvals[idx];
-                    closure->upvals[i]->closed.flags = flags;
-                }
-                BREAK;
-            }
-            CASE(OP_GET_UPVALUE)
-            {
-                UInt idx = READ_BYTEL();
-                push(vm, *frame->closure->upvals[idx]->location);
-                BREAK;
-            }
-            CASE(OP_SET_UPVALUE)
-            {
-                UInt      idx   = READ_BYTEL();
-                OUpvalue* upval = frame->closure->upvals[idx];
-                if(unlikely(VAR_CHECK(&upval->closed, VAR_FIXED_BIT))) {
-                    frame->ip      = ip;
-                    OString* gname = globalname(vm, idx);
-                    VARIABLE_FIXED_ERR(vm, gname->len, gname->storage);
-                    runerror(vm, "Can't assign to a variable declared as 'fixed'.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                *upval->location = pop(vm);
-                BREAK;
-            }
-            CASE(OP_CLOSE_UPVAL)
-            {
-                closeupval(vm, vm->sp - 1);
-                pop(vm);
-                BREAK;
-            }
-            CASE(OP_CLOSE_UPVALN)
-            {
-                UInt last = READ_BYTEL();
-                closeupval(vm, vm->sp - last);
-                popn(vm, last);
-                BREAK;
-            }
-            CASE(OP_CLASS)
-            {
-                push(vm, OBJ_VAL(OClass_new(vm, READ_STRING())));
-                BREAK;
-            }
-            CASE(OP_INDEX)
-            {
-                Value receiver = *stackpeek(1);
-                Value key      = *stackpeek(0);
-                if(unlikely(!IS_INSTANCE(receiver))) {
-                    frame->ip = ip;
-                    INDEX_RECEIVER_ERR(vm, vtostr(vm, receiver)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                } else if(unlikely(!IS_STRING(key))) {
-                    frame->ip = ip;
-                    INVALID_INDEX_ERR(vm);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // @TODO: Fix this up when overloading gets implemented
-                Value      value;
-                OInstance* instance = AS_INSTANCE(receiver);
-                if(HashTable_get(&instance->fields, key, &value)) {
-                    popn(vm, 2); // Pop key and receiver
-                    push(vm, value); // Push the field value
-                    BREAK;
-                }
-                frame->ip           = ip;
-                OBoundMethod* bound = bindmethod(vm, instance->oclass, key, receiver);
-                if(unlikely(bound == NULL)) return INTERPRET_RUNTIME_ERROR;
-                popn(vm, 2); // Pop key and receiver
-                push(vm, OBJ_VAL(bound)); // Push bound method
-                BREAK;
-            }
-            CASE(OP_SET_INDEX)
-            {
-                Value receiver = *stackpeek(2);
-                Value property = *stackpeek(1);
-                Value field    = *stackpeek(0);
-                if(unlikely(!IS_INSTANCE(receiver))) {
-                    frame->ip = ip;
-                    INDEX_RECEIVER_ERR(vm, vtostr(vm, receiver)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                } else if(unlikely(!IS_STRING(property))) {
-                    frame->ip = ip;
-                    INVALID_INDEX_ERR(vm);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // @TODO: Fix this up when overloading gets implemented
-                HashTable_insert(vm, &AS_INSTANCE(receiver)->fields, property, field);
-                popn(vm, 3);
-                push(vm, field);
-                BREAK;
-            }
-            CASE(OP_INVOKE_INDEX)
-            {
-                Int retcnt = READ_BYTEL();
-                Int argc   = vm->sp - Array_VRef_pop(&vm->callstart);
-                frame->ip  = ip;
-                if(unlikely(!invokeindex(vm, *stackpeek(argc), argc + 1, retcnt)))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm->frames[vm->fc - 1];
-                ip    = frame->ip;
-                BREAK;
-            }
-            CASE(OP_OVERLOAD)
-            {
-                OClass* oclass = AS_CLASS(*stackpeek(1));
-                // Right now the only thing that can be overloaded
-                // is class initializer, so this parameter is not useful,
-                // but if the operator overloading gets implemented
-                // this will actually be index into the array of
-                // overload-able methods/operators.
-                Byte opn = READ_BYTE();
-                UNUSED(opn);
-                oclass->overloaded = AS_CLOSURE(*stackpeek(0));
-                ASSERT(*ip == OP_METHOD, "Expected 'OP_METHOD'.");
-                BREAK;
-            }
-            CASE(OP_INHERIT)
-            {
-                ASSERT(IS_CLASS(*stackpeek(0)), "subclass must be class.");
-                OClass* subclass   = AS_CLASS(*stackpeek(0));
-                Value   superclass = *stackpeek(1);
-                if(unlikely(!IS_CLASS(superclass))) {
-                    frame->ip = ip;
-                    INHERIT_ERR(
-                        vm,
-                        otostr(vm, (O*)subclass)->storage,
-                        vtostr(vm, superclass)->storage);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                HashTable_into(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
-                subclass->overloaded = AS_CLASS(superclass)->overloaded;
-                pop(vm); // pop subclass
-                BREAK;
-            }
-            CASE(OP_FOREACH_PREP)
-            {
-                Int vars = READ_BYTEL();
-                memcpy(vm->sp, stackpeek(2), 3 * sizeof(Value));
-                vm->sp    += 3;
-                frame->ip  = ip;
-                if(unlikely(!vcall(vm, *stackpeek(2), 2, vars)))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm->frames[vm->fc - 1];
-                ip    = frame->ip;
-                BREAK;
-            }
-            CASE(OP_FOREACH)
-            {
-                Int vars         = READ_BYTEL();
-                *stackpeek(vars) = *stackpeek(vars - 1); // cntlvar
-                ASSERT(*ip == OP_JMP, "Expect 'OP_JMP'.");
-                if(!IS_NIL(*stackpeek(vars))) ip += 4;
-                BREAK;
-            }
-            CASE(OP_CALLSTART)
-            {
-                Array_VRef_push(&vm->callstart, vm->sp);
-                BREAK;
-            }
-            CASE(OP_RETSTART)
-            {
-                Array_VRef_push(&vm->retstart, vm->sp);
-                BREAK;
-            }
+    #include "vmops.h"
         }
     }
 
     unreachable;
+#endif
 
-#undef READ_BYTE
-#undef READ_BYTEL
+#undef READ_OP
+#undef READ_ARG
+#undef READ_EXT
 #undef READ_CONSTANT
 #undef READ_CONSTANTL
 #undef READ_STRING
 #undef READ_STRINGL
+#undef READ_CACHE
+#undef READ_LOOP
+#undef VARCNT
+#undef RK
+#undef REGISTER_SET
+#undef SP
+#undef SAVE_SP
+#undef LOAD_SP
+#undef PEEK
+#undef PUSH
+#undef POP
+#undef POPN
+#undef CONCAT
+#undef JUMP
+#undef LABEL
+#undef OPFN
+#undef BCIP
+#undef SAVE_IP
+#undef LOAD_IP
+#undef PATCH
+#undef QUICKEN
+#undef UNQUICKEN
+#undef REGISTER_OP
+#undef REGISTER_JMP
+#undef JIT_ENTER
+#undef OPTABLE
+#undef OPHANDLER
 #undef DISPATCH
 #undef CASE
 #undef BREAK
@@ -1140,26 +1186,34 @@ InterpretResult interpret(VM* vm, const char* source, const char* path)
     Value     name    = OBJ_VAL(OString_from(vm, path, strlen(path)));
     OClosure* closure = compile(vm, source, name);
     if(closure == NULL) return INTERPRET_COMPILE_ERROR;
-    fncall(vm, closure, 0, 1);
-    return run(vm);
+    InterpretResult result = INTERPRET_RUNTIME_ERROR;
+    if(fncall(vm, closure, 0, 1)) result = run(vm);
+    closeupval(vm, vm->stack); // in case of runtime error
+    vm->fc = 0;
+    stack_reset(vm);
+    shrinkstacks(vm);
+    return result;
 }
 
 void VM_free(VM* vm)
 {
     if(vm == NULL) return;
+#ifdef S_OPCODE_PAIRS
+    oppairs_dump();
+#endif
     HashTable_free(vm, &vm->loaded);
     HashTable_free(vm, &vm->globids);
     GARRAY_FREE(vm);
     GSARRAY_FREE(vm);
-    Array_Value_free(&vm->temp, NULL);
-    Array_VRef_free(&vm->callstart, NULL);
-    Array_VRef_free(&vm->retstart, NULL);
     HashTable_free(vm, &vm->strings);
     O* next;
     for(O* head = vm->objects; head != NULL; head = next) {
         next = onext(head);
         ofree(vm, head);
     }
+    FREE(vm, vm->frames);
+    FREE(vm, vm->stack);
+    FREE(vm, vm->upvals);
     FREE(vm, vm);
 }
 
@@ -8,11 +8,13 @@
 #include "skconf.h"
 #include "value.h"
 
-// Max depth of CallFrames
-#define VM_FRAMES_MAX S_CALLFRAMES_MAX
+// Initial and max depth of CallFrames
+#define VM_FRAMES_INIT S_CALLFRAMES_INIT
+#define VM_FRAMES_MAX  S_CALLFRAMES_MAX
 
-// Max stack size
-#define VM_STACK_MAX ((Int)(S_STACK_MAX / sizeof(Value)))
+// Initial and max stack size
+#define VM_STACK_INIT ((Int)(S_STACK_INIT / sizeof(Value)))
+#define VM_STACK_MAX  ((Int)(S_STACK_MAX / sizeof(Value)))
 
 
 
@@ -20,7 +22,7 @@
 
 typedef struct {
     OClosure* closure; /* Function or Closure */
-    Byte*     ip; /* Top of the CallFrame */
+    Inst*     ip; /* Top of the CallFrame */
     Value*    sp; /* Relative stack pointer */
     Int       retcnt; /* Expected value return count */
 } CallFrame;
@@ -79,26 +81,26 @@ bool            fncall(VM* vm, OClosure* callee, Int argc, Int retcnt);
 
 
 ARRAY_NEW(Array_ORef, O*);
-ARRAY_NEW(Array_VRef, Value*);
 
 struct VM {
     Config      config; // user configuration
     HashTable   loaded; // loaded scripts
     Value       script; // current script name
     Function*   F; // function state
-    CallFrame   frames[VM_FRAMES_MAX];
+    CallFrame*  frames; // call frames
     Int         fc; // frame count
-    Value       stack[VM_STACK_MAX];
+    Int         fcap; // frames capacity
+    Value*      stack; // value stack
     Value*      sp; // stack pointer
-    Array_VRef  callstart;
-    Array_VRef  retstart;
+    Int         stackcap; // stack capacity (in values)
+    Int         mulretc; // count of values returned by last call or '...'
     HashTable   globids; // global variable names
     Variable*   globvals; // global variable values
     UInt        globlen; // global variable count
     UInt        globcap; // global variable array size
-    Array_Value temp; // temporary return values
     HashTable   strings; // interned strings (weak refs)
-    OUpvalue*   open_upvals; // closure values
+    OUpvalue**  upvals; // open upvalues indexed by stack slot (NULL if none)
+    Value*      upvaltop; // one past the highest slot with an open upvalue
     OString*    statics[SS_SIZE]; // static strings
     O*          objects; // list of all allocated objects
     O**         gray_stack; // tricolor gc (stores marked objects)
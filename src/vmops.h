@@ -0,0 +1,950 @@
+/*
+ * Opcode handlers of the interpreter, this file is not a standalone
+ * header, 'vmachine.c' includes it either inside of the 'run' loop
+ * (CASE is a label or a switch case) or at file scope where each
+ * CASE opens a separate handler function ('S_TAILCALL').
+ * BREAK dispatches the next instruction, JUMP continues in the
+ * handler of another opcode.
+ */
+
+CASE(OP_TRUE)
+{
+    PUSH(BOOL_VAL(true));
+    BREAK;
+}
+CASE(OP_FALSE)
+{
+    PUSH(BOOL_VAL(false));
+    BREAK;
+}
+CASE(OP_NIL)
+{
+    PUSH(NIL_VAL);
+    BREAK;
+}
+CASE(OP_NILN)
+{
+    for(UInt n = READ_ARG(); n > 0; n--)
+        PUSH(NIL_VAL);
+    BREAK;
+}
+CASE(OP_NEG)
+{
+    Value val = *PEEK(0);
+    if(unlikely(!IS_NUMBER(val))) {
+        SAVE_IP();
+        UNARYNEG_ERR(vm, vtostr(vm, val)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    *PEEK(0) = (IS_INT(val) && AS_INT(val) != INT32_MIN)
+                        ? INT_VAL(-AS_INT(val))
+                        : NUMBER_VAL(-AS_NUMBER(val));
+    BREAK;
+}
+CASE(OP_ADD)
+{
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    if(IS_NUMBER(b) && IS_NUMBER(a)) QUICKEN(1, OP_ADD_NUM);
+    else if(IS_STRING(b) && IS_STRING(a)) QUICKEN(1, OP_ADD_STR);
+    JUMP(OP_ADD_ANY, add_any);
+}
+CASE(OP_ADD_ANY)
+{
+    LABEL(add_any);
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    if(IS_NUMBER(b) && IS_NUMBER(a)) {
+        NUM_ARITH(BINARY_SET, a, b, +, __builtin_add_overflow, unreachable);
+    } else if(IS_STRING(b) && IS_STRING(a)) {
+        CONCAT(PUSH, a, b);
+    } else {
+        SAVE_IP();
+        ADD_OPERATOR_ERR(vm, a, b);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    BREAK;
+}
+CASE(OP_ADD_NUM)
+{
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    NUM_ARITH(BINARY_SET, a, b, +, __builtin_add_overflow, UNQUICKEN(1, OP_ADD_ANY));
+    BREAK;
+}
+CASE(OP_ADD_STR)
+{
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    if(unlikely(!IS_STRING(b) || !IS_STRING(a))) UNQUICKEN(1, OP_ADD_ANY);
+    CONCAT(PUSH, a, b);
+    BREAK;
+}
+CASE(OP_SUB)
+{
+    BINARY_ARITH(-, __builtin_sub_overflow);
+    BREAK;
+}
+CASE(OP_MUL)
+{
+    BINARY_ARITH(*, __builtin_mul_overflow);
+    BREAK;
+}
+CASE(OP_MOD)
+{
+    BINARY_OP(
+        %,
+        (IS_INT(a) && IS_INT(b) && AS_INT(b) > 0)
+            ? INT_VAL(AS_INT(a) % AS_INT(b))
+            : NUMBER_VAL(sfmod(AS_NUMBER(a), AS_NUMBER(b))));
+    BREAK;
+}
+CASE(OP_POW)
+{
+    int32_t r;
+    BINARY_OP(
+        ^,
+        (IS_INT(a) && IS_INT(b) && ipow(AS_INT(a), AS_INT(b), &r))
+            ? INT_VAL(r)
+            : NUMBER_VAL(spow(AS_NUMBER(a), AS_NUMBER(b))));
+    BREAK;
+}
+CASE(OP_DIV)
+{
+    BINARY_OP(/, NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)));
+    BREAK;
+}
+CASE(OP_NOT)
+{
+    *(SP - 1) = BOOL_VAL(ISFALSEY(*PEEK(0)));
+    BREAK;
+}
+CASE(OP_VALIST)
+{
+    OFunction* fn    = FFN(frame);
+    UInt       vacnt = READ_ARG();
+    vacnt            = (vacnt == 0 ? fn->vacnt : vacnt);
+    vm->mulretc      = vacnt;
+    SAVE_SP();
+    if(unlikely(!stackfits(vm, vacnt + SPREAD_EXTRA)) &&
+       !growstack(vm, vacnt + SPREAD_EXTRA))
+    {
+        SAVE_IP();
+        STACK_LIMIT_ERR(vm, VM_STACK_MAX);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    LOAD_SP();
+    for(UInt i = 1; i <= vacnt; i++) {
+        Value* next = frame->sp + fn->arity + i;
+        PUSH(*next);
+    }
+    BREAK;
+}
+CASE(OP_NOT_EQUAL)
+{
+    Value b = POP();
+    Value a = POP();
+    PUSH(BOOL_VAL(!veq(a, b)));
+    BREAK;
+}
+CASE(OP_EQUAL)
+{
+    Value b = POP();
+    Value a = POP();
+    PUSH(BOOL_VAL(veq(a, b)));
+    BREAK;
+}
+CASE(OP_EQ)
+{
+    Value b = POP();
+    Value a = *PEEK(0);
+    PUSH(BOOL_VAL(veq(a, b)));
+    BREAK;
+}
+CASE(OP_GREATER)
+{
+    BINARY_OP(>, BOOL_VAL(NUM_CMP(a, b, >)));
+    BREAK;
+}
+CASE(OP_GREATER_EQUAL)
+{
+    BINARY_OP(>=, BOOL_VAL(NUM_CMP(a, b, >=)));
+    BREAK;
+}
+CASE(OP_LESS)
+{
+    BINARY_OP(<, BOOL_VAL(NUM_CMP(a, b, <)));
+    BREAK;
+}
+CASE(OP_LESS_EQUAL)
+{
+    BINARY_OP(<=, BOOL_VAL(NUM_CMP(a, b, <=)));
+    BREAK;
+}
+CASE(OP_ADDRK)
+{
+    Value a = RK(GET_B(ins));
+    Value b = RK(GET_C(ins));
+    if(IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(1, OP_ADDRK_NUM);
+    else if(IS_STRING(a) && IS_STRING(b)) QUICKEN(1, OP_ADDRK_STR);
+    JUMP(OP_ADDRK_ANY, addrk_any);
+}
+CASE(OP_ADDRK_ANY)
+{
+    LABEL(addrk_any);
+    Byte  ra = GET_A(ins);
+    Value a  = RK(GET_B(ins));
+    Value b  = RK(GET_C(ins));
+    if(IS_NUMBER(a) && IS_NUMBER(b)) {
+        NUM_ARITH(REGISTER_RA, a, b, +, __builtin_add_overflow, unreachable);
+    } else if(IS_STRING(a) && IS_STRING(b)) {
+        PUSH(a);
+        PUSH(b);
+        CONCAT(REGISTER_RA, a, b);
+    } else {
+        SAVE_IP();
+        ADD_OPERATOR_ERR(vm, a, b);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    BREAK;
+}
+CASE(OP_ADDRK_NUM)
+{
+    Byte  ra = GET_A(ins);
+    Value a  = RK(GET_B(ins));
+    Value b  = RK(GET_C(ins));
+    NUM_ARITH(REGISTER_RA, a, b, +, __builtin_add_overflow, UNQUICKEN(1, OP_ADDRK_ANY));
+    BREAK;
+}
+CASE(OP_ADDRK_STR)
+{
+    Byte  ra = GET_A(ins);
+    Value a  = RK(GET_B(ins));
+    Value b  = RK(GET_C(ins));
+    if(unlikely(!IS_STRING(a) || !IS_STRING(b))) UNQUICKEN(1, OP_ADDRK_ANY);
+    PUSH(a);
+    PUSH(b);
+    CONCAT(REGISTER_RA, a, b);
+    BREAK;
+}
+CASE(OP_SUBRK)
+{
+    REGISTER_ARITH(-, __builtin_sub_overflow);
+    BREAK;
+}
+CASE(OP_MULRK)
+{
+    REGISTER_ARITH(*, __builtin_mul_overflow);
+    BREAK;
+}
+CASE(OP_DIVRK)
+{
+    REGISTER_OP(/, NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)));
+    BREAK;
+}
+CASE(OP_NOT_EQUALRK)
+{
+    Byte  ra = GET_A(ins);
+    Value a  = RK(GET_B(ins));
+    Value b  = RK(GET_C(ins));
+    REGISTER_SET(ra, BOOL_VAL(!veq(a, b)));
+    BREAK;
+}
+CASE(OP_EQUALRK)
+{
+    Byte  ra = GET_A(ins);
+    Value a  = RK(GET_B(ins));
+    Value b  = RK(GET_C(ins));
+    REGISTER_SET(ra, BOOL_VAL(veq(a, b)));
+    BREAK;
+}
+CASE(OP_GREATERRK)
+{
+    REGISTER_OP(>, BOOL_VAL(NUM_CMP(a, b, >)));
+    BREAK;
+}
+CASE(OP_GREATER_EQUALRK)
+{
+    REGISTER_OP(>=, BOOL_VAL(NUM_CMP(a, b, >=)));
+    BREAK;
+}
+CASE(OP_LESSRK)
+{
+    REGISTER_OP(<, BOOL_VAL(NUM_CMP(a, b, <)));
+    BREAK;
+}
+CASE(OP_LESS_EQUALRK)
+{
+    REGISTER_OP(<=, BOOL_VAL(NUM_CMP(a, b, <=)));
+    BREAK;
+}
+CASE(OP_NOT_EQUALRK_JMP)
+{
+    UInt  skip  = READ_ARG();
+    Inst  ext   = READ_EXT();
+    Value a     = RK(GET_B(ext));
+    Value b     = RK(GET_C(ext));
+    ip         += veq(a, b) * skip;
+    BREAK;
+}
+CASE(OP_EQUALRK_JMP)
+{
+    UInt  skip  = READ_ARG();
+    Inst  ext   = READ_EXT();
+    Value a     = RK(GET_B(ext));
+    Value b     = RK(GET_C(ext));
+    ip         += !veq(a, b) * skip;
+    BREAK;
+}
+CASE(OP_GREATERRK_JMP)
+{
+    REGISTER_JMP(>);
+    BREAK;
+}
+CASE(OP_GREATER_EQUALRK_JMP)
+{
+    REGISTER_JMP(>=);
+    BREAK;
+}
+CASE(OP_LESSRK_JMP)
+{
+    REGISTER_JMP(<);
+    BREAK;
+}
+CASE(OP_LESS_EQUALRK_JMP)
+{
+    REGISTER_JMP(<=);
+    BREAK;
+}
+// Fused instructions ('Chunk_optimize') skip the opcode of the second
+// instruction, if the operands of the addition are not numbers only the
+// first instruction executes and 'OP_ADD_NUM' runs on its own.
+CASE(OP_CONST_ADD_NUM)
+{
+    Value b = READ_CONSTANT();
+    Value a = *PEEK(0);
+    NUM_ARITH(FUSED_SET, a, b, +, __builtin_add_overflow, PUSH(b));
+    BREAK;
+}
+CASE(OP_GET_LOCAL_ADD_NUM)
+{
+    Value b = frame->sp[READ_ARG()];
+    Value a = *PEEK(0);
+    NUM_ARITH(FUSED_SET, a, b, +, __builtin_add_overflow, PUSH(b));
+    BREAK;
+}
+CASE(OP_ADD_NUM_SET_LOCAL)
+{
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    NUM_ARITH(LOCAL_SET, a, b, +, __builtin_add_overflow, UNQUICKEN(1, OP_ADD_ANY));
+    BREAK;
+}
+CASE(OP_SUB_SET_LOCAL)
+{
+    Value b = *PEEK(0);
+    Value a = *PEEK(1);
+    NUM_ARITH(LOCAL_SET, a, b, -, __builtin_sub_overflow, BINARYOP_FAIL(-));
+    BREAK;
+}
+CASE(OP_POP)
+{
+    POPN(1);
+    BREAK;
+}
+CASE(OP_POPN)
+{
+    POPN(READ_ARG());
+    BREAK;
+}
+CASE(OP_CONST)
+{
+    PUSH(READ_CONSTANT());
+    BREAK;
+}
+CASE(OP_CALL)
+{
+    Int retcnt = READ_ARG();
+    Int argc   = VARCNT(READ_EXT());
+    SAVE_IP();
+    if(unlikely(!vcall(vm, *PEEK(argc), argc, retcnt)))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_TAILCALL)
+{
+    Int argc   = VARCNT(READ_EXT()); // 'retcnt' is inherited from the caller
+    Int fc     = vm->fc;
+    SAVE_IP();
+    if(unlikely(!vcall(vm, *PEEK(argc), argc, frame->retcnt)))
+        return INTERPRET_RUNTIME_ERROR;
+    if(vm->fc > fc) { // otherwise callee returned, 'OP_RET' follows
+        tailframe(vm);
+        frame = &vm->frames[vm->fc - 1];
+        LOAD_IP();
+        JIT_ENTER();
+    } else LOAD_SP();
+    BREAK;
+}
+CASE(OP_METHOD)
+{
+    Value   methodname = READ_CONSTANT();
+    Value   method     = *PEEK(0); // OFunction or OClosure
+    OClass* oclass     = AS_CLASS(*PEEK(1));
+    SAVE_SP();
+    OClass_setmethod(vm, oclass, methodname, AS_CLOSURE(method));
+    POPN(1); // pop method
+    BREAK;
+}
+CASE(OP_INVOKE)
+{
+    Value        methodname = READ_CONSTANT();
+    Int          retcnt     = READ_EXT();
+    Int          argc       = VARCNT(READ_EXT());
+    InlineCache* cache      = READ_CACHE();
+    SAVE_IP();
+    if(unlikely(!invoke(vm, methodname, argc, retcnt, cache)))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_TAILINVOKE)
+{
+    Value methodname  = READ_CONSTANT();
+    ip               += 1; // 'retcnt' is inherited from the caller
+    Int          argc  = VARCNT(READ_EXT());
+    InlineCache* cache = READ_CACHE();
+    Int          fc    = vm->fc;
+    SAVE_IP();
+    if(unlikely(!invoke(vm, methodname, argc, frame->retcnt, cache)))
+        return INTERPRET_RUNTIME_ERROR;
+    if(vm->fc > fc) {
+        tailframe(vm);
+        frame = &vm->frames[vm->fc - 1];
+        LOAD_IP();
+        JIT_ENTER();
+    } else LOAD_SP();
+    BREAK;
+}
+CASE(OP_GET_SUPER)
+{
+    Value        methodname = READ_CONSTANT();
+    InlineCache* cache      = READ_CACHE();
+    OClass*      superclass = AS_CLASS(POP());
+    SAVE_IP();
+    Int slot = superslot(vm, superclass, methodname, cache);
+    if(unlikely(slot < 0)) return INTERPRET_RUNTIME_ERROR;
+    OBoundMethod* bound =
+        OBoundMethod_new(vm, *PEEK(0), superclass->mtable[slot]);
+    SP[-1] = OBJ_VAL(bound);
+    BREAK;
+}
+CASE(OP_INVOKE_SUPER)
+{
+    Value methodname = READ_CONSTANT();
+    ASSERT(IS_CLASS(*PEEK(0)), "superclass must be class.");
+    OClass*      superclass = AS_CLASS(POP());
+    Int          retcnt     = READ_EXT();
+    Int          argc       = VARCNT(READ_EXT());
+    InlineCache* cache      = READ_CACHE();
+    SAVE_IP();
+    if(unlikely(
+           !invokefrom(vm, superclass, methodname, argc, retcnt, cache)))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_SET_PROPERTY)
+{
+    Value        property_name = READ_CONSTANT();
+    InlineCache* cache         = READ_CACHE();
+    Value        receiver      = *PEEK(1);
+    if(unlikely(!IS_INSTANCE(receiver))) {
+        SAVE_IP();
+        NOT_INSTANCE_ERR(vm, vtostr(vm, receiver)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    OInstance* instance = AS_INSTANCE(receiver);
+    ICEntry*   entry    = IC_find(cache, instance->shape);
+    if(likely(entry != NULL)) {
+        if(entry->next == NULL) {
+            instance->slots[entry->slot] = *PEEK(0);
+            POPN(2);
+            BREAK;
+        } else if(likely(instance->cap >= entry->next->len)) {
+            instance->slots[entry->slot] = *PEEK(0);
+            instance->shape              = entry->next;
+            POPN(2);
+            BREAK;
+        }
+    }
+    SAVE_IP();
+    OShape* shape = instance->shape;
+    OInstance_set(vm, instance, property_name, *PEEK(0));
+    if(entry == NULL)
+        IC_addfield(cache, shape, instance->shape, property_name);
+    POPN(2);
+    BREAK;
+}
+CASE(OP_GET_LOCAL_PROPERTY)
+{
+    PUSH(frame->sp[READ_ARG()]);
+    ins = MAKE_INS(OP_GET_PROPERTY, READ_EXT()); // property name
+    JUMP(OP_GET_PROPERTY, get_property_fin);
+}
+CASE(OP_GET_PROPERTY)
+{
+    LABEL(get_property_fin);
+    Value        property_name = READ_CONSTANT();
+    InlineCache* cache         = READ_CACHE();
+    Value        receiver      = *PEEK(0);
+    if(unlikely(!IS_INSTANCE(receiver))) {
+        SAVE_IP();
+        NOT_INSTANCE_ERR(vm, vtostr(vm, receiver)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    OInstance* instance = AS_INSTANCE(receiver);
+    ICEntry*   entry    = IC_find(cache, instance->shape);
+    SAVE_IP();
+    if(likely(entry != NULL)) {
+        Value property;
+        if(entry->method == NULL) property = instance->slots[entry->slot];
+        else
+            property =
+                OBJ_VAL(OBoundMethod_new(vm, receiver, entry->method));
+        *(SP - 1) = property;
+        BREAK;
+    }
+    Value property;
+    if(OInstance_get(instance, property_name, &property)) {
+        IC_addfield(cache, instance->shape, instance->shape, property_name);
+        *(SP - 1) = property;
+        BREAK;
+    }
+    OBoundMethod* bound =
+        bindmethod(vm, instance->oclass, property_name, receiver);
+    if(unlikely(bound == NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    IC_addmethod(cache, instance->shape, bound->method);
+    *(SP - 1) = OBJ_VAL(bound);
+    BREAK;
+}
+CASE(OP_DEFINE_GLOBAL)
+{
+    Int bcp = READ_ARG();
+    if(unlikely(!veq(vm->globvals[bcp].value, EMPTY_VAL))) {
+        SAVE_IP();
+        GLOBALVAR_REDEFINITION_ERR(vm, globalname(vm, bcp)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm->globvals[bcp].value = *PEEK(0);
+    POPN(1);
+    BREAK;
+}
+CASE(OP_GET_GLOBAL)
+{
+    Int       bcp    = READ_ARG();
+    Variable* global = &vm->globvals[bcp];
+    if(unlikely(IS_UNDEFINED(global->value))) {
+        SAVE_IP();
+        UNDEFINED_GLOBAL_ERR(vm, globalname(vm, bcp)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    PUSH(global->value);
+    BREAK;
+}
+CASE(OP_SET_GLOBAL)
+{
+    Int       bcp    = READ_ARG();
+    Variable* global = &vm->globvals[bcp];
+    if(unlikely(IS_UNDEFINED(global->value))) {
+        SAVE_IP();
+        UNDEFINED_GLOBAL_ERR(vm, globalname(vm, bcp)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    } else if(unlikely(VAR_CHECK(global, VAR_FIXED_BIT))) {
+        SAVE_IP();
+        OString* name = globalname(vm, bcp);
+        VARIABLE_FIXED_ERR(vm, name->len, name->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    global->value = POP();
+    BREAK;
+}
+CASE(OP_GET_LOCAL)
+{
+    PUSH(frame->sp[READ_ARG()]);
+    BREAK;
+}
+CASE(OP_SET_LOCAL)
+{
+    frame->sp[READ_ARG()] = POP();
+    BREAK;
+}
+CASE(OP_TOPRET) // return from script
+{
+    SAVE_SP();
+    HashTable_insert(
+        vm,
+        &vm->loaded,
+        OBJ_VAL(FFN(frame)->name),
+        TRUE_VAL);
+    JUMP(OP_RET, ret_fin);
+}
+CASE(OP_RET) // function return
+{
+    LABEL(ret_fin);
+    Int retcnt = VARCNT(READ_ARG());
+    Int want   = frame->retcnt;
+    if(want == 0) { // caller takes all, not covered by its 'maxstack'
+        want = retcnt;
+        // values are moved down to the callee slot
+        Int grow = want + SPREAD_EXTRA - (SP - frame->sp);
+        SAVE_SP();
+        if(unlikely(!stackfits(vm, grow)) && !growstack(vm, grow)) {
+            SAVE_IP();
+            STACK_LIMIT_ERR(vm, VM_STACK_MAX);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_SP();
+    }
+    Value* retv = SP - retcnt;
+    Value* dest = frame->sp; // callee slot
+    vm->mulretc = want;
+    closeupval(vm, dest);
+    vm->fc--;
+    if(vm->fc == 0) { // end of main script
+        vm->sp = vm->stack;
+        return INTERPRET_OK;
+    }
+    if(likely(retcnt == 1 && want == 1)) {
+        *dest  = *retv;
+        SP = dest + 1;
+    } else {
+        Int movec = (retcnt < want ? retcnt : want);
+        memmove(dest, retv, movec * sizeof(Value));
+        for(Value* nil = dest + movec; nil < dest + want; nil++)
+            *nil = NIL_VAL;
+        SP = dest + want;
+    }
+    SAVE_SP();
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_JMP_IF_FALSE)
+{
+    UInt skip_offset  = READ_ARG();
+    ip               += ((Byte)ISFALSEY(*PEEK(0)) * skip_offset);
+    BREAK;
+}
+CASE(OP_JMP_IF_FALSE_POP)
+{
+    UInt skip_offset  = READ_ARG();
+    ip               += ISFALSEY(*PEEK(0)) * skip_offset;
+    POPN(1);
+    BREAK;
+}
+CASE(OP_JMP_IF_FALSE_OR_POP)
+{
+    UInt skip_offset = READ_ARG();
+    if(ISFALSEY(*PEEK(0))) ip += skip_offset;
+    else POPN(1);
+    BREAK;
+}
+CASE(OP_JMP_IF_FALSE_AND_POP)
+{
+    UInt skip_offset = READ_ARG();
+    if(ISFALSEY(*PEEK(0))) {
+        ip += skip_offset;
+        POPN(1);
+    }
+    BREAK;
+}
+CASE(OP_JMP)
+{
+    UInt skip_offset  = READ_ARG();
+    ip               += skip_offset;
+    BREAK;
+}
+CASE(OP_JMP_AND_POP)
+{
+    UInt skip_offset  = READ_ARG();
+    ip               += skip_offset;
+    POPN(1);
+    BREAK;
+}
+CASE(OP_LOOP)
+{
+    UInt     offset  = READ_ARG();
+    HotLoop* loop    = READ_LOOP();
+    ip              -= offset;
+    if(unlikely(--loop->hotcount <= 0)) {
+        SAVE_SP();
+        frame->ip = hotloop(vm, frame, loop, BCIP(ip));
+        LOAD_IP();
+    }
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_FORPREP)
+{
+    UInt  skip    = READ_ARG();
+    Inst  ext     = READ_EXT();
+    Value counter = frame->sp[GET_B(ext)];
+    Value limit   = RK(GET_C(ext));
+    if(unlikely(!IS_NUMBER(counter) || !IS_NUMBER(limit))) {
+        SAVE_IP();
+        BINARYOP_ERR(vm, FOR_CMP(ext));
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    ip += !forcond(FOR_CMP(ext), AS_NUMBER(counter), AS_NUMBER(limit)) * skip;
+    BREAK;
+}
+CASE(OP_FORLOOP)
+{
+    UInt     offset   = READ_ARG();
+    Inst     ext      = READ_EXT();
+    HotLoop* loop     = READ_LOOP();
+    Value*   counter  = &frame->sp[GET_B(ext)];
+    Value    step     = RK(FOR_STEP(ext));
+    Value    limit    = RK(GET_C(ext));
+    int32_t  n;
+    bool     again;
+    if(IS_INTS(*counter, step) && IS_INT(limit) &&
+       !__builtin_add_overflow(AS_INT(*counter), AS_INT(step), &n))
+    {
+        *counter = INT_VAL(n);
+        again    = forcond(FOR_CMP(ext), n, AS_INT(limit));
+    } else if(IS_DOUBLE(*counter) && IS_DOUBLE(step) && IS_DOUBLE(limit)) {
+        double i = AS_DOUBLE(*counter) + AS_DOUBLE(step);
+        *counter = NUMBER_VAL(i);
+        again    = forcond(FOR_CMP(ext), i, AS_DOUBLE(limit));
+    } else {
+        double i = AS_NUMBER(*counter) + AS_NUMBER(step);
+        *counter = NUMBER_VAL(i);
+        again    = forcond(FOR_CMP(ext), i, AS_NUMBER(limit));
+    }
+    if(again) {
+        ip -= offset;
+        if(unlikely(--loop->hotcount <= 0)) {
+            SAVE_SP();
+            frame->ip = hotloop(vm, frame, loop, BCIP(ip));
+            LOAD_IP();
+        }
+        JIT_ENTER();
+    }
+    BREAK;
+}
+CASE(OP_CLOSURE)
+{
+    OFunction* fn      = AS_FUNCTION(READ_CONSTANT());
+    SAVE_SP();
+    OClosure*  closure = OClosure_new(vm, fn);
+    PUSH(OBJ_VAL(closure));
+    SAVE_SP(); // 'captureupval' allocates
+    for(UInt i = 0, u = 0, f = 0; i < closure->upvalc + closure->fixedc; i++) {
+        Inst upval = READ_EXT();
+        UInt idx   = GET_ARG(upval);
+        if(UPVAL_FLAGS(upval) & VAR_FIXED_BIT) { // copy the value
+            if(UPVAL_LOCAL(upval)) closure->fixed[f++] = frame->sp[idx];
+            else closure->fixed[f++] = frame->closure->fixed[idx];
+            continue;
+        }
+        if(UPVAL_LOCAL(upval))
+            closure->upvals[u] = captureupval(vm, frame->sp + idx);
+        else closure->upvals[u] = frame->closure->upvals[idx];
+        closure->upvals[u++]->closed.flags = UPVAL_FLAGS(upval);
+    }
+    BREAK;
+}
+CASE(OP_GET_FIXED)
+{
+    PUSH(frame->closure->fixed[READ_ARG()]);
+    BREAK;
+}
+CASE(OP_GET_UPVALUE)
+{
+    UInt idx = READ_ARG();
+    PUSH(*frame->closure->upvals[idx]->location);
+    BREAK;
+}
+CASE(OP_SET_UPVALUE)
+{
+    UInt      idx   = READ_ARG();
+    OUpvalue* upval = frame->closure->upvals[idx];
+    if(unlikely(VAR_CHECK(&upval->closed, VAR_FIXED_BIT))) {
+        SAVE_IP();
+        OString* gname = globalname(vm, idx);
+        VARIABLE_FIXED_ERR(vm, gname->len, gname->storage);
+        runerror(vm, "Can't assign to a variable declared as 'fixed'.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    *upval->location = POP();
+    BREAK;
+}
+CASE(OP_CLOSE_UPVAL)
+{
+    closeupval(vm, SP - 1);
+    POPN(1);
+    BREAK;
+}
+CASE(OP_CLOSE_UPVALN)
+{
+    UInt last = READ_ARG();
+    closeupval(vm, SP - last);
+    POPN(last);
+    BREAK;
+}
+CASE(OP_CLASS)
+{
+    SAVE_SP();
+    OClass* oclass = OClass_new(vm, READ_STRING());
+    PUSH(OBJ_VAL(oclass));
+    BREAK;
+}
+CASE(OP_INDEX)
+{
+    Value receiver = *PEEK(1);
+    Value key      = *PEEK(0);
+    if(unlikely(!IS_INSTANCE(receiver))) {
+        SAVE_IP();
+        INDEX_RECEIVER_ERR(vm, vtostr(vm, receiver)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    } else if(unlikely(!IS_STRING(key))) {
+        SAVE_IP();
+        INVALID_INDEX_ERR(vm);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    // @TODO: Fix this up when overloading gets implemented
+    Value      value;
+    OInstance* instance = AS_INSTANCE(receiver);
+    if(OInstance_get(instance, key, &value)) {
+        POPN(2); // Pop key and receiver
+        PUSH(value); // Push the field value
+        BREAK;
+    }
+    SAVE_IP();
+    OBoundMethod* bound = bindmethod(vm, instance->oclass, key, receiver);
+    if(unlikely(bound == NULL)) return INTERPRET_RUNTIME_ERROR;
+    POPN(2); // Pop key and receiver
+    PUSH(OBJ_VAL(bound)); // Push bound method
+    BREAK;
+}
+CASE(OP_SET_INDEX)
+{
+    Value receiver = *PEEK(2);
+    Value property = *PEEK(1);
+    Value field    = *PEEK(0);
+    if(unlikely(!IS_INSTANCE(receiver))) {
+        SAVE_IP();
+        INDEX_RECEIVER_ERR(vm, vtostr(vm, receiver)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    } else if(unlikely(!IS_STRING(property))) {
+        SAVE_IP();
+        INVALID_INDEX_ERR(vm);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    // @TODO: Fix this up when overloading gets implemented
+    SAVE_SP();
+    OInstance_set(vm, AS_INSTANCE(receiver), property, field);
+    POPN(3);
+    BREAK;
+}
+CASE(OP_INVOKE_INDEX)
+{
+    Int retcnt = READ_ARG();
+    Int argc   = VARCNT(READ_EXT());
+    SAVE_IP();
+    if(unlikely(!invokeindex(vm, *PEEK(argc), argc + 1, retcnt)))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_OVERLOAD)
+{
+    OClass* oclass = AS_CLASS(*PEEK(1));
+    // Right now the only thing that can be overloaded
+    // is class initializer, so this parameter is not useful,
+    // but if the operator overloading gets implemented
+    // this will actually be index into the array of
+    // overload-able methods/operators.
+    UInt opn = READ_ARG();
+    UNUSED(opn);
+    oclass->overloaded = AS_CLOSURE(*PEEK(0));
+    ASSERT(GET_OP(*BCIP(ip)) == OP_METHOD, "Expected 'OP_METHOD'.");
+    BREAK;
+}
+CASE(OP_INHERIT)
+{
+    ASSERT(IS_CLASS(*PEEK(0)), "subclass must be class.");
+    OClass* subclass   = AS_CLASS(*PEEK(0));
+    Value   superclass = *PEEK(1);
+    if(unlikely(!IS_CLASS(superclass))) {
+        SAVE_IP();
+        INHERIT_ERR(
+            vm,
+            otostr(vm, (O*)subclass)->storage,
+            vtostr(vm, superclass)->storage);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    SAVE_SP();
+    OClass_inherit(vm, subclass, AS_CLASS(superclass));
+    subclass->overloaded = AS_CLASS(superclass)->overloaded;
+    POPN(1); // pop subclass
+    BREAK;
+}
+CASE(OP_FOREACH_PREP)
+{
+    Int    vars = READ_ARG();
+    Value* iter = PEEK(2); // iterator, invariant state, control variable
+    if(IS_RANGE(*iter)) { // count in place and do 'OP_FOREACH' here
+        double i;
+        bool   more = ORange_next(AS_RANGE(*iter), iter[2], &i);
+        SP[0]   = (more ? INTNUM_VAL(i) : NIL_VAL);
+        for(Int k = 1; k < vars; k++)
+            SP[k] = NIL_VAL;
+        SP  += vars;
+        iter[2]  = iter[3]; // cntlvar
+        ASSERT(GET_OP(*BCIP(ip)) == OP_FOREACH, "Expect 'OP_FOREACH'.");
+        ip += 1 + more; // skip the loop exit 'OP_JMP' unless exhausted
+        BREAK;
+    }
+    if(IS_NATIVE(*iter) && AS_NATIVE(*iter)->next != NULL) { // no call frame
+        SAVE_SP();
+        if(unlikely(!AS_NATIVE(*iter)->next(vm, iter, SP, vars))) {
+            SAVE_IP();
+            runerror(vm, AS_CSTRING(*SP));
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        SP += vars;
+        BREAK;
+    }
+    memcpy(SP, PEEK(2), 3 * sizeof(Value));
+    SP    += 3;
+    SAVE_IP();
+    if(unlikely(!vcall(vm, *PEEK(2), 2, vars)))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->fc - 1];
+    LOAD_IP();
+    JIT_ENTER();
+    BREAK;
+}
+CASE(OP_FOREACH)
+{
+    Int vars         = READ_ARG();
+    *PEEK(vars) = *PEEK(vars - 1); // cntlvar
+    ASSERT(GET_OP(*BCIP(ip)) == OP_JMP, "Expect 'OP_JMP'.");
+    if(!IS_NIL(*PEEK(vars))) ip += 1;
+    BREAK;
+}
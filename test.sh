@@ -9,4 +9,9 @@ do
     else
         printf "\nTEST -> %s + PASSED" "$testfile"
     fi
+    if ! ./skooma --jit "$testfile" > /dev/null 2>&1; then
+        printf "\nTEST (jit) -> %s x FAILED" "$testfile"
+    else
+        printf "\nTEST (jit) -> %s + PASSED" "$testfile"
+    fi
 done